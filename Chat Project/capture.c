@@ -0,0 +1,86 @@
+#include "capture.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "logger.h"
+#include "server_stats.h"  // monotonicNs()
+
+#define CAPTURE_BUFFER_SIZE (1 << 20)  // Large stdio buffer: a record costs a memcpy, not a write
+
+static FILE* captureFile = NULL;
+static char* captureBuffer = NULL;
+static uint64_t captureStartNs = 0;
+static uint64_t capturedRecords = 0;
+
+int startCapture(const char* path) {
+    captureFile = fopen(path, "wb");
+    if (captureFile == NULL) {
+        return -1;
+    }
+    captureBuffer = malloc(CAPTURE_BUFFER_SIZE);
+    if (captureBuffer != NULL) {
+        setvbuf(captureFile, captureBuffer, _IOFBF, CAPTURE_BUFFER_SIZE);
+    }
+
+    struct CaptureHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CAPTURE_MAGIC;
+    header.recordSize = sizeof(struct CaptureRecord);
+    header.startTime = (int64_t)time(NULL);
+    if (fwrite(&header, sizeof(header), 1, captureFile) != 1) {
+        stopCapture();
+        return -1;
+    }
+    captureStartNs = monotonicNs();
+    capturedRecords = 0;
+    return 0;
+}
+
+void captureMessage(uint32_t connection, uint64_t arrivalNs, const struct Message* message) {
+    if (captureFile == NULL) {
+        return;
+    }
+
+    struct CaptureRecord record;
+    record.arrivalNs = (arrivalNs > captureStartNs) ? arrivalNs - captureStartNs : 0;
+    record.connection = connection;
+    record.reserved = 0;
+    record.message = *message;
+    if (fwrite(&record, sizeof(record), 1, captureFile) != 1) {
+        logMessage(LOG_ERROR, "Capture stopped, write failed: %s", strerror(errno));
+        stopCapture();
+        return;
+    }
+    capturedRecords++;
+}
+
+void stopCapture(void) {
+    if (captureFile == NULL) {
+        return;
+    }
+    if (fclose(captureFile) != 0) {
+        logMessage(LOG_ERROR, "Failed to close capture: %s", strerror(errno));
+    } else {
+        logMessage(LOG_INFO, "Captured %llu messages", (unsigned long long)capturedRecords);
+    }
+    captureFile = NULL;
+    free(captureBuffer);
+    captureBuffer = NULL;
+}
+
+FILE* openCapture(const char* path, struct CaptureHeader* header) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    if (fread(header, sizeof(*header), 1, file) != 1 || header->magic != CAPTURE_MAGIC
+        || header->recordSize != sizeof(struct CaptureRecord)) {
+        fclose(file);
+        errno = EINVAL;
+        return NULL;
+    }
+    return file;
+}
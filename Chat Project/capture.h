@@ -0,0 +1,62 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chat.h"
+
+#define CAPTURE_MAGIC 0x50414343u   ///< "CCAP" in little-endian, first field of a capture file
+
+/**
+ * Header written once at the start of a capture file.
+ */
+struct CaptureHeader {
+    uint32_t magic;        ///< CAPTURE_MAGIC
+    uint32_t recordSize;   ///< sizeof(struct CaptureRecord) of the writer, checked by readers
+    int64_t startTime;     ///< Wall-clock time the capture started, for reference
+};
+
+/**
+ * One inbound message as the server received it, before it was timestamped.
+ */
+struct CaptureRecord {
+    uint64_t arrivalNs;       ///< Arrival time, in ns since the start of the capture
+    uint32_t connection;      ///< Id of the sending connection, stable for its lifetime
+    uint32_t reserved;        ///< Zero
+    struct Message message;   ///< Message as received
+};
+
+/**
+ * Starts recording inbound messages to a capture file (truncated if it exists).
+ *
+ * @param path Capture file
+ * @return 0 on success, -1 on failure
+ */
+int startCapture(const char* path);
+
+/**
+ * Appends one message to the capture. Does nothing when no capture is running.
+ * Records are buffered; a write error stops the capture.
+ *
+ * @param connection Id of the sending connection
+ * @param arrivalNs monotonicNs() when the message was complete
+ * @param message Message as received
+ */
+void captureMessage(uint32_t connection, uint64_t arrivalNs, const struct Message* message);
+
+/**
+ * Flushes and closes the capture file.
+ */
+void stopCapture(void);
+
+/**
+ * Opens a capture file for reading and checks its header.
+ *
+ * @param path Capture file
+ * @param header Receives the header
+ * @return The file positioned on the first record, NULL on failure (errno set, EINVAL for a bad header)
+ */
+FILE* openCapture(const char* path, struct CaptureHeader* header);
+
+#endif
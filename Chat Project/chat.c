@@ -15,13 +15,18 @@ struct sockaddr_in setupServer(uint16_t _port) {
     return retval;
 }
 
+enum MessageClass messageClass(const struct Message* _message) {
+    int value = _message->flags & MESSAGE_CLASS_MASK;
+    return (value < MESSAGE_CLASSES) ? (enum MessageClass)value : MESSAGE_INTERACTIVE;
+}
+
 int readMessage(int _connectedFd, struct Message* _message) {
     memset(_message, 0, sizeof(struct Message)); // Clear out message buffer before reading
-    int flags = 0; // No special flags used with recv
+    int flags = MSG_WAITALL; // A message may arrive in several TCP segments: wait for all of it
     int bytesReceived =
         recv(_connectedFd, _message, sizeof(struct Message), flags);
-    if (bytesReceived == -1) {
-        return -1; // Error occurred while receiving
+    if (bytesReceived != (int)sizeof(struct Message)) {
+        return -1; // Error occurred while receiving, or the peer disconnected
     }
     return 0;
 }
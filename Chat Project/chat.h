@@ -2,10 +2,58 @@
 #define CHAT_H
 
 #include <netinet/in.h>
+#include <stdint.h>
 
 #define BUFFER_LENGTH 1024
 #define NAME_LENGTH 13
 
+#define MESSAGE_CLASS_MASK 0x3   ///< Bits of Message.flags holding the message class
+#define MESSAGE_CLASSES 3        ///< Number of message classes
+
+/**
+ * Class of a message, in the low bits of Message.flags.
+ * The server gives every class its own output lane per connection, so bulk traffic
+ * (bots, history backlog) cannot delay interactive chat.
+ */
+enum MessageClass {
+    MESSAGE_INTERACTIVE = 0,  ///< Chat typed by a user (flags left at 0)
+    MESSAGE_CONTROL = 1,      ///< Small protocol messages, sent first
+    MESSAGE_BULK = 2          ///< Bot traffic and history backlog, sent when the others leave room
+};
+
+#define MESSAGE_BATCH 0x4            ///< Flag: the message is a batch, see struct BatchHeader
+#define MAX_BATCH_RECORDS 256        ///< Most messages packed in one batch
+#define MESSAGE_DIRECT 0x8           ///< Flag: private message, the text is "<recipient> <text>"
+#define MESSAGE_CLIENT_FLAGS (MESSAGE_CLASS_MASK | MESSAGE_DIRECT)  ///< Flags a client may set; the server clears the others
+
+/*
+ * Control messages (class MESSAGE_CONTROL) are handled by the server, never broadcast.
+ * Their text is a command followed by its arguments.
+ */
+#define CONTROL_HELLO "hello"        ///< Lists the features of the sender, e.g. "hello lz"; the server answers with its own
+#define CONTROL_HISTORY "history"    ///< "history <count>": asks the server for the last stored messages
+#define FEATURE_LZ "lz"              ///< Feature: batches of history compressed with the built-in LZ codec
+#define CONTROL_UNKNOWN "unknown"    ///< "unknown <nickname>": sent back when a direct message has no recipient
+
+/**
+ * Encoding of a batch payload.
+ */
+enum BatchCodec {
+    BATCH_RAW = 0,  ///< The messages as they are (data that did not compress)
+    BATCH_LZ = 1    ///< The messages compressed with lzCompress()
+};
+
+/**
+ * Start of Message.message in a batch. Batches are only sent to clients that announced
+ * FEATURE_LZ; the payloadLength bytes that follow the message on the stream decode to
+ * `records` consecutive struct Message.
+ */
+struct BatchHeader {
+    uint32_t records;        ///< Messages in the batch (at most MAX_BATCH_RECORDS)
+    uint32_t codec;          ///< enum BatchCodec
+    uint32_t payloadLength;  ///< Bytes following the message
+};
+
 /**
  * Given a message error, prints it on stderr and exit the program
  */
@@ -17,10 +65,15 @@ void error(const char* msg);
 struct Message {
     char nickname[NAME_LENGTH];  ///< Nickname of the user that sent the message
     char message[BUFFER_LENGTH]; ///< Message sent
-    int flags;                   ///< Reserved for Digital manufacturing (can be used for metadata or control)
+    int flags;                   ///< Message class (enum MessageClass) in MESSAGE_CLASS_MASK, other bits reserved
     time_t timestamp;            ///< Time when the message was sent
 };
 
+/**
+ * Returns the class of a message; unknown values are treated as interactive.
+ */
+enum MessageClass messageClass(const struct Message* _message);
+
 /**
  * Fills the socket information for the server
  * Note: only port is set, IP must be specified separately (e.g., INADDR_ANY or inet_pton)
@@ -29,7 +82,8 @@ struct sockaddr_in setupServer(uint16_t _port);
 
 /**
  * Given a socket and a client address, tries to read a message
- * Note: Assumes the socket is already connected
+ * Note: Assumes the socket is already connected and blocking; waits for the whole message
+ * and returns -1 if the peer disconnected before sending all of it
  */
 int readMessage(int _connectedFd, struct Message* _message);
 
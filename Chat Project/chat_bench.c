@@ -0,0 +1,367 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "chat.h"
+#include "server.h"
+#include "server_stats.h"  // Latency histograms and monotonic clock
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_CONNECTIONS 100
+#define DEFAULT_RATE 1000        // Messages per second, across all connections
+#define DEFAULT_DURATION 10      // Seconds of measurement
+#define DEFAULT_WARMUP 1         // Seconds between connecting and sending
+#define MAX_EVENTS 256
+#define BENCH_NICKNAME "bench"
+
+void error(const char* msg) {
+    perror(msg);
+    exit(1);
+}
+
+/**
+ * One simulated client: a non-blocking socket with its reassembly buffer
+ * and the unsent part of its last message.
+ */
+struct BenchClient {
+    int fd;
+    size_t received;           // Bytes of `incoming` received so far
+    struct Message incoming;   // Message being reassembled
+    size_t outgoingSent;       // Bytes of `outgoing` already written (sizeof: nothing pending)
+    struct Message outgoing;   // Message being written
+};
+
+/**
+ * Benchmark settings and results.
+ */
+struct Bench {
+    const char* host;
+    uint16_t port;
+    int nbClients;
+    double rate;                 // Target messages per second
+    int duration;                // Seconds of measurement
+    int warmup;                  // Seconds of warm-up
+    int minSize;                 // Shortest message text
+    int maxSize;                 // Longest message text
+    int bulkPercent;             // Share of messages sent in the bulk class
+    const char* output;          // JSON result file (NULL: stdout)
+    struct BenchClient* clients;
+    int epollFd;
+    uint64_t messagesSent;
+    uint64_t sendStalls;         // Send slots skipped because the socket was still busy
+    uint64_t deliveries;         // Messages received by the simulated clients
+    uint64_t bytesReceived;
+    uint64_t errors;
+    struct LatencyHistogram latency;      // Interactive messages
+    struct LatencyHistogram bulkLatency;  // Bulk messages
+};
+
+void printUsage(const char* programName) {
+    printf("Usage: %s [options]\n", programName);
+    printf("Options:\n");
+    printf("  -H <address>    Server address (default: %s)\n", DEFAULT_HOST);
+    printf("  -p <port>       Server port (default: %d)\n", DEFAULT_PORT);
+    printf("  -c <clients>    Number of simulated clients (default: %d)\n", DEFAULT_CONNECTIONS);
+    printf("  -r <rate>       Messages per second sent across all clients (default: %d)\n", DEFAULT_RATE);
+    printf("  -d <seconds>    Duration of the measurement (default: %d)\n", DEFAULT_DURATION);
+    printf("  -w <seconds>    Warm-up between connecting and sending (default: %d)\n", DEFAULT_WARMUP);
+    printf("  -s <min>-<max>  Message text length, uniformly distributed (default: 32-32)\n");
+    printf("  -k <percent>    Share of messages sent as bulk traffic (default: 0)\n");
+    printf("  -o <file>       Write the JSON results to <file> (default: stdout)\n");
+    printf("  -h              Display this help message\n");
+    printf("The server must accept at least <clients> connections (server -c).\n");
+}
+
+// Connects one simulated client and makes its socket non-blocking
+static int connectClient(const struct Bench* bench) {
+    struct sockaddr_in serverAddress = setupServer(bench->port);
+    if (inet_aton(bench->host, &serverAddress.sin_addr) == 0) {
+        error("Error converting address");
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        error("Error creating socket");
+    }
+    if (connect(fd, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) != 0) {
+        error("Error connecting to server");
+    }
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Writes the rest of a client's outgoing message, returns -1 on a broken connection
+static int flushClient(struct Bench* bench, struct BenchClient* client) {
+    while (client->outgoingSent < sizeof(struct Message)) {
+        ssize_t bytes = send(client->fd, (char*)&client->outgoing + client->outgoingSent,
+                             sizeof(struct Message) - client->outgoingSent, MSG_NOSIGNAL);
+        if (bytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Wait for the socket to drain before writing the rest
+                struct epoll_event event = { .events = EPOLLIN | EPOLLOUT, .data.ptr = client };
+                epoll_ctl(bench->epollFd, EPOLL_CTL_MOD, client->fd, &event);
+                return 0;
+            }
+            return -1;
+        }
+        client->outgoingSent += bytes;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+    epoll_ctl(bench->epollFd, EPOLL_CTL_MOD, client->fd, &event);
+    return 0;
+}
+
+// Starts sending a message stamped with the send time; the text length follows the distribution
+static void sendBenchMessage(struct Bench* bench, struct BenchClient* client) {
+    if (client->outgoingSent < sizeof(struct Message)) {
+        bench->sendStalls++;  // Previous message still in flight
+        return;
+    }
+
+    memset(&client->outgoing, 0, sizeof(struct Message));
+    strcpy(client->outgoing.nickname, BENCH_NICKNAME);
+    client->outgoing.flags = (rand() % 100 < bench->bulkPercent) ? MESSAGE_BULK : MESSAGE_INTERACTIVE;
+    int length = bench->minSize;
+    if (bench->maxSize > bench->minSize) {
+        length += rand() % (bench->maxSize - bench->minSize + 1);
+    }
+    int stamp = snprintf(client->outgoing.message, BUFFER_LENGTH, "%llu ",
+                         (unsigned long long)monotonicNs());
+    if (length > stamp) {
+        memset(client->outgoing.message + stamp, 'x', length - stamp);
+    }
+
+    client->outgoingSent = 0;
+    bench->messagesSent++;
+    if (flushClient(bench, client) < 0) {
+        bench->errors++;
+    }
+}
+
+// Reads what a client received and records the latency of every completed message
+static void receiveBenchMessages(struct Bench* bench, struct BenchClient* client, int measuring) {
+    while (1) {
+        ssize_t bytes = recv(client->fd, (char*)&client->incoming + client->received,
+                             sizeof(struct Message) - client->received, 0);
+        if (bytes <= 0) {
+            if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            bench->errors++;
+            epoll_ctl(bench->epollFd, EPOLL_CTL_DEL, client->fd, NULL);
+            return;
+        }
+
+        bench->bytesReceived += bytes;
+        client->received += bytes;
+        if (client->received < sizeof(struct Message)) {
+            continue;
+        }
+        client->received = 0;
+
+        // Only messages sent by the benchmark carry a send time
+        if (measuring && strncmp(client->incoming.nickname, BENCH_NICKNAME, NAME_LENGTH) == 0) {
+            uint64_t sentNs = strtoull(client->incoming.message, NULL, 10);
+            uint64_t now = monotonicNs();
+            if (sentNs > 0 && sentNs <= now) {
+                histogramRecord(messageClass(&client->incoming) == MESSAGE_BULK ? &bench->bulkLatency
+                                                                                : &bench->latency,
+                                now - sentNs);
+            }
+            bench->deliveries++;
+        }
+    }
+}
+
+// Processes socket events until the deadline
+static void pumpEvents(struct Bench* bench, uint64_t deadlineNs, int measuring) {
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        uint64_t now = monotonicNs();
+        int timeoutMs = (deadlineNs > now) ? (int)((deadlineNs - now + 999999) / 1000000) : 0;
+        int ready = epoll_wait(bench->epollFd, events, MAX_EVENTS, timeoutMs);
+        if (ready < 0 && errno != EINTR) {
+            error("epoll_wait failed");
+        }
+
+        for (int i = 0; i < ready; i++) {
+            struct BenchClient* client = (struct BenchClient*)events[i].data.ptr;
+            if (events[i].events & EPOLLOUT) {
+                if (flushClient(bench, client) < 0) {
+                    bench->errors++;
+                }
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                receiveBenchMessages(bench, client, measuring);
+            }
+        }
+
+        if (monotonicNs() >= deadlineNs) {
+            return;
+        }
+    }
+}
+
+// Writes the summary of a latency histogram as a JSON member
+static void writeLatency(FILE* out, const char* name, const struct LatencyHistogram* latency, const char* end) {
+    uint64_t total = latency->total;
+    fprintf(out, "  \"%s\": { \"count\": %llu, \"mean\": %llu, \"p50\": %llu, \"p90\": %llu, "
+                 "\"p99\": %llu, \"p999\": %llu, \"max\": %llu }%s\n",
+            name, (unsigned long long)total,
+            (unsigned long long)(total ? latency->sum / total : 0),
+            (unsigned long long)histogramPercentile(latency, 50),
+            (unsigned long long)histogramPercentile(latency, 90),
+            (unsigned long long)histogramPercentile(latency, 99),
+            (unsigned long long)histogramPercentile(latency, 99.9),
+            (unsigned long long)latency->max, end);
+}
+
+// Writes settings and results as a JSON object
+static void writeResults(const struct Bench* bench, double elapsed, FILE* out) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"host\": \"%s\",\n", bench->host);
+    fprintf(out, "  \"port\": %u,\n", bench->port);
+    fprintf(out, "  \"connections\": %d,\n", bench->nbClients);
+    fprintf(out, "  \"target_rate\": %.1f,\n", bench->rate);
+    fprintf(out, "  \"message_size\": { \"min\": %d, \"max\": %d },\n", bench->minSize, bench->maxSize);
+    fprintf(out, "  \"duration_s\": %.3f,\n", elapsed);
+    fprintf(out, "  \"messages_sent\": %llu,\n", (unsigned long long)bench->messagesSent);
+    fprintf(out, "  \"send_stalls\": %llu,\n", (unsigned long long)bench->sendStalls);
+    fprintf(out, "  \"deliveries\": %llu,\n", (unsigned long long)bench->deliveries);
+    fprintf(out, "  \"errors\": %llu,\n", (unsigned long long)bench->errors);
+    fprintf(out, "  \"sent_per_s\": %.1f,\n", bench->messagesSent / elapsed);
+    fprintf(out, "  \"deliveries_per_s\": %.1f,\n", bench->deliveries / elapsed);
+    fprintf(out, "  \"received_mb_per_s\": %.2f,\n", bench->bytesReceived / elapsed / (1024 * 1024));
+    fprintf(out, "  \"bulk_percent\": %d,\n", bench->bulkPercent);
+    writeLatency(out, "latency_ns", &bench->latency, ",");
+    writeLatency(out, "bulk_latency_ns", &bench->bulkLatency, "");
+    fprintf(out, "}\n");
+}
+
+int main(int argc, char** argv) {
+    static struct Bench bench;  // Static: the histogram is large
+    bench.host = DEFAULT_HOST;
+    bench.port = DEFAULT_PORT;
+    bench.nbClients = DEFAULT_CONNECTIONS;
+    bench.rate = DEFAULT_RATE;
+    bench.duration = DEFAULT_DURATION;
+    bench.warmup = DEFAULT_WARMUP;
+    bench.minSize = 32;
+    bench.maxSize = 32;
+    bench.latency.name = "fanout_latency_ns";
+
+    // Parse command-line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-H") == 0 && i + 1 < argc) {
+            bench.host = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            bench.port = (uint16_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            bench.nbClients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            bench.rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            bench.duration = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            bench.warmup = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d-%d", &bench.minSize, &bench.maxSize) != 2) {
+                bench.maxSize = bench.minSize;
+            }
+        } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            bench.bulkPercent = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            bench.output = argv[++i];
+        } else if (strcmp(argv[i], "-h") == 0) {
+            printUsage(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (bench.nbClients < 2 || bench.rate <= 0 || bench.duration <= 0 || bench.warmup < 0
+        || bench.minSize < 0 || bench.maxSize >= BUFFER_LENGTH || bench.minSize > bench.maxSize
+        || bench.bulkPercent < 0 || bench.bulkPercent > 100) {
+        fprintf(stderr, "Invalid settings: at least 2 clients, a positive rate and duration, "
+                        "and sizes below %d are required\n", BUFFER_LENGTH);
+        return 1;
+    }
+
+    // Thousands of sockets need more than the default descriptor limit
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    bench.epollFd = epoll_create1(0);
+    bench.clients = calloc(bench.nbClients, sizeof(struct BenchClient));
+    if (bench.epollFd < 0 || bench.clients == NULL) {
+        error("Error setting up the benchmark");
+    }
+
+    for (int i = 0; i < bench.nbClients; i++) {
+        struct BenchClient* client = &bench.clients[i];
+        client->fd = connectClient(&bench);
+        client->outgoingSent = sizeof(struct Message);
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+        if (epoll_ctl(bench.epollFd, EPOLL_CTL_ADD, client->fd, &event) < 0) {
+            error("epoll_ctl failed");
+        }
+    }
+    fprintf(stderr, "%d clients connected, warming up for %d s\n", bench.nbClients, bench.warmup);
+    pumpEvents(&bench, monotonicNs() + (uint64_t)bench.warmup * 1000000000u, 0);
+
+    // Send at a fixed pace, round-robin over the clients, handling replies in between
+    fprintf(stderr, "Sending %.0f msgs/s for %d s\n", bench.rate, bench.duration);
+    uint64_t interval = (uint64_t)(1e9 / bench.rate);
+    uint64_t start = monotonicNs();
+    uint64_t end = start + (uint64_t)bench.duration * 1000000000u;
+    uint64_t nextSend = start;
+    int nextClient = 0;
+    while (monotonicNs() < end) {
+        uint64_t now = monotonicNs();
+        while (nextSend <= now && nextSend < end) {
+            sendBenchMessage(&bench, &bench.clients[nextClient]);
+            nextClient = (nextClient + 1) % bench.nbClients;
+            nextSend += interval;
+        }
+        pumpEvents(&bench, nextSend < end ? nextSend : end, 1);
+    }
+    double elapsed = (monotonicNs() - start) / 1e9;
+
+    // Give in-flight messages a moment to arrive; they count but not in the rate
+    pumpEvents(&bench, monotonicNs() + 500000000u, 1);
+
+    FILE* out = stdout;
+    if (bench.output != NULL && (out = fopen(bench.output, "w")) == NULL) {
+        error("Error opening output file");
+    }
+    writeResults(&bench, elapsed, out);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    for (int i = 0; i < bench.nbClients; i++) {
+        close(bench.clients[i].fd);
+    }
+    free(bench.clients);
+    close(bench.epollFd);
+    return 0;
+}
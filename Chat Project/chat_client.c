@@ -0,0 +1,336 @@
+#include "chat_client.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "lz.h"
+
+// Common part of both connection kinds
+static void initClient(struct ChatClient* client, const char* nickname) {
+    memset(client, 0, sizeof(*client));
+    client->fd = -1;
+    strncpy(client->nickname, nickname, NAME_LENGTH - 1);
+}
+
+int chatConnect(struct ChatClient* client, const char* address, uint16_t port, const char* nickname) {
+    initClient(client, nickname);
+    struct sockaddr_in serverAddress = setupServer(port);
+    if (inet_pton(AF_INET, address, &serverAddress.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    client->receiveCapacity = CHAT_CLIENT_RECV_BATCH * sizeof(struct Message);
+    client->receiveBuffer = malloc(client->receiveCapacity);
+    client->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (client->receiveBuffer == NULL || client->fd < 0) {
+        chatClose(client);
+        return -1;
+    }
+
+    // Sends are coalesced here, so Nagle's algorithm would only add delay
+    int on = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    if (connect(client->fd, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+        if (errno != EINPROGRESS) {
+            chatClose(client);
+            return -1;
+        }
+        client->connecting = 1;  // Completes when the socket becomes writable
+    }
+    return 0;
+}
+
+int chatConnectShm(struct ChatClient* client, const char* path, const char* nickname) {
+    initClient(client, nickname);
+    client->shm = malloc(sizeof(struct ShmChannel));
+    if (client->shm == NULL) {
+        return -1;
+    }
+    if (shmConnect(path, client->shm) != 0) {
+        free(client->shm);
+        client->shm = NULL;
+        return -1;
+    }
+    client->fd = client->shm->socketFd;
+    return 0;
+}
+
+void chatSetCallback(struct ChatClient* client, ChatMessageCallback onMessage, void* context) {
+    client->onMessage = onMessage;
+    client->context = context;
+}
+
+int chatSend(struct ChatClient* client, const char* text, int flags) {
+    struct Message message;
+    memset(&message, 0, sizeof(message));
+    memcpy(message.nickname, client->nickname, NAME_LENGTH);
+    strncpy(message.message, text, BUFFER_LENGTH - 1);
+    message.flags = flags;
+    return chatSendMessage(client, &message);
+}
+
+int chatSendDirect(struct ChatClient* client, const char* recipient, const char* text) {
+    struct Message message;
+    memset(&message, 0, sizeof(message));
+    memcpy(message.nickname, client->nickname, NAME_LENGTH);
+    snprintf(message.message, BUFFER_LENGTH, "%.*s %s", NAME_LENGTH - 1, recipient, text);
+    message.flags = MESSAGE_INTERACTIVE | MESSAGE_DIRECT;
+    return chatSendMessage(client, &message);
+}
+
+int chatSendMessage(struct ChatClient* client, const struct Message* message) {
+    // The shared-memory ring is the queue: shmSend() only waits when it is full
+    if (client->shm != NULL) {
+        return shmSend(client->shm, message);
+    }
+
+    if (client->queued == CHAT_CLIENT_QUEUE_LIMIT) {
+        errno = EAGAIN;
+        return -1;
+    }
+    // Grow by doubling; the queue is allocated on first use
+    if (client->queued == client->capacity) {
+        int capacity = (client->capacity == 0) ? 16 : client->capacity * 2;
+        struct Message* queue = realloc(client->queue, capacity * sizeof(struct Message));
+        if (queue == NULL) {
+            return -1;
+        }
+        client->queue = queue;
+        client->capacity = capacity;
+    }
+    client->queue[client->queued++] = *message;
+    return 0;
+}
+
+// Queues a control message
+static int sendControl(struct ChatClient* client, const char* text) {
+    struct Message message;
+    memset(&message, 0, sizeof(message));
+    memcpy(message.nickname, client->nickname, NAME_LENGTH);
+    snprintf(message.message, BUFFER_LENGTH, "%s", text);
+    message.flags = MESSAGE_CONTROL;
+    return chatSendMessage(client, &message);
+}
+
+int chatEnableBatches(struct ChatClient* client) {
+    if (client->shm != NULL) {
+        return 0;  // A ring slot holds one message: nothing to negotiate
+    }
+    client->batches = 1;
+    return sendControl(client, CONTROL_HELLO " " FEATURE_LZ);
+}
+
+int chatRequestHistory(struct ChatClient* client, int count) {
+    char text[32];
+    snprintf(text, sizeof(text), CONTROL_HISTORY " %d", count);
+    return sendControl(client, text);
+}
+
+int chatFlush(struct ChatClient* client) {
+    if (client->shm != NULL || client->queued == 0) {
+        return 0;
+    }
+    if (client->connecting) {
+        return 1;
+    }
+
+    // One send() for everything queued
+    size_t total = client->queued * sizeof(struct Message);
+    while (client->queueSent < total) {
+        ssize_t bytes = send(client->fd, (char*)client->queue + client->queueSent, total - client->queueSent,
+                             MSG_NOSIGNAL);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            break;
+        }
+        client->queueSent += bytes;
+    }
+
+    // Drop the messages written completely, keeping a partly written one at the front
+    int done = (int)(client->queueSent / sizeof(struct Message));
+    if (done > 0) {
+        memmove(client->queue, client->queue + done, (client->queued - done) * sizeof(struct Message));
+        client->queued -= done;
+        client->queueSent -= done * sizeof(struct Message);
+    }
+    return client->queued > 0;
+}
+
+int chatPending(const struct ChatClient* client) {
+    return client->queued;
+}
+
+int chatDescriptors(const struct ChatClient* client, struct pollfd* fds) {
+    if (client->shm != NULL) {
+        fds[0].fd = client->fd;                 // Only reports the server going away
+        fds[0].events = POLLIN;
+        fds[1].fd = client->shm->eventFd;       // Rung by the server when it fills our ring
+        fds[1].events = POLLIN;
+        fds[0].revents = fds[1].revents = 0;
+        return 2;
+    }
+
+    fds[0].fd = client->fd;
+    fds[0].events = client->connecting ? POLLOUT : (short)(POLLIN | (client->queued > 0 ? POLLOUT : 0));
+    fds[0].revents = 0;
+    return 1;
+}
+
+// Decodes a batch payload and hands its messages to the callback
+static int unpackBatch(struct ChatClient* client, const struct BatchHeader* batch, const char* payload) {
+    size_t rawLength = batch->records * sizeof(struct Message);
+    if (client->batchMessages == NULL
+        && (client->batchMessages = malloc(MAX_BATCH_RECORDS * sizeof(struct Message))) == NULL) {
+        return -1;
+    }
+    if (batch->codec == BATCH_LZ) {
+        if (lzDecompress(payload, batch->payloadLength, client->batchMessages, rawLength) != (long)rawLength) {
+            errno = EPROTO;
+            return -1;
+        }
+    } else if (batch->codec == BATCH_RAW && batch->payloadLength == rawLength) {
+        memcpy(client->batchMessages, payload, rawLength);
+    } else {
+        errno = EPROTO;
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < batch->records && client->onMessage != NULL; i++) {
+        client->onMessage(&client->batchMessages[i], client->context);
+    }
+    return 0;
+}
+
+// Hands every complete message (or batch) at the start of the receive buffer to the callback,
+// then keeps the incomplete rest, growing the buffer if a batch does not fit in it
+static int dispatchMessages(struct ChatClient* client) {
+    size_t offset = 0;
+    size_t needed = sizeof(struct Message);
+    while (client->received - offset >= sizeof(struct Message)) {
+        struct Message message;
+        memcpy(&message, client->receiveBuffer + offset, sizeof(message));  // Buffer is not aligned
+        needed = sizeof(struct Message);
+
+        // Batches are framed by the server itself: bulk class, no nickname
+        if (client->batches && (message.flags & MESSAGE_BATCH) && messageClass(&message) == MESSAGE_BULK
+            && message.nickname[0] == '\0') {
+            struct BatchHeader batch;
+            memcpy(&batch, message.message, sizeof(batch));
+            if (batch.records > MAX_BATCH_RECORDS
+                || batch.payloadLength > lzCompressBound(MAX_BATCH_RECORDS * sizeof(struct Message))) {
+                errno = EPROTO;
+                return -1;
+            }
+            needed += batch.payloadLength;
+            if (client->received - offset < needed) {
+                break;  // Wait for the rest of the payload
+            }
+            if (unpackBatch(client, &batch, client->receiveBuffer + offset + sizeof(struct Message)) < 0) {
+                return -1;
+            }
+        } else if (client->onMessage != NULL) {
+            client->onMessage(&message, client->context);
+        }
+        offset += needed;
+        needed = sizeof(struct Message);
+    }
+
+    memmove(client->receiveBuffer, client->receiveBuffer + offset, client->received - offset);
+    client->received -= offset;
+    if (needed > client->receiveCapacity) {
+        char* buffer = realloc(client->receiveBuffer, needed);
+        if (buffer == NULL) {
+            return -1;
+        }
+        client->receiveBuffer = buffer;
+        client->receiveCapacity = needed;
+    }
+    return 0;
+}
+
+// Reads what the socket holds and hands every complete message to the callback
+static int receiveMessages(struct ChatClient* client) {
+    while (1) {
+        ssize_t bytes = recv(client->fd, client->receiveBuffer + client->received,
+                             client->receiveCapacity - client->received, 0);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (bytes == 0) {
+            return -1;  // The server closed the connection
+        }
+        client->received += bytes;
+        if (dispatchMessages(client) < 0) {
+            return -1;
+        }
+    }
+}
+
+int chatHandleEvents(struct ChatClient* client, const struct pollfd* fds, int nbFds) {
+    if (client->shm != NULL) {
+        if (nbFds > 1 && fds[1].revents != 0) {
+            shmClearDoorbell(client->shm);
+            struct Message message;
+            while (shmReceive(client->shm, &message)) {
+                if (client->onMessage != NULL) {
+                    client->onMessage(&message, client->context);
+                }
+            }
+        }
+        return (fds[0].revents != 0) ? -1 : 0;  // Nothing is ever sent on the negotiation socket
+    }
+
+    short revents = fds[0].revents;
+    if (client->connecting && revents != 0) {
+        int failure = 0;
+        socklen_t length = sizeof(failure);
+        if (getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &failure, &length) < 0 || failure != 0) {
+            errno = failure ? failure : errno;
+            return -1;
+        }
+        client->connecting = 0;
+    }
+    if ((revents & POLLOUT) && chatFlush(client) < 0) {
+        return -1;
+    }
+    if ((revents & (POLLIN | POLLHUP | POLLERR)) && receiveMessages(client) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void chatClose(struct ChatClient* client) {
+    if (client->shm != NULL) {
+        shmClose(client->shm);  // Also closes the negotiation socket
+        free(client->shm);
+        client->shm = NULL;
+    } else if (client->fd >= 0) {
+        close(client->fd);
+    }
+    client->fd = -1;
+    free(client->queue);
+    free(client->receiveBuffer);
+    free(client->batchMessages);
+    client->queue = NULL;
+    client->receiveBuffer = NULL;
+    client->batchMessages = NULL;
+    client->queued = 0;
+    client->capacity = 0;
+}
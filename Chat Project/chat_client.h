@@ -0,0 +1,149 @@
+#ifndef CHAT_CLIENT_H
+#define CHAT_CLIENT_H
+
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chat.h"
+#include "shm_transport.h"
+
+#define CHAT_CLIENT_QUEUE_LIMIT 4096   ///< Messages queued by chatSend() before it refuses more
+#define CHAT_CLIENT_RECV_BATCH 64      ///< Messages read from the socket per recv() call
+#define CHAT_CLIENT_MAX_FDS 2          ///< Descriptors a client may ask its event loop to poll
+
+/**
+ * Called for every message received, in order.
+ */
+typedef void (*ChatMessageCallback)(const struct Message* message, void* context);
+
+/**
+ * Non-blocking connection to a chat server, over TCP or a shared-memory channel.
+ *
+ * Sends are queued and coalesced: everything queued since the last write goes out in a
+ * single send() call when the socket is writable. Received bytes are read in batches and
+ * handed to the callback message by message.
+ *
+ * The client is driven by the application's own event loop: chatDescriptors() tells what
+ * to poll and chatHandleEvents() does the work once poll() returns.
+ */
+struct ChatClient {
+    int fd;                         ///< TCP socket, or negotiation socket of the shared-memory channel
+    int connecting;                 ///< Set until the non-blocking TCP connect completes
+    struct ShmChannel* shm;         ///< Shared-memory channel, NULL over TCP
+    char nickname[NAME_LENGTH];     ///< Stamped on every message sent with chatSend()
+    struct Message* queue;          ///< Messages waiting to be written
+    int queued;                     ///< Messages in queue
+    int capacity;                   ///< Messages allocated in queue
+    size_t queueSent;               ///< Bytes of the queue already written
+    char* receiveBuffer;            ///< Holds CHAT_CLIENT_RECV_BATCH messages, or a whole batch
+    size_t receiveCapacity;         ///< Size of receiveBuffer
+    size_t received;                ///< Bytes in receiveBuffer
+    int batches;                    ///< Set by chatEnableBatches(): MESSAGE_BATCH frames are expected
+    struct Message* batchMessages;  ///< Decoded batch, allocated on the first one
+    ChatMessageCallback onMessage;  ///< Receive callback, may be NULL
+    void* context;                  ///< Passed to onMessage
+};
+
+/**
+ * Starts connecting to a server over TCP without waiting for the connection to complete.
+ * Messages may be queued right away; they are sent once the connection is up.
+ *
+ * @param client Client to initialise
+ * @param address IPv4 address of the server
+ * @param port Port of the server
+ * @param nickname Nickname stamped on the messages sent with chatSend()
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int chatConnect(struct ChatClient* client, const char* address, uint16_t port, const char* nickname);
+
+/**
+ * Connects to a server on the same host through a shared-memory channel.
+ *
+ * @param client Client to initialise
+ * @param path Negotiation socket of the server
+ * @param nickname Nickname stamped on the messages sent with chatSend()
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int chatConnectShm(struct ChatClient* client, const char* path, const char* nickname);
+
+/**
+ * Sets the function called for every message received.
+ */
+void chatSetCallback(struct ChatClient* client, ChatMessageCallback onMessage, void* context);
+
+/**
+ * Queues a text message of the given class (enum MessageClass), truncated to BUFFER_LENGTH - 1 bytes.
+ *
+ * @return 0 on success, -1 if the queue is full (errno EAGAIN) or the channel failed
+ */
+int chatSend(struct ChatClient* client, const char* text, int flags);
+
+/**
+ * Queues a direct message, delivered by the server to the client signing its messages
+ * with `recipient` only. If nobody does, the server answers with a CONTROL_UNKNOWN message.
+ *
+ * @return 0 on success, -1 if the queue is full (errno EAGAIN) or the channel failed
+ */
+int chatSendDirect(struct ChatClient* client, const char* recipient, const char* text);
+
+/**
+ * Queues a complete message as is.
+ *
+ * @return 0 on success, -1 if the queue is full (errno EAGAIN) or the channel failed
+ */
+int chatSendMessage(struct ChatClient* client, const struct Message* message);
+
+/**
+ * Tells the server that this client takes history in compressed batches (CONTROL_HELLO
+ * with FEATURE_LZ). Batches are unpacked by the library: the callback still sees one
+ * message at a time. Over shared memory the server keeps sending single messages.
+ *
+ * @return 0 on success, -1 if the control message could not be queued
+ */
+int chatEnableBatches(struct ChatClient* client);
+
+/**
+ * Asks the server for the last `count` stored messages (CONTROL_HISTORY). They arrive
+ * through the callback, oldest first, as bulk messages.
+ *
+ * @return 0 on success, -1 if the control message could not be queued
+ */
+int chatRequestHistory(struct ChatClient* client, int count);
+
+/**
+ * Writes as much of the queue as the socket accepts, without blocking.
+ *
+ * @return 0 if the queue is empty, 1 if messages remain, -1 on error
+ */
+int chatFlush(struct ChatClient* client);
+
+/**
+ * Returns the number of messages still queued.
+ */
+int chatPending(const struct ChatClient* client);
+
+/**
+ * Event-loop hook: fills the descriptors and events to poll for this client.
+ *
+ * @param fds At least CHAT_CLIENT_MAX_FDS entries
+ * @return Number of entries filled
+ */
+int chatDescriptors(const struct ChatClient* client, struct pollfd* fds);
+
+/**
+ * Event-loop hook: completes the connection, writes the queue and reads incoming
+ * messages (calling the callback) according to the events poll() returned.
+ *
+ * @param fds Entries filled by chatDescriptors(), with revents set
+ * @param nbFds Number of entries
+ * @return 0 while connected, -1 once the server closed the connection or on error
+ */
+int chatHandleEvents(struct ChatClient* client, const struct pollfd* fds, int nbFds);
+
+/**
+ * Closes the connection and frees the queues; unsent messages are lost.
+ */
+void chatClose(struct ChatClient* client);
+
+#endif
@@ -0,0 +1,378 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "chat.h"
+#include "server.h"
+#include "server_stats.h"  // Monotonic clock and lateness histogram
+#include "capture.h"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_CAPTURE "chat_capture.dat"
+#define MAX_EVENTS 256
+#define MAX_SPEED_POLL 64   // At max speed, drain replies every this many messages
+
+void error(const char* msg) {
+    perror(msg);
+    exit(1);
+}
+
+/**
+ * One replayed connection, standing for one or more captured connections.
+ */
+struct ReplayClient {
+    int fd;
+    size_t received;           // Bytes of `incoming` received so far
+    struct Message incoming;   // Message being reassembled
+    size_t outgoingSent;       // Bytes of `outgoing` already written (sizeof: nothing pending)
+    struct Message outgoing;   // Message being written
+    int dead;                  // Set once the server closed the connection or a send failed
+};
+
+/**
+ * Replay settings and results.
+ */
+struct Replay {
+    const char* host;
+    uint16_t port;
+    const char* capture;
+    double speed;                 // Time compression factor, 0 for as fast as possible
+    int nbClients;                // 0: one per captured connection
+    struct ReplayClient* clients;
+    uint32_t* ids;                // Open-addressing table of captured connection ids...
+    int* slots;                   // ...and the replayed connection each one maps to
+    size_t idCapacity;
+    int epollFd;
+    uint64_t messagesSent;
+    uint64_t messagesSkipped;     // Messages of connections that were dead when they came due
+    uint64_t deliveries;
+    uint64_t errors;
+    struct LatencyHistogram lateness;  // How far behind schedule each message was sent
+};
+
+void printUsage(const char* programName) {
+    printf("Usage: %s [options]\n", programName);
+    printf("Options:\n");
+    printf("  -H <address>    Server address (default: %s)\n", DEFAULT_HOST);
+    printf("  -p <port>       Server port (default: %d)\n", DEFAULT_PORT);
+    printf("  -f <file>       Capture recorded with server -C (default: %s)\n", DEFAULT_CAPTURE);
+    printf("  -x <speed>      Replay speed: 1 for real time, 10 for ten times faster, max for no pauses "
+           "(default: 1)\n");
+    printf("  -c <clients>    Connections to replay over (default: one per captured connection)\n");
+    printf("  -h              Display this help message\n");
+    printf("The server must accept at least <clients> connections (server -c).\n");
+}
+
+// Returns the replayed connection of a captured connection id, assigning slots in order of appearance
+static int slotOf(struct Replay* replay, uint32_t id, int* nbIds) {
+    size_t mask = replay->idCapacity - 1;
+    size_t i = (id * 2654435761u) & mask;
+    while (replay->ids[i] != 0 && replay->ids[i] != id) {
+        i = (i + 1) & mask;
+    }
+    if (replay->ids[i] == 0) {
+        // Keep the table at most half full so probes stay short
+        if ((size_t)(*nbIds + 1) * 2 > replay->idCapacity) {
+            size_t oldCapacity = replay->idCapacity;
+            uint32_t* oldIds = replay->ids;
+            int* oldSlots = replay->slots;
+            replay->idCapacity *= 2;
+            replay->ids = calloc(replay->idCapacity, sizeof(uint32_t));
+            replay->slots = calloc(replay->idCapacity, sizeof(int));
+            if (replay->ids == NULL || replay->slots == NULL) {
+                error("Memory allocation failed");
+            }
+            for (size_t j = 0; j < oldCapacity; j++) {
+                if (oldIds[j] != 0) {
+                    size_t k = (oldIds[j] * 2654435761u) & (replay->idCapacity - 1);
+                    while (replay->ids[k] != 0) {
+                        k = (k + 1) & (replay->idCapacity - 1);
+                    }
+                    replay->ids[k] = oldIds[j];
+                    replay->slots[k] = oldSlots[j];
+                }
+            }
+            free(oldIds);
+            free(oldSlots);
+            return slotOf(replay, id, nbIds);
+        }
+        replay->ids[i] = id;
+        replay->slots[i] = (*nbIds)++;
+    }
+    return replay->slots[i];
+}
+
+// Connects one replayed connection and makes its socket non-blocking
+static int connectClient(const struct Replay* replay) {
+    struct sockaddr_in serverAddress = setupServer(replay->port);
+    if (inet_aton(replay->host, &serverAddress.sin_addr) == 0) {
+        error("Error converting address");
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        error("Error creating socket");
+    }
+    if (connect(fd, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) != 0) {
+        error("Error connecting to server");
+    }
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Stops using a connection the server closed or that failed; its later messages are skipped
+static void markDead(struct Replay* replay, struct ReplayClient* client) {
+    if (client->dead) {
+        return;
+    }
+    client->dead = 1;
+    client->outgoingSent = sizeof(struct Message);  // Nothing to wait for any more
+    replay->errors++;
+    epoll_ctl(replay->epollFd, EPOLL_CTL_DEL, client->fd, NULL);
+}
+
+// Writes the rest of a connection's outgoing message, returns -1 on a broken connection
+static int flushClient(struct Replay* replay, struct ReplayClient* client) {
+    while (client->outgoingSent < sizeof(struct Message)) {
+        ssize_t bytes = send(client->fd, (char*)&client->outgoing + client->outgoingSent,
+                             sizeof(struct Message) - client->outgoingSent, MSG_NOSIGNAL);
+        if (bytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct epoll_event event = { .events = EPOLLIN | EPOLLOUT, .data.ptr = client };
+                epoll_ctl(replay->epollFd, EPOLL_CTL_MOD, client->fd, &event);
+                return 0;
+            }
+            markDead(replay, client);
+            return -1;
+        }
+        client->outgoingSent += bytes;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+    epoll_ctl(replay->epollFd, EPOLL_CTL_MOD, client->fd, &event);
+    return 0;
+}
+
+// Reads and counts what a connection received; replies must be drained or the server stalls
+static void receiveReplies(struct Replay* replay, struct ReplayClient* client) {
+    while (1) {
+        ssize_t bytes = recv(client->fd, (char*)&client->incoming + client->received,
+                             sizeof(struct Message) - client->received, 0);
+        if (bytes <= 0) {
+            if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            markDead(replay, client);  // The server closed the connection (or it broke)
+            return;
+        }
+        client->received += bytes;
+        if (client->received == sizeof(struct Message)) {
+            client->received = 0;
+            replay->deliveries++;
+        }
+    }
+}
+
+// Processes socket events until the deadline (a deadline in the past polls once)
+static void pumpEvents(struct Replay* replay, uint64_t deadlineNs) {
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        uint64_t now = monotonicNs();
+        int timeoutMs = (deadlineNs > now) ? (int)((deadlineNs - now + 999999) / 1000000) : 0;
+        int ready = epoll_wait(replay->epollFd, events, MAX_EVENTS, timeoutMs);
+        if (ready < 0 && errno != EINTR) {
+            error("epoll_wait failed");
+        }
+
+        for (int i = 0; i < ready; i++) {
+            struct ReplayClient* client = (struct ReplayClient*)events[i].data.ptr;
+            if (events[i].events & EPOLLOUT) {
+                flushClient(replay, client);
+            }
+            if (!client->dead && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                receiveReplies(replay, client);
+            }
+        }
+
+        if (monotonicNs() >= deadlineNs) {
+            return;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    static struct Replay replay;  // Static: the histogram is large
+    replay.host = DEFAULT_HOST;
+    replay.port = DEFAULT_PORT;
+    replay.capture = DEFAULT_CAPTURE;
+    replay.speed = 1;
+    replay.lateness.name = "lateness_ns";
+
+    // Parse command-line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-H") == 0 && i + 1 < argc) {
+            replay.host = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            replay.port = (uint16_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            replay.capture = argv[++i];
+        } else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+            i++;
+            replay.speed = (strcmp(argv[i], "max") == 0) ? 0 : atof(argv[i]);
+            if (replay.speed <= 0 && strcmp(argv[i], "max") != 0) {
+                fprintf(stderr, "Invalid speed\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            replay.nbClients = atoi(argv[++i]);
+            if (replay.nbClients <= 0) {
+                fprintf(stderr, "Invalid number of clients\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-h") == 0) {
+            printUsage(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    struct CaptureHeader header;
+    FILE* capture = openCapture(replay.capture, &header);
+    if (capture == NULL) {
+        error("Error opening capture");
+    }
+
+    // First pass: map every captured connection to a replayed one
+    replay.idCapacity = 1024;
+    replay.ids = calloc(replay.idCapacity, sizeof(uint32_t));
+    replay.slots = calloc(replay.idCapacity, sizeof(int));
+    if (replay.ids == NULL || replay.slots == NULL) {
+        error("Memory allocation failed");
+    }
+    struct CaptureRecord record;
+    int nbIds = 0;
+    uint64_t nbRecords = 0;
+    uint64_t captureNs = 0;
+    while (fread(&record, sizeof(record), 1, capture) == 1) {
+        slotOf(&replay, record.connection, &nbIds);
+        captureNs = record.arrivalNs;
+        nbRecords++;
+    }
+    if (nbRecords == 0) {
+        fprintf(stderr, "Capture %s holds no message\n", replay.capture);
+        return 1;
+    }
+    if (replay.nbClients == 0) {
+        replay.nbClients = nbIds;
+    }
+
+    // Thousands of sockets need more than the default descriptor limit
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    replay.epollFd = epoll_create1(0);
+    replay.clients = calloc(replay.nbClients, sizeof(struct ReplayClient));
+    if (replay.epollFd < 0 || replay.clients == NULL) {
+        error("Error setting up the replay");
+    }
+    for (int i = 0; i < replay.nbClients; i++) {
+        struct ReplayClient* client = &replay.clients[i];
+        client->fd = connectClient(&replay);
+        client->outgoingSent = sizeof(struct Message);
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+        if (epoll_ctl(replay.epollFd, EPOLL_CTL_ADD, client->fd, &event) < 0) {
+            error("epoll_ctl failed");
+        }
+    }
+    fprintf(stderr, "Replaying %llu messages from %d captured connections over %d connections\n",
+            (unsigned long long)nbRecords, nbIds, replay.nbClients);
+
+    // Second pass: send every message when its scaled arrival time comes
+    fseek(capture, sizeof(header), SEEK_SET);
+    uint64_t start = monotonicNs();
+    while (fread(&record, sizeof(record), 1, capture) == 1) {
+        uint64_t due = start;
+        if (replay.speed > 0) {
+            due += (uint64_t)(record.arrivalNs / replay.speed);
+            pumpEvents(&replay, due);
+        } else if (replay.messagesSent % MAX_SPEED_POLL == 0) {
+            pumpEvents(&replay, 0);
+        }
+
+        // Messages of one connection keep their order: wait for the previous one to be written
+        int slot = slotOf(&replay, record.connection, &nbIds) % replay.nbClients;
+        struct ReplayClient* client = &replay.clients[slot];
+        while (client->outgoingSent < sizeof(struct Message)) {
+            pumpEvents(&replay, monotonicNs() + 1000000);
+        }
+        if (client->dead) {
+            replay.messagesSkipped++;
+            continue;
+        }
+
+        uint64_t now = monotonicNs();
+        if (replay.speed > 0) {
+            histogramRecord(&replay.lateness, (now > due) ? now - due : 0);
+        }
+        client->outgoing = record.message;
+        client->outgoingSent = 0;
+        replay.messagesSent++;
+        flushClient(&replay, client);
+    }
+    double elapsed = (monotonicNs() - start) / 1e9;
+    fclose(capture);
+
+    // Give in-flight messages a moment to be delivered
+    pumpEvents(&replay, monotonicNs() + 500000000u);
+
+    uint64_t total = replay.lateness.total;
+    printf("Captured duration:  %.3f s\n", captureNs / 1e9);
+    if (replay.speed > 0) {
+        printf("Replay duration:    %.3f s at %gx (target %.3f s)\n", elapsed, replay.speed,
+               captureNs / 1e9 / replay.speed);
+    } else {
+        printf("Replay duration:    %.3f s at max speed\n", elapsed);
+    }
+    printf("Messages sent:      %llu (%.1f msgs/s)\n", (unsigned long long)replay.messagesSent,
+           replay.messagesSent / elapsed);
+    if (replay.messagesSkipped > 0) {
+        printf("Messages skipped:   %llu (connection closed by the server)\n",
+               (unsigned long long)replay.messagesSkipped);
+    }
+    printf("Deliveries:         %llu\n", (unsigned long long)replay.deliveries);
+    printf("Errors:             %llu\n", (unsigned long long)replay.errors);
+    if (total > 0) {
+        printf("Lateness (ns):      mean %llu p50 %llu p99 %llu max %llu\n",
+               (unsigned long long)(replay.lateness.sum / total),
+               (unsigned long long)histogramPercentile(&replay.lateness, 50),
+               (unsigned long long)histogramPercentile(&replay.lateness, 99),
+               (unsigned long long)replay.lateness.max);
+    }
+
+    for (int i = 0; i < replay.nbClients; i++) {
+        close(replay.clients[i].fd);
+    }
+    free(replay.clients);
+    free(replay.ids);
+    free(replay.slots);
+    close(replay.epollFd);
+    return 0;
+}
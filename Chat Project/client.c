@@ -1,105 +1,117 @@
-#include <arpa/inet.h>
-#include <netinet/in.h>
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <unistd.h>
 
 #include "chat.h"
+#include "chat_client.h"  // Non-blocking connection, send queue and receive callback
 
 #define PORT 12345
 #define SERVER_ADDR "127.0.0.1"
+#define HISTORY_COMMAND "/history"  // "/history <n>" shows the last n messages of the server
+#define DIRECT_COMMAND "/msg"        // "/msg <nickname> <text>" sends a private message
 
 void error(const char* msg) {
     perror(msg);
     exit(1);
 }
 
-int settingUpClientSocket() {
-    struct sockaddr_in serverAddress = setupServer(PORT);
-
-    int sockfd;
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        error("Error creating socket");
-    }
-
-    if (connect(sockfd, (struct sockaddr*)&serverAddress,
-            sizeof(struct sockaddr_in))
-        != 0) {
-        error("Error connecting to server");
-    }
-
-    int on;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (char*)&on, sizeof(on))
-        < 0) {
-        error("Error setting reuse option\n");
-    }
-
-    // Set the IP address of the server (overwrites sin_addr)
-    if (inet_aton(SERVER_ADDR, &serverAddress.sin_addr) == 0) {
-        error("Error converting address");
+// Prints a received message, overwriting the current prompt
+static void printMessage(const struct Message* message, void* context) {
+    const char* nickname = (const char*)context;
+    const char* text = message->message;
+    if (messageClass(message) == MESSAGE_CONTROL) {
+        if (strncmp(text, CONTROL_UNKNOWN " ", strlen(CONTROL_UNKNOWN) + 1) != 0) {
+            return; // Other protocol replies, e.g. to the hello
+        }
+        printf("\rNo user named %s\n%s> ", text + strlen(CONTROL_UNKNOWN) + 1, nickname);
+    } else if (message->flags & MESSAGE_DIRECT) {
+        text += strcspn(text, " "); // Skip the recipient (us)
+        text += (*text == ' ');
+        printf("\r%.*s (private)> %s\n%s> ", NAME_LENGTH, message->nickname, text, nickname);
+    } else {
+        printf("\r%.*s> %.*s\n%s> ", NAME_LENGTH, message->nickname, BUFFER_LENGTH, text, nickname);
     }
-
-    return sockfd;
+    fflush(stdout);
 }
 
 int main(int argc, char** argv) {
     if (argc < 2) {
         printf("Please specify a nickname\n");
+        return 1;
     }
 
-    printf("Welcome %s\n", argv[1]);
-
-    struct Message outgoing;
-    strcpy(outgoing.nickname, argv[1]); // Set user's nickname for outgoing messages
+    // Optional: client <nickname> -m [socket] talks to a local server through shared memory
+    const char* shmPath = NULL;
+    if (argc >= 3 && strcmp(argv[2], "-m") == 0) {
+        shmPath = (argc >= 4) ? argv[3] : DEFAULT_SHM_SOCKET;
+    }
 
-    int sockfd = settingUpClientSocket();
+    printf("Welcome %s\n", argv[1]);
 
-    struct Message incoming;
-    struct pollfd fds[2];
+    struct ChatClient client;
+    if (shmPath != NULL) {
+        if (chatConnectShm(&client, shmPath, argv[1]) != 0) {
+            error("Error negotiating shared memory");
+        }
+    } else if (chatConnect(&client, SERVER_ADDR, PORT, argv[1]) != 0) {
+        error("Error connecting to server");
+    }
+    chatSetCallback(&client, printMessage, client.nickname);
+    chatEnableBatches(&client); // History comes compressed, many messages per batch
 
+    struct pollfd fds[1 + CHAT_CLIENT_MAX_FDS];
     fds[0].fd = 0;             // Standard input (keyboard)
     fds[0].events = POLLIN;    // Monitor for input
-    fds[1].fd = sockfd;        // Server socket
-    fds[1].events = POLLIN;    // Monitor for incoming messages
+    setvbuf(stdin, NULL, _IONBF, 0); // fgets() must not read lines ahead of poll(), e.g. from a pipe
 
     // Start sending and receiving messages
+    printf("%s> ", client.nickname);
+    fflush(stdout); // Ensure prompt is shown immediately
     while (1) {
-        printf("%s> ", outgoing.nickname);
-        fflush(stdout); // Ensure prompt is shown immediately
-
-        int retpoll = poll(fds, 2, -1); // Wait for input from user or server
+        int nbFds = 1 + chatDescriptors(&client, &fds[1]);
+        int retpoll = poll(fds, nbFds, -1); // Wait for input from user or server
         if (retpoll < 0) {
             perror("poll failed");
-            return -1;
-        }
-        if (retpoll == 0) {
-            continue; // Shouldn't happen with -1 timeout, but safe to check
+            break;
         }
 
-        if (fds[0].revents == POLLIN) {
-            fgets(outgoing.message, 1023, stdin); // Read user input
-            outgoing.message[strcspn(outgoing.message, "\n")] = 0; // Remove newline
-
-            if (sendMessage(sockfd, &outgoing) < 0) {
-                perror("Error sending message");
-                break;
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            char line[BUFFER_LENGTH];
+            if (fgets(line, sizeof(line), stdin) == NULL) {
+                break; // End of input
+            }
+            line[strcspn(line, "\n")] = 0; // Remove newline
+
+            // Queued, then written at once if the socket has room
+            int queued;
+            if (strncmp(line, HISTORY_COMMAND " ", strlen(HISTORY_COMMAND) + 1) == 0) {
+                queued = chatRequestHistory(&client, atoi(line + strlen(HISTORY_COMMAND)));
+            } else if (strncmp(line, DIRECT_COMMAND " ", strlen(DIRECT_COMMAND) + 1) == 0) {
+                char* recipient = line + strlen(DIRECT_COMMAND) + 1;
+                char* text = recipient + strcspn(recipient, " ");
+                if (*text != '\0') {
+                    *text++ = '\0';
+                }
+                queued = chatSendDirect(&client, recipient, text);
+            } else {
+                queued = chatSend(&client, line, MESSAGE_INTERACTIVE);
             }
-        } else if (fds[1].revents == POLLIN) {
-            if (readMessage(fds[1].fd, &incoming) < 0) {
-                perror("Error reading message");
+            if (queued < 0 || chatFlush(&client) < 0) {
+                perror("Error sending message");
                 break;
             }
-            // Print received message, overwriting current prompt
-            printf("\r%s> %s\n", incoming.nickname, incoming.message);
-        } else {
-            printf("Unexcepted revent\n"); // Should not occur unless there's a poll error
+            printf("%s> ", client.nickname);
+            fflush(stdout);
+        }
+
+        if (chatHandleEvents(&client, &fds[1], nbFds - 1) < 0) {
+            printf("\rServer closed the connection\n");
             break;
         }
     }
 
-    close(sockfd); // Clean up on exit
+    // Clean up on exit
+    chatClose(&client);
     return 0;
 }
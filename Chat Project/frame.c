@@ -0,0 +1,43 @@
+#include "frame.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct Frame* createFrame(const struct Message* message, uint64_t readNs, uint64_t traceId) {
+    struct Frame* frame = malloc(sizeof(struct Frame));
+    if (frame == NULL) {
+        return NULL;
+    }
+    atomic_init(&frame->references, 1);
+    frame->readNs = readNs;
+    frame->traceId = traceId;
+    frame->payloadLength = 0;
+    encodeRecord(&frame->record, message);
+    return frame;
+}
+
+struct Frame* createBatchFrame(const struct Message* header, const void* payload, size_t length) {
+    struct Frame* frame = malloc(sizeof(struct Frame) + length);
+    if (frame == NULL) {
+        return NULL;
+    }
+    atomic_init(&frame->references, 1);
+    frame->readNs = 0;
+    frame->traceId = 0;
+    frame->payloadLength = (uint32_t)length;
+    encodeRecord(&frame->record, header);
+    memcpy(frame->payload, payload, length);
+    return frame;
+}
+
+struct Frame* retainFrame(struct Frame* frame) {
+    atomic_fetch_add_explicit(&frame->references, 1, memory_order_relaxed);
+    return frame;
+}
+
+void releaseFrame(struct Frame* frame) {
+    // Release/acquire: the thread freeing the frame sees every other holder done with it
+    if (atomic_fetch_sub_explicit(&frame->references, 1, memory_order_acq_rel) == 1) {
+        free(frame);
+    }
+}
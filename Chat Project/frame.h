@@ -0,0 +1,69 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chat.h"
+#include "message_store.h"
+
+/**
+ * A message encoded once and shared, by reference, by the persistence queue and the
+ * output queues of every recipient.
+ *
+ * The encoding is the on-disk MessageRecord; what goes on the wire is its `message`
+ * part, so the bytes sent to a client are the bytes stored at offset
+ * offsetof(struct MessageRecord, message) of its record in the history file.
+ */
+struct Frame {
+    atomic_int references;       ///< Holders of the frame; it is freed by the last releaseFrame()
+    uint64_t readNs;             ///< When the message was read, for the persistence histogram
+    uint64_t traceId;            ///< Trace of the message, 0 if not sampled
+    uint32_t payloadLength;      ///< Bytes sent right after the message (batches only)
+    struct MessageRecord record; ///< Magic, checksum and message
+    unsigned char payload[];     ///< Batch payload, contiguous with the message
+};
+
+_Static_assert(offsetof(struct Frame, payload) == offsetof(struct Frame, record) + sizeof(struct MessageRecord),
+               "the payload must follow the message so a frame is written in one piece");
+
+/**
+ * Encodes a message into a new frame holding one reference.
+ *
+ * @return The frame, or NULL if memory is exhausted
+ */
+struct Frame* createFrame(const struct Message* message, uint64_t readNs, uint64_t traceId);
+
+/**
+ * Builds a batch frame: a header message followed by a payload, never persisted.
+ *
+ * @return The frame, holding one reference, or NULL if memory is exhausted
+ */
+struct Frame* createBatchFrame(const struct Message* header, const void* payload, size_t length);
+
+/**
+ * Adds a reference to a frame.
+ */
+struct Frame* retainFrame(struct Frame* frame);
+
+/**
+ * Drops a reference, freeing the frame with the last one. Safe from any thread.
+ */
+void releaseFrame(struct Frame* frame);
+
+/**
+ * Returns the message of the frame, where the bytes sent to clients start.
+ */
+static inline const struct Message* frameMessage(const struct Frame* frame) {
+    return &frame->record.message;
+}
+
+/**
+ * Returns the number of bytes sent to clients for this frame.
+ */
+static inline size_t frameLength(const struct Frame* frame) {
+    return sizeof(struct Message) + frame->payloadLength;
+}
+
+#endif
@@ -0,0 +1,317 @@
+#include "handoff.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "shm_transport.h"
+
+#define HANDOFF_MAX_FDS 3  // Descriptors attached to one record (a shared-memory client)
+
+// Kept open until this process exits: its end of file tells the new process we are gone
+static int handoffFd = -1;
+
+// Sends one record with its descriptors (SOCK_SEQPACKET keeps records and descriptors together)
+static int sendRecord(int fd, const void* data, size_t size, const int* fds, int nbFds) {
+    struct iovec iov = { .iov_base = (void*)data, .iov_len = size };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (nbFds > 0) {
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = CMSG_SPACE(nbFds * sizeof(int));
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nbFds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nbFds * sizeof(int));
+    }
+    return (sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)size) ? 0 : -1;
+}
+
+// Receives one record and its descriptors, returns the number of descriptors or -1
+static int receiveRecord(int fd, void* data, size_t size, int* fds) {
+    struct iovec iov = { .iov_base = data, .iov_len = size };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer) };
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)size || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        return -1;
+    }
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL) {
+        return 0;
+    }
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int nbFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), nbFds * sizeof(int));
+    return nbFds;
+}
+
+int listenForUpgrade(const char* path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);  // Left behind by a previous run
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handOffServer(struct Server* _server) {
+    int fd = accept(_server->upgradeListenFd, NULL, NULL);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int nbConnections = 0;
+    for (int i = 1; i <= _server->nbClients; i++) {
+        nbConnections += !_server->clients[i].closing;
+    }
+
+    struct HandoffHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = HANDOFF_MAGIC;
+    header.version = HANDOFF_VERSION;
+    header.messageSize = sizeof(struct Message);
+    header.nbConnections = nbConnections;
+    header.nextConnectionId = _server->nextConnectionId;
+    header.origin = relayOrigin();
+    header.hasRelayListener = (_server->relayListenFd >= 0);
+    int listeners[2] = { _server->fds[0].fd, _server->relayListenFd };
+    if (sendRecord(fd, &header, sizeof(header), listeners, header.hasRelayListener ? 2 : 1) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    for (int i = 1; i <= _server->nbClients; i++) {
+        struct Connection* client = &_server->clients[i];
+        if (client->closing) {
+            continue;  // Closed by compactDescriptor() in this process
+        }
+
+        struct HandoffConnection record;
+        memset(&record, 0, sizeof(record));
+        record.id = client->id;
+        memcpy(record.nickname, client->nickname, NAME_LENGTH);
+        int fds[HANDOFF_MAX_FDS] = { _server->fds[i].fd };
+        int nbFds = 1;
+        if (client->shm != NULL) {
+            record.kind = HANDOFF_SHM;
+            fds[1] = client->shm->memFd;
+            fds[2] = client->shm->eventFd;
+            nbFds = 3;
+        } else if (client->relay != NULL) {
+            record.kind = HANDOFF_RELAY;
+            record.relay = *client->relay;
+        } else {
+            record.kind = HANDOFF_TCP;
+            record.received = client->received;
+            record.pending = client->pending;
+            record.batches = client->batches;
+        }
+        // The queued messages follow the record, in chunks: a slow client delays nobody
+        size_t queuedBytes;
+        uint32_t sentBytes;
+        unsigned char* queued = outboxSave(&client->outbox, &queuedBytes, &sentBytes);
+        if (queued == NULL && queuedBytes > 0) {
+            logMessage(LOG_WARNING, "Client %d lost %zu queued bytes in the handoff (out of memory)",
+                       _server->fds[i].fd, queuedBytes - sentBytes);
+            queuedBytes = 0;
+            sentBytes = 0;
+        }
+        record.queuedBytes = queuedBytes;
+        record.sentBytes = sentBytes;
+        int sent = sendRecord(fd, &record, sizeof(record), fds, nbFds);
+        for (size_t offset = 0; sent == 0 && offset < queuedBytes; offset += HANDOFF_CHUNK_BYTES) {
+            size_t chunk = (queuedBytes - offset < HANDOFF_CHUNK_BYTES) ? queuedBytes - offset : HANDOFF_CHUNK_BYTES;
+            sent = sendRecord(fd, queued + offset, chunk, NULL, 0);
+        }
+        free(queued);
+        if (sent < 0) {
+            logMessage(LOG_ERROR, "Handoff interrupted: %s", strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    handoffFd = fd;
+    return 0;
+}
+
+// Receives the queued messages of a connection, sent in chunks after its record
+static int receiveQueued(int fd, uint64_t length, unsigned char** queued) {
+    *queued = malloc(length);
+    if (*queued == NULL) {
+        return -1;
+    }
+    int unused[HANDOFF_MAX_FDS];
+    for (uint64_t offset = 0; offset < length; offset += HANDOFF_CHUNK_BYTES) {
+        size_t chunk = (length - offset < HANDOFF_CHUNK_BYTES) ? length - offset : HANDOFF_CHUNK_BYTES;
+        if (receiveRecord(fd, *queued + offset, chunk, unused) != 0) {
+            free(*queued);
+            *queued = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int takeOverServer(const char* path, int maxClients, struct Server* _server) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct HandoffHeader header;
+    int listeners[HANDOFF_MAX_FDS];
+    int nbListeners = receiveRecord(fd, &header, sizeof(header), listeners);
+    if (nbListeners < 1 || header.magic != HANDOFF_MAGIC || header.version != HANDOFF_VERSION
+        || header.messageSize != sizeof(struct Message) || nbListeners != 1 + (header.hasRelayListener != 0)) {
+        fprintf(stderr, "The running server speaks another handoff protocol\n");
+        for (int i = 0; i < nbListeners; i++) {
+            close(listeners[i]);
+        }
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+
+    *_server = adoptServer(listeners[0], maxClients);
+    _server->nextConnectionId = header.nextConnectionId;
+    if (header.hasRelayListener) {
+        _server->relayListenFd = listeners[1];
+    }
+    initRelay(header.origin);
+
+    int nbRelayPeers;
+    struct RelayPeer* peers = relayPeers(&nbRelayPeers);
+    for (uint32_t i = 0; i < header.nbConnections; i++) {
+        struct HandoffConnection record;
+        int fds[HANDOFF_MAX_FDS];
+        int nbFds = receiveRecord(fd, &record, sizeof(record), fds);
+        if (nbFds < 1) {
+            fprintf(stderr, "Handoff interrupted after %u connections\n", i);
+            break;
+        }
+
+        unsigned char* queued = NULL;
+        if (record.queuedBytes > 0 && receiveQueued(fd, record.queuedBytes, &queued) < 0) {
+            fprintf(stderr, "Handoff interrupted after %u connections\n", i);
+            for (int j = 0; j < nbFds; j++) {
+                close(fds[j]);
+            }
+            break;
+        }
+
+        struct Connection* client = adoptConnection(_server, fds[0]);
+        if (queued != NULL
+            && (client == NULL || outboxRestore(&client->outbox, queued, record.queuedBytes, record.sentBytes) < 0)) {
+            fprintf(stderr, "Connection %u lost %llu queued bytes in the handoff\n", record.id,
+                    (unsigned long long)(record.queuedBytes - record.sentBytes));
+        }
+        free(queued);
+        if (client == NULL) {
+            for (int j = 0; j < nbFds; j++) {
+                close(fds[j]);
+            }
+            continue;
+        }
+        if (outboxPending(&client->outbox)) {
+            _server->fds[_server->nbClients].events |= POLLOUT;  // Resume sending where the old process stopped
+        }
+        client->id = record.id;
+        record.nickname[NAME_LENGTH - 1] = '\0';
+        if (record.nickname[0] != '\0' && insertNickname(&_server->nicknames, record.nickname, _server->nbClients) == 0) {
+            memcpy(client->nickname, record.nickname, NAME_LENGTH);
+        }
+        if (record.kind == HANDOFF_SHM && nbFds == 3) {
+            client->shm = malloc(sizeof(struct ShmChannel));
+            if (client->shm == NULL || shmAdopt(client->shm, fds[0], fds[1], fds[2]) < 0) {
+                if (client->shm == NULL) {
+                    close(fds[1]);
+                    close(fds[2]);
+                } else {
+                    _server->fds[_server->nbClients].fd = -1;  // shmAdopt() closed the socket
+                }
+                free(client->shm);
+                client->shm = NULL;
+                client->closing = 1;
+            } else {
+                // Not POLLOUT: the ring is refilled on the doorbell, or on the first read
+                _server->fds[_server->nbClients].events = POLLIN;
+                client->resumed = 1;
+            }
+        } else if (record.kind == HANDOFF_RELAY) {
+            client->relay = malloc(sizeof(struct RelayLink));
+            if (client->relay == NULL) {
+                client->closing = 1;
+                continue;
+            }
+            *client->relay = record.relay;
+            _server->nbPeers++;
+            if (record.relay.connecting) {
+                _server->fds[_server->nbClients].events = POLLOUT;  // Read once connected
+            }
+            // The peers are given again on the command line, in the same order
+            if (record.relay.outbound >= 0) {
+                if (record.relay.outbound < nbRelayPeers) {
+                    peers[record.relay.outbound].linked = 1;
+                } else {
+                    client->relay->outbound = -1;
+                }
+            }
+        } else {
+            client->received = record.received;
+            client->pending = record.pending;
+            client->batches = record.batches;
+        }
+    }
+
+    // Wait for the old process to exit: it still owns the history and the Unix socket paths
+    char byte;
+    while (recv(fd, &byte, 1, 0) > 0) {
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,87 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+
+#include "chat.h"
+#include "relay.h"
+#include "server.h"
+
+#define DEFAULT_UPGRADE_SOCKET "chat_server.upgrade"  ///< Unix socket on which a new process asks for a handoff
+#define HANDOFF_MAGIC 0x46444E48u                      ///< "HNDF" in little-endian
+#define HANDOFF_VERSION 4                              ///< Bumped whenever the records below change
+#define HANDOFF_CHUNK_BYTES 65536                      ///< Largest record carrying queued messages
+
+/**
+ * First record of a handoff, sent with the listening sockets
+ * (TCP listener, then the relay listener if any).
+ */
+struct HandoffHeader {
+    uint32_t magic;              ///< HANDOFF_MAGIC
+    uint32_t version;            ///< HANDOFF_VERSION
+    uint32_t messageSize;        ///< sizeof(struct Message) of the old process, must match
+    uint32_t nbConnections;      ///< Connection records following this header
+    uint32_t nextConnectionId;   ///< Keeps connection ids unique across the upgrade
+    uint32_t origin;             ///< Relay origin id, kept so peers recognise the server
+    int32_t hasRelayListener;    ///< Set when the relay listening socket is attached
+    int32_t reserved;            ///< Zero
+};
+
+/**
+ * Kind of a handed-over connection, telling which descriptors come with it.
+ */
+enum HandoffKind {
+    HANDOFF_TCP,     ///< Client socket
+    HANDOFF_SHM,     ///< Negotiation socket, memory file and doorbell of a shared-memory client
+    HANDOFF_RELAY    ///< Link to a peer server
+};
+
+/**
+ * One connection and the part of its state that is not in the kernel. Its queued messages
+ * follow it, so nothing waits on a slow client and nothing is lost.
+ */
+struct HandoffConnection {
+    uint32_t kind;                ///< enum HandoffKind
+    uint32_t id;                  ///< Connection id
+    uint32_t batches;             ///< The client negotiated compressed history batches (TCP clients)
+    uint32_t sentBytes;           ///< Bytes of the first queued message already written
+    uint64_t queuedBytes;         ///< Length of the outboxSave() stream sent after the record,
+                                  ///< in records of at most HANDOFF_CHUNK_BYTES
+    uint64_t received;            ///< Bytes of `pending` received so far (TCP clients)
+    struct Message pending;       ///< Message being reassembled (TCP clients)
+    struct RelayLink relay;       ///< Link state (peer servers)
+    char nickname[NAME_LENGTH];   ///< Nickname held in the map for direct messages, empty if none
+};
+
+/**
+ * Creates the socket on which a new server process can ask this one for its connections.
+ *
+ * @param path Socket path (replaced if it exists)
+ * @return The listening socket, -1 on failure
+ */
+int listenForUpgrade(const char* path);
+
+/**
+ * Old process: hands the listening sockets and every open connection over to the new
+ * process asking on the upgrade socket. Once it succeeds the caller must stop serving,
+ * close its copies of the descriptors and exit; the new process waits for this exit
+ * before it opens the message history.
+ *
+ * @param _server Server whose connections are handed over
+ * @return 0 on success, -1 on failure (the old process keeps serving)
+ */
+int handOffServer(struct Server* _server);
+
+/**
+ * New process: takes the listening sockets and the connections over from the server
+ * listening on `path`, then waits for that server to exit.
+ * Restores the relay origin id of the old process.
+ *
+ * @param path Upgrade socket of the running server
+ * @param maxClients Maximum number of clients served at the same time
+ * @param _server Receives the server, ready to run
+ * @return 0 on success, -1 on failure
+ */
+int takeOverServer(const char* path, int maxClients, struct Server* _server);
+
+#endif
@@ -1,9 +1,14 @@
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 #include "chat.h"
 #include "message_store.h"
+#include "message_stats.h"
 
 #define DEFAULT_HISTORY_FILE "chat_history.dat"
 
@@ -16,7 +21,66 @@ void printUsage(const char* programName) {
     printf("  -u              Sort by username/nickname\n");
     printf("  -a              Sort in ascending order (default)\n");
     printf("  -d              Sort in descending order\n");
+    printf("  -s <time>       Only show messages sent at or after <time>\n");
+    printf("  -e <time>       Only show messages sent at or before <time>\n");
+    printf("  -N <nickname>   Only show messages sent by <nickname>\n");
+    printf("  -g <text>       Only show messages containing <text>\n");
+    printf("  -j <threads>    Number of scanning threads (default: number of CPUs)\n");
+    printf("  -m <megabytes>  Memory budget; larger histories are sorted on disk (default: %ld)\n",
+           DEFAULT_SORT_MEMORY / (1024 * 1024));
+    printf("  -F              Follow the file and print new messages as they are saved\n");
+    printf("  --stats         Print per-user, per-hour and message length statistics instead\n");
     printf("  -h              Display this help message\n");
+    printf("Times are given as seconds since the epoch or as \"YYYY-MM-DD[ HH:MM:SS]\" (local time)\n");
+}
+
+// Parses an epoch value or a local "YYYY-MM-DD[ HH:MM:SS]" date, returns -1 if invalid
+static time_t parseTime(const char* text) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    int fields = sscanf(text, "%d-%d-%d %d:%d:%d",
+                        &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                        &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+    if (fields == 3 || fields == 6) {
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        tm.tm_isdst = -1;
+        return mktime(&tm);
+    }
+
+    char* end;
+    long long epoch = strtoll(text, &end, 10);
+    if (*end != '\0' || epoch < 0) {
+        return -1;
+    }
+    return (time_t)epoch;
+}
+
+// Prints one message with its formatted timestamp
+static void printMessage(const struct Message* message) {
+    char timeStr[64];
+    struct tm* timeinfo = localtime(&message->timestamp);
+    strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", timeinfo);
+
+    printf("[%s] %s: %.*s\n",
+           timeStr,
+           message->nickname,
+           BUFFER_LENGTH, message->message);
+}
+
+// Visitor of the live tail: prints each new message as soon as it is decoded
+static int printFollowedMessage(const struct Message* message, void* context) {
+    (void)context;
+    printMessage(message);
+    fflush(stdout);
+    return 0;
+}
+
+// Visitor of the external sort: prints messages until the requested number is reached
+static int printSortedMessage(const struct Message* message, void* context) {
+    int* remaining = (int*)context;
+    printMessage(message);
+    return (*remaining > 0 && --(*remaining) == 0);
 }
 
 int main(int argc, char** argv) {
@@ -24,6 +88,12 @@ int main(int argc, char** argv) {
     int maxMessages = -1;  // -1 means display all available messages
     int sortByTime = 1;    // Default: sort messages by timestamp
     int ascending = 1;     // Default: sort in ascending order
+    int nbThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    long memoryBudget = DEFAULT_SORT_MEMORY;
+    int showStats = 0;
+    int follow = 0;
+    struct MessageFilter filter;
+    memset(&filter, 0, sizeof(filter));
 
     // Parse command-line arguments
     for (int i = 1; i < argc; i++) {
@@ -43,6 +113,43 @@ int main(int argc, char** argv) {
             ascending = 1;
         } else if (strcmp(argv[i], "-d") == 0) {
             ascending = 0;
+        } else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "-e") == 0) && i + 1 < argc) {
+            time_t bound = parseTime(argv[i + 1]);
+            if (bound < 0) {
+                fprintf(stderr, "Invalid time: %s\n", argv[i + 1]);
+                return 1;
+            }
+            if (argv[i][1] == 's') {
+                filter.since = bound;
+            } else {
+                filter.until = bound;
+            }
+            i++;
+        } else if (strcmp(argv[i], "-N") == 0 && i + 1 < argc) {
+            strncpy(filter.nickname, argv[++i], NAME_LENGTH - 1);
+        } else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+            filter.substring = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nbThreads = atoi(argv[++i]);
+            if (nbThreads <= 0) {
+                fprintf(stderr, "Invalid number of threads\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            // Checked before scaling: the multiplication must not overflow
+            char* end;
+            errno = 0;
+            long megabytes = strtol(argv[++i], &end, 10);
+            if (errno != 0 || end == argv[i] || *end != '\0' || megabytes <= 0
+                || megabytes > LONG_MAX / (1024 * 1024)) {
+                fprintf(stderr, "Invalid memory budget\n");
+                return 1;
+            }
+            memoryBudget = megabytes * 1024 * 1024;
+        } else if (strcmp(argv[i], "-F") == 0) {
+            follow = 1; // Behave like tail -f
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            showStats = 1; // Aggregate in one pass instead of listing messages
         } else if (strcmp(argv[i], "-h") == 0) {
             printUsage(argv[0]);
             return 0;
@@ -53,67 +160,85 @@ int main(int argc, char** argv) {
         }
     }
 
-    // Open the message store file for reading
-    if (initMessageStore(filename) != 0) {
-        fprintf(stderr, "Failed to open message history file: %s\n", filename);
-        return 1;
+    // Damaged records are skipped silently: say so when nothing in the file is intact
+    struct stat st;
+    if (stat(filename, &st) == 0 && st.st_size >= (off_t)sizeof(struct MessageRecord)
+        && containsValidRecord(filename) == 0) {
+        fprintf(stderr, "Warning: no record of %s passed validation; a history saved before checksums "
+                        "is only converted when the server opens it\n", filename);
     }
 
-    // If user didn't specify how many messages, determine from file size
-    if (maxMessages <= 0) {
-        FILE* file = fopen(filename, "rb");
-        if (file == NULL) {
-            fprintf(stderr, "Failed to open message history file: %s\n", filename);
+    // Live tail: show the last messages in file order, then only what gets appended
+    if (follow) {
+        int backlog = (maxMessages > 0) ? maxMessages : 10;
+        if (followMessages(filename, &filter, backlog, printFollowedMessage, NULL) < 0) {
+            fprintf(stderr, "Failed to follow message history file: %s\n", filename);
             return 1;
         }
+        return 0;
+    }
 
-        fseek(file, 0, SEEK_END);
-        long fileSize = ftell(file); // Get total file size in bytes
-        maxMessages = fileSize / sizeof(struct Message); // Calculate number of stored messages
-        fclose(file);
-
-        if (maxMessages <= 0) {
-            printf("No messages in history\n");
-            return 0;
+    // Statistics are aggregated in one parallel pass and never need the messages in memory
+    if (showStats) {
+        struct MessageStats stats;
+        if (computeMessageStats(filename, &filter, nbThreads, &stats) < 0) {
+            fprintf(stderr, "Failed to read message history file: %s\n", filename);
+            freeMessageStats(&stats);
+            return 1;
         }
+        printMessageStats(&stats, stdout);
+        freeMessageStats(&stats);
+        return 0;
     }
 
-    // Allocate memory to hold the messages
-    struct Message* messages = malloc(maxMessages * sizeof(struct Message));
-    if (messages == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        closeMessageStore();
+    // Histories larger than the memory budget are sorted on disk and streamed out
+    if (stat(filename, &st) != 0) {
+        fprintf(stderr, "Failed to open message history file: %s\n", filename);
         return 1;
     }
+    if (st.st_size > memoryBudget) {
+        printf("Message History (sorted on disk, %ld MB budget):\n", memoryBudget / (1024 * 1024));
+        printf("--------------------\n");
+        int remaining = maxMessages;
+        int numShown = sortMessagesExternal(filename, &filter, memoryBudget, sortByTime, ascending,
+                                            printSortedMessage, &remaining);
+        if (numShown < 0) {
+            fprintf(stderr, "Failed to sort message history file: %s\n", filename);
+            return 1;
+        }
+        printf("--------------------\n");
+        printf("%d messages\n", numShown);
+        return 0;
+    }
 
-    // Load messages from the file with specified sorting options
-    int numLoaded = loadMessages(messages, maxMessages, sortByTime, ascending);
-    if (numLoaded <= 0) {
+    // Scan the whole file in parallel, keeping only the messages that pass the filters
+    struct Message* messages = NULL;
+    int numMatched = scanMessages(filename, &filter, nbThreads, &messages);
+    if (numMatched < 0) {
+        fprintf(stderr, "Failed to read message history file: %s\n", filename);
+        return 1;
+    }
+    if (numMatched == 0) {
         printf("No messages in history\n");
-        free(messages);
-        closeMessageStore();
         return 0;
     }
 
+    sortMessages(messages, numMatched, sortByTime, ascending);
+
+    // Display at most maxMessages of them (-1 means all)
+    int numLoaded = (maxMessages > 0 && maxMessages < numMatched) ? maxMessages : numMatched;
+
     // Display loaded messages with timestamp formatting
     printf("Message History (%d messages):\n", numLoaded);
     printf("--------------------\n");
 
     for (int i = 0; i < numLoaded; i++) {
-        char timeStr[64];
-        struct tm* timeinfo = localtime(&messages[i].timestamp);
-        strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", timeinfo);
-
-        printf("[%s] %s: %s\n",
-               timeStr,
-               messages[i].nickname,
-               messages[i].message);
+        printMessage(&messages[i]);
     }
 
     printf("--------------------\n");
 
     // Clean up
     free(messages);
-    closeMessageStore();
     return 0;
 }
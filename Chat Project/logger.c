@@ -0,0 +1,278 @@
+#include "logger.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// One log event as produced on the hot path: nothing here needs formatting I/O
+struct LogRecord {
+    uint64_t realtimeNs;          // CLOCK_REALTIME when the event was logged
+    int level;
+    int length;                   // Bytes used in text
+    char text[LOG_TEXT_LENGTH];
+};
+
+// Ring owned by one producer thread and drained by the writer thread
+struct LogRing {
+    struct LogRecord records[LOG_RING_SLOTS];
+    atomic_uint_fast64_t head;    // Next record to write out (advanced by the writer)
+    atomic_uint_fast64_t tail;    // Next free slot (advanced by the producer)
+    atomic_int retired;           // Set when the producer thread exited: freed once drained
+    struct LogRing* next;         // Registration list
+};
+
+static struct LogRing* rings = NULL;             // Rings of the threads that logged, until freed
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static int writerActive = 0;                     // Under ringsLock: the writer may read the rings
+static _Thread_local struct LogRing* threadRing = NULL;
+static pthread_key_t ringKey;                    // Retires the ring of an exiting thread
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+
+static FILE* logOutput = NULL;
+static enum LogLevel logLevel = LOG_INFO;
+static pthread_t writerThread;
+static atomic_int running = 0;
+static atomic_int writerIdle = 0;                // Set while the writer waits on queuedEvent
+static int queuedEvent = -1;                     // Rung by a producer when the idle writer has work;
+                                                 // kept open so a late ring never hits a reused fd
+static atomic_uint_fast64_t dropped = 0;
+
+static const char* levelNames[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+// Unlinks and frees a ring; called with ringsLock held, by the only thread reading the rings
+static void freeRing(struct LogRing* ring) {
+    struct LogRing** link = &rings;
+    while (*link != ring) {
+        link = &(*link)->next;
+    }
+    *link = ring->next;
+    free(ring);
+}
+
+// Thread exit: the writer frees the ring once it wrote the last records, or right away if
+// there is no writer
+static void retireRing(void* value) {
+    struct LogRing* ring = value;
+    threadRing = NULL;   // A later destructor that logs registers a new ring
+    pthread_mutex_lock(&ringsLock);
+    if (writerActive) {
+        atomic_store_explicit(&ring->retired, 1, memory_order_release);
+    }
+    else {
+        freeRing(ring);
+    }
+    pthread_mutex_unlock(&ringsLock);
+}
+
+static void createRingKey(void) {
+    pthread_key_create(&ringKey, retireRing);
+}
+
+// Returns the ring of the calling thread, registering it on first use
+static struct LogRing* currentRing(void) {
+    if (threadRing == NULL) {
+        struct LogRing* ring = calloc(1, sizeof(struct LogRing));
+        if (ring == NULL) {
+            return NULL;
+        }
+        pthread_once(&ringKeyOnce, createRingKey);
+        pthread_setspecific(ringKey, ring);
+        pthread_mutex_lock(&ringsLock);
+        ring->next = rings;
+        rings = ring;
+        pthread_mutex_unlock(&ringsLock);
+        threadRing = ring;
+    }
+    return threadRing;
+}
+
+// Rings the eventfd; the counter keeps the wakeup until the writer reads it
+static void wakeWriter(void) {
+    uint64_t one = 1;
+    while (write(queuedEvent, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+// Formats and writes one record
+static void writeRecord(FILE* out, const struct LogRecord* record) {
+    time_t seconds = (time_t)(record->realtimeNs / 1000000000u);
+    struct tm tm;
+    char timeStr[32];
+    localtime_r(&seconds, &tm);
+    strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(out, "[%s.%03u] %-5s %.*s\n", timeStr,
+            (unsigned)(record->realtimeNs / 1000000u % 1000u),
+            levelNames[record->level], record->length, record->text);
+}
+
+// Writes out everything currently in the rings and frees the drained rings of exited
+// threads; returns the number of records written
+static int drainRings(FILE* out) {
+    int written = 0;
+    pthread_mutex_lock(&ringsLock);
+    struct LogRing* ring = rings;
+    pthread_mutex_unlock(&ringsLock);
+
+    // Other threads only ever prepend rings, so the list after the head is stable
+    while (ring != NULL) {
+        struct LogRing* next = ring->next;
+        // Read before the tail: once retired, the tail does not move any more
+        int retired = atomic_load_explicit(&ring->retired, memory_order_acquire);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        for (; head != tail; head++) {
+            writeRecord(out, &ring->records[head & (LOG_RING_SLOTS - 1)]);
+            written++;
+        }
+        atomic_store(&ring->head, head);
+        if (retired) {
+            pthread_mutex_lock(&ringsLock);
+            freeRing(ring);
+            pthread_mutex_unlock(&ringsLock);
+        }
+        ring = next;
+    }
+    if (written > 0) {
+        fflush(out);
+    }
+    return written;
+}
+
+// Returns 1 if a ring holds records the writer has not written yet
+static int recordsPending(void) {
+    pthread_mutex_lock(&ringsLock);
+    struct LogRing* ring = rings;
+    pthread_mutex_unlock(&ringsLock);
+    for (; ring != NULL; ring = ring->next) {
+        if (atomic_load(&ring->tail) != atomic_load_explicit(&ring->head, memory_order_relaxed)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Writer thread: drains the rings, sleeps on queuedEvent when there is nothing to do
+static void* runWriter(void* arg) {
+    (void)arg;
+    uint64_t reportedDrops = 0;
+    while (atomic_load(&running)) {
+        int written = drainRings(logOutput);
+
+        uint64_t drops = atomic_load_explicit(&dropped, memory_order_relaxed);
+        if (drops != reportedDrops) {
+            fprintf(logOutput, "[logger] %llu records dropped so far\n", (unsigned long long)drops);
+            reportedDrops = drops;
+        }
+        if (written != 0) {
+            continue;
+        }
+
+        // Announce the sleep, then look again: a record logged in between rings queuedEvent
+        atomic_store(&writerIdle, 1);
+        if (!recordsPending() && atomic_load(&running)) {
+            uint64_t count;
+            while (read(queuedEvent, &count, sizeof(count)) < 0 && errno == EINTR) {
+            }
+        }
+        atomic_store(&writerIdle, 0);
+    }
+    drainRings(logOutput);
+    return NULL;
+}
+
+int startLogger(FILE* out, enum LogLevel minLevel) {
+    logOutput = out;
+    logLevel = minLevel;
+    if (queuedEvent < 0) {
+        queuedEvent = eventfd(0, EFD_CLOEXEC);
+    }
+    if (queuedEvent < 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&ringsLock);
+    writerActive = 1;
+    pthread_mutex_unlock(&ringsLock);
+    atomic_store(&running, 1);
+    if (pthread_create(&writerThread, NULL, runWriter, NULL) != 0) {
+        atomic_store(&running, 0);
+        stopLogger();
+        return -1;
+    }
+    return 0;
+}
+
+void stopLogger(void) {
+    if (atomic_exchange(&running, 0)) {
+        wakeWriter();
+        pthread_join(writerThread, NULL);
+        fflush(logOutput);
+    }
+
+    // Nobody reads the rings any more: rings of threads that exited meanwhile go now, the
+    // others when their thread exits
+    pthread_mutex_lock(&ringsLock);
+    writerActive = 0;
+    struct LogRing* ring = rings;
+    while (ring != NULL) {
+        struct LogRing* next = ring->next;
+        if (atomic_load_explicit(&ring->retired, memory_order_relaxed)) {
+            freeRing(ring);
+        }
+        ring = next;
+    }
+    pthread_mutex_unlock(&ringsLock);
+}
+
+void logMessage(enum LogLevel level, const char* format, ...) {
+    if (level < logLevel) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    va_list args;
+    va_start(args, format);
+
+    // Before the writer runs (or after it stopped) there is nobody to drain a ring
+    struct LogRing* ring = atomic_load(&running) ? currentRing() : NULL;
+    if (ring == NULL) {
+        struct LogRecord record;
+        record.realtimeNs = (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+        record.level = level;
+        int length = vsnprintf(record.text, LOG_TEXT_LENGTH, format, args);
+        record.length = (length < 0) ? 0 : (length < LOG_TEXT_LENGTH ? length : LOG_TEXT_LENGTH - 1);
+        writeRecord(stderr, &record);
+        va_end(args);
+        return;
+    }
+
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head >= LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);  // Never wait for the writer
+        va_end(args);
+        return;
+    }
+
+    struct LogRecord* record = &ring->records[tail & (LOG_RING_SLOTS - 1)];
+    record->realtimeNs = (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+    record->level = level;
+    int length = vsnprintf(record->text, LOG_TEXT_LENGTH, format, args);
+    record->length = (length < 0) ? 0 : (length < LOG_TEXT_LENGTH ? length : LOG_TEXT_LENGTH - 1);
+    va_end(args);
+
+    atomic_store(&ring->tail, tail + 1);  // Sequentially consistent: ordered before reading writerIdle
+    if (atomic_load(&writerIdle)) {
+        wakeWriter();
+    }
+}
+
+uint64_t droppedLogRecords(void) {
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
@@ -0,0 +1,53 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define LOG_RING_SLOTS 1024     ///< Records buffered per logging thread (power of two)
+#define LOG_TEXT_LENGTH 240     ///< Longest text kept in a record; longer texts are truncated
+
+/**
+ * Severity of a log record.
+ */
+enum LogLevel {
+    LOG_DEBUG,    ///< Per-iteration details, only shown in verbose mode
+    LOG_INFO,     ///< Normal events: connections, messages
+    LOG_WARNING,  ///< Something failed but the server keeps going
+    LOG_ERROR     ///< A failure that stops part of the server
+};
+
+/**
+ * Starts the background thread that formats and writes the log records.
+ * Until it is started, logMessage() writes synchronously to stderr.
+ *
+ * @param out Stream receiving the formatted records (e.g. stdout)
+ * @param minLevel Records below this level are discarded at the call site
+ * @return 0 on success, -1 if the thread could not be started
+ */
+int startLogger(FILE* out, enum LogLevel minLevel);
+
+/**
+ * Writes out every pending record, then stops the background thread and frees the rings of
+ * the threads that exited.
+ */
+void stopLogger(void);
+
+/**
+ * Logs a printf-style message without ever blocking on I/O.
+ * The text is formatted on the calling thread: vsnprintf renders it, truncated to
+ * LOG_TEXT_LENGTH, into a record (raw timestamp, level, text) pushed onto a single-producer
+ * single-consumer ring owned by the calling thread. The arguments cannot be kept for later
+ * since a %s string may not outlive the call. Only the date formatting and the write are
+ * left to the background thread, woken through an eventfd when it sleeps. When the ring
+ * is full the record is dropped and counted instead of waiting for the writer. The ring is
+ * freed once the thread exits and its records are written.
+ */
+void logMessage(enum LogLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Returns the number of records dropped because a ring was full.
+ */
+uint64_t droppedLogRecords(void);
+
+#endif
@@ -0,0 +1,152 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+static uint32_t read32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hashPrefix(uint32_t prefix) {
+    return (prefix * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+size_t lzCompressBound(size_t length) {
+    return length + length / 255 + 16;
+}
+
+// Writes the extension bytes of a length whose nibble saturated at 15
+static unsigned char* writeLength(unsigned char* out, size_t rest) {
+    while (rest >= 255) {
+        *out++ = 255;
+        rest -= 255;
+    }
+    *out++ = (unsigned char)rest;
+    return out;
+}
+
+// Emits one sequence; offset 0 marks the final, literals-only one. Returns NULL if it does not fit.
+static unsigned char* writeSequence(unsigned char* out, const unsigned char* end, const unsigned char* literals,
+                                    size_t nbLiterals, size_t offset, size_t matchLength) {
+    size_t extra = matchLength >= LZ_MIN_MATCH ? matchLength - LZ_MIN_MATCH : 0;
+    size_t worst = 1 + nbLiterals + nbLiterals / 255 + 1 + 2 + extra / 255 + 1;
+    if ((size_t)(end - out) < worst) {
+        return NULL;
+    }
+
+    unsigned char* token = out++;
+    *token = (unsigned char)((nbLiterals >= 15 ? 15 : nbLiterals) << 4);
+    if (nbLiterals >= 15) {
+        out = writeLength(out, nbLiterals - 15);
+    }
+    memcpy(out, literals, nbLiterals);
+    out += nbLiterals;
+    if (offset == 0) {
+        return out;
+    }
+
+    *out++ = (unsigned char)(offset & 0xFF);
+    *out++ = (unsigned char)(offset >> 8);
+    *token |= (unsigned char)(extra >= 15 ? 15 : extra);
+    if (extra >= 15) {
+        out = writeLength(out, extra - 15);
+    }
+    return out;
+}
+
+size_t lzCompress(const void* source, size_t length, void* destination, size_t capacity) {
+    const unsigned char* in = (const unsigned char*)source;
+    unsigned char* out = (unsigned char*)destination;
+    const unsigned char* outEnd = out + capacity;
+    uint32_t table[1 << LZ_HASH_BITS];  // Position + 1 of the last prefix seen per slot, 0 if none
+    memset(table, 0, sizeof(table));
+
+    size_t anchor = 0;  // First byte not yet emitted
+    size_t position = 0;
+    while (length >= LZ_MIN_MATCH && position <= length - LZ_MIN_MATCH) {
+        uint32_t prefix = read32(in + position);
+        uint32_t slot = hashPrefix(prefix);
+        size_t candidate = table[slot];
+        table[slot] = (uint32_t)(position + 1);
+        if (candidate == 0 || position - (candidate - 1) > LZ_MAX_OFFSET || read32(in + candidate - 1) != prefix) {
+            position++;
+            continue;
+        }
+
+        candidate--;
+        size_t matchLength = LZ_MIN_MATCH;
+        while (position + matchLength < length && in[candidate + matchLength] == in[position + matchLength]) {
+            matchLength++;
+        }
+        out = writeSequence(out, outEnd, in + anchor, position - anchor, position - candidate, matchLength);
+        if (out == NULL) {
+            return 0;
+        }
+        position += matchLength;
+        anchor = position;
+    }
+
+    out = writeSequence(out, outEnd, in + anchor, length - anchor, 0, 0);
+    return (out == NULL) ? 0 : (size_t)(out - (unsigned char*)destination);
+}
+
+// Reads the extension bytes of a saturated nibble, -1 past the end of the input
+static long readLength(const unsigned char** in, const unsigned char* end, size_t base) {
+    size_t total = base;
+    unsigned char byte;
+    do {
+        if (*in >= end) {
+            return -1;
+        }
+        byte = *(*in)++;
+        total += byte;
+    } while (byte == 255);
+    return (long)total;
+}
+
+long lzDecompress(const void* source, size_t length, void* destination, size_t capacity) {
+    const unsigned char* in = (const unsigned char*)source;
+    const unsigned char* inEnd = in + length;
+    unsigned char* out = (unsigned char*)destination;
+    size_t produced = 0;
+
+    while (in < inEnd) {
+        unsigned char token = *in++;
+        long nbLiterals = token >> 4;
+        if (nbLiterals == 15 && (nbLiterals = readLength(&in, inEnd, 15)) < 0) {
+            return -1;
+        }
+        if ((size_t)(inEnd - in) < (size_t)nbLiterals || capacity - produced < (size_t)nbLiterals) {
+            return -1;
+        }
+        memcpy(out + produced, in, nbLiterals);
+        in += nbLiterals;
+        produced += nbLiterals;
+        if (in == inEnd) {
+            break;  // Final sequence: literals only
+        }
+
+        if (inEnd - in < 2) {
+            return -1;
+        }
+        size_t offset = in[0] | ((size_t)in[1] << 8);
+        in += 2;
+        long matchLength = token & 0xF;
+        if (matchLength == 15 && (matchLength = readLength(&in, inEnd, 15)) < 0) {
+            return -1;
+        }
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || offset > produced || capacity - produced < (size_t)matchLength) {
+            return -1;
+        }
+        // Byte by byte: the match may overlap what it produces (runs)
+        unsigned char* match = out + produced - offset;
+        for (long i = 0; i < matchLength; i++) {
+            out[produced + i] = match[i];
+        }
+        produced += matchLength;
+    }
+    return (long)produced;
+}
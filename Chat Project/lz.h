@@ -0,0 +1,40 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+#define LZ_MIN_MATCH 4       ///< Shortest match encoded
+#define LZ_MAX_OFFSET 65535  ///< Farthest match, offsets are stored on two bytes
+#define LZ_HASH_BITS 12      ///< log2 of the entries of the match finder's hash table
+
+/**
+ * Worst-case size of the compressed form of `length` bytes (incompressible input).
+ */
+size_t lzCompressBound(size_t length);
+
+/**
+ * Compresses a buffer with a byte-oriented LZ77 in the spirit of LZ4: a sequence is a token
+ * (literal count and match length nibbles, extended by 255-valued bytes), the literals,
+ * a little-endian 16-bit offset and the match. The last sequence only holds literals.
+ * Matches are found through a hash table of 4-byte prefixes, one candidate per slot.
+ *
+ * @param source Bytes to compress
+ * @param length Number of bytes
+ * @param destination Output buffer
+ * @param capacity Size of the output buffer (lzCompressBound(length) always suffices)
+ * @return Compressed size, 0 if it does not fit in capacity
+ */
+size_t lzCompress(const void* source, size_t length, void* destination, size_t capacity);
+
+/**
+ * Decompresses what lzCompress() produced, checking every length and offset.
+ *
+ * @param source Compressed bytes
+ * @param length Number of compressed bytes
+ * @param destination Output buffer
+ * @param capacity Size of the output buffer
+ * @return Decompressed size, -1 if the input is corrupted or does not fit in capacity
+ */
+long lzDecompress(const void* source, size_t length, void* destination, size_t capacity);
+
+#endif
@@ -0,0 +1,256 @@
+#include "message_stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define INITIAL_USERS 64           // Counters allocated for the first nickname seen
+#define HISTOGRAM_WIDTH 50         // Width in characters of the longest histogram bar
+
+// Returns the counters of a nickname (NUL-terminated), adding them if needed
+static struct NicknameStats* findUser(struct MessageStats* stats, const char* nickname) {
+    if (stats->nicknameIndex.slots == NULL && initNicknameMap(&stats->nicknameIndex) < 0) {
+        return NULL;
+    }
+    int index = findNickname(&stats->nicknameIndex, nickname);
+    if (index > 0) {
+        return &stats->users[index - 1];
+    }
+
+    if (stats->userCount == stats->userCapacity) {
+        int capacity = (stats->userCapacity == 0) ? INITIAL_USERS : stats->userCapacity * 2;
+        struct NicknameStats* users = realloc(stats->users, capacity * sizeof(struct NicknameStats));
+        if (users == NULL) {
+            return NULL;
+        }
+        stats->users = users;
+        stats->userCapacity = capacity;
+    }
+    // The map holds 1 + the index, since 0 marks a free slot there
+    if (insertNickname(&stats->nicknameIndex, nickname, stats->userCount + 1) < 0) {
+        return NULL;
+    }
+    struct NicknameStats* user = &stats->users[stats->userCount++];
+    memset(user, 0, sizeof(*user));
+    strncpy(user->nickname, nickname, NAME_LENGTH - 1);
+    return user;
+}
+
+// Visitor of the parallel pass: adds one message to the range aggregates
+static int accumulateMessage(const struct Message* message, void* context) {
+    struct MessageStats* stats = (struct MessageStats*)context;
+    if (!matchMessage(message, stats->filter)) {
+        return 0;
+    }
+
+    // Records come straight from disk: terminate the nickname, and give an empty one a
+    // placeholder so the report has something to show
+    char nickname[NAME_LENGTH];
+    strncpy(nickname, message->nickname, NAME_LENGTH - 1);
+    nickname[NAME_LENGTH - 1] = '\0';
+    if (nickname[0] == '\0') {
+        strcpy(nickname, "?");
+    }
+    struct NicknameStats* user = findUser(stats, nickname);
+    if (user == NULL) {
+        return -1;
+    }
+
+    int length = (int)strnlen(message->message, BUFFER_LENGTH);
+    user->messages++;
+    user->bytes += length;
+    stats->total++;
+    stats->totalBytes += length;
+    stats->lengths[length]++;
+
+    if (stats->total == 1 || message->timestamp < stats->first) {
+        stats->first = message->timestamp;
+    }
+    if (stats->total == 1 || message->timestamp > stats->last) {
+        stats->last = message->timestamp;
+    }
+
+    // Histories are mostly in time order: only call localtime_r when leaving the cached hour
+    if (message->timestamp < stats->hourStart || message->timestamp >= stats->hourStart + 3600) {
+        struct tm tm;
+        localtime_r(&message->timestamp, &tm);
+        stats->hour = tm.tm_hour;
+        stats->hourStart = message->timestamp - tm.tm_min * 60 - tm.tm_sec;
+    }
+    stats->perHour[stats->hour]++;
+    return 0;
+}
+
+// Adds the aggregates of one range into the final statistics
+static int mergeMessageStats(struct MessageStats* into, const struct MessageStats* from) {
+    if (from->total == 0) {
+        return 0;
+    }
+    if (into->total == 0 || from->first < into->first) {
+        into->first = from->first;
+    }
+    if (into->total == 0 || from->last > into->last) {
+        into->last = from->last;
+    }
+    into->total += from->total;
+    into->totalBytes += from->totalBytes;
+    for (int h = 0; h < 24; h++) {
+        into->perHour[h] += from->perHour[h];
+    }
+    for (int l = 0; l <= BUFFER_LENGTH; l++) {
+        into->lengths[l] += from->lengths[l];
+    }
+    for (int i = 0; i < from->userCount; i++) {
+        const struct NicknameStats* entry = &from->users[i];
+        struct NicknameStats* user = findUser(into, entry->nickname);
+        if (user == NULL) {
+            return -1;
+        }
+        user->messages += entry->messages;
+        user->bytes += entry->bytes;
+    }
+    return 0;
+}
+
+// Initializes an empty aggregate whose hour cache is invalid
+static void initMessageStats(struct MessageStats* stats, const struct MessageFilter* filter) {
+    memset(stats, 0, sizeof(*stats));
+    stats->filter = filter;
+    stats->hourStart = (time_t)-3601;
+    stats->hour = 0;
+}
+
+/**
+ * Aggregates every range into its own MessageStats, then merges them.
+ */
+int computeMessageStats(const char* filename, const struct MessageFilter* filter, int nbThreads,
+                        struct MessageStats* stats) {
+    if (stats == NULL) {
+        return -1;
+    }
+    // Initialized before anything can fail, so the caller may always free it
+    initMessageStats(stats, filter);
+    if (nbThreads < 1) {
+        return -1;
+    }
+
+    struct MessageStats* partial = malloc(nbThreads * sizeof(struct MessageStats));
+    void** contexts = malloc(nbThreads * sizeof(void*));
+    if (partial == NULL || contexts == NULL) {
+        free(partial);
+        free(contexts);
+        return -1;
+    }
+    for (int i = 0; i < nbThreads; i++) {
+        initMessageStats(&partial[i], filter);
+        contexts[i] = &partial[i];
+    }
+
+    int result = (visitMessagesParallel(filename, nbThreads, accumulateMessage, contexts) < 0) ? -1 : 0;
+    for (int i = 0; i < nbThreads; i++) {
+        if (result == 0 && mergeMessageStats(stats, &partial[i]) < 0) {
+            result = -1;
+        }
+        freeMessageStats(&partial[i]);
+    }
+    free(partial);
+    free(contexts);
+    return result;
+}
+
+// Returns the smallest length such that at least `percent` % of the messages are not longer
+static int lengthPercentile(const struct MessageStats* stats, double percent) {
+    long rank = (long)(percent / 100.0 * stats->total + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    long seen = 0;
+    for (int l = 0; l <= BUFFER_LENGTH; l++) {
+        seen += stats->lengths[l];
+        if (seen >= rank) {
+            return l;
+        }
+    }
+    return BUFFER_LENGTH;
+}
+
+// Orders nickname counters by decreasing number of messages
+static int compareByMessages(const void* a, const void* b) {
+    const struct NicknameStats* userA = (const struct NicknameStats*)a;
+    const struct NicknameStats* userB = (const struct NicknameStats*)b;
+    if (userA->messages != userB->messages) {
+        return (userA->messages > userB->messages) ? -1 : 1;
+    }
+    return strncmp(userA->nickname, userB->nickname, NAME_LENGTH);
+}
+
+/**
+ * Prints the merged statistics as a plain-text report.
+ */
+void printMessageStats(const struct MessageStats* stats, FILE* out) {
+    fprintf(out, "Message Statistics (%ld messages, %ld bytes of text):\n", stats->total, stats->totalBytes);
+    fprintf(out, "--------------------\n");
+    if (stats->total == 0) {
+        fprintf(out, "--------------------\n");
+        return;
+    }
+
+    char firstStr[64];
+    char lastStr[64];
+    struct tm tm;
+    strftime(firstStr, sizeof(firstStr), "%Y-%m-%d %H:%M:%S", localtime_r(&stats->first, &tm));
+    strftime(lastStr, sizeof(lastStr), "%Y-%m-%d %H:%M:%S", localtime_r(&stats->last, &tm));
+    fprintf(out, "Period: %s -> %s\n\n", firstStr, lastStr);
+
+    // Messages per user, busiest first
+    struct NicknameStats* users = malloc(stats->userCount * sizeof(struct NicknameStats));
+    if (users != NULL) {
+        int count = stats->userCount;
+        memcpy(users, stats->users, count * sizeof(struct NicknameStats));
+        qsort(users, count, sizeof(struct NicknameStats), compareByMessages);
+
+        fprintf(out, "Messages per user (%d users):\n", count);
+        for (int i = 0; i < count; i++) {
+            fprintf(out, "  %-*s %10ld  (%5.1f%%, avg %ld chars)\n",
+                    NAME_LENGTH, users[i].nickname, users[i].messages,
+                    100.0 * users[i].messages / stats->total, users[i].bytes / users[i].messages);
+        }
+        free(users);
+    }
+
+    // Histogram per hour of the day
+    long busiest = 1;
+    for (int h = 0; h < 24; h++) {
+        if (stats->perHour[h] > busiest) {
+            busiest = stats->perHour[h];
+        }
+    }
+    fprintf(out, "\nMessages per hour of the day:\n");
+    for (int h = 0; h < 24; h++) {
+        int width = (int)(stats->perHour[h] * HISTOGRAM_WIDTH / busiest);
+        fprintf(out, "  %02dh %10ld |", h, stats->perHour[h]);
+        for (int i = 0; i < width; i++) {
+            fputc('#', out);
+        }
+        fputc('\n', out);
+    }
+
+    fprintf(out, "\nMessage length (chars): avg %.1f, p50 %d, p90 %d, p99 %d, max %d\n",
+            (double)stats->totalBytes / stats->total,
+            lengthPercentile(stats, 50), lengthPercentile(stats, 90),
+            lengthPercentile(stats, 99), lengthPercentile(stats, 100));
+    fprintf(out, "--------------------\n");
+}
+
+/**
+ * Frees the nickname map and the counters.
+ */
+void freeMessageStats(struct MessageStats* stats) {
+    if (stats != NULL) {
+        freeNicknameMap(&stats->nicknameIndex);
+        free(stats->users);
+        stats->users = NULL;
+        stats->userCapacity = 0;
+        stats->userCount = 0;
+    }
+}
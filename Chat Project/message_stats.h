@@ -0,0 +1,62 @@
+#ifndef MESSAGE_STATS_H
+#define MESSAGE_STATS_H
+
+#include <stdio.h>
+
+#include "chat.h"
+#include "message_store.h"
+#include "nickname_map.h"
+
+/**
+ * Per-nickname counters.
+ */
+struct NicknameStats {
+    char nickname[NAME_LENGTH];  ///< Sender nickname
+    long messages;               ///< Number of messages sent
+    long bytes;                  ///< Total length of the message texts
+};
+
+/**
+ * Aggregates computed in a single pass over a message history.
+ * Every worker of a parallel pass fills its own MessageStats; they are merged at the end.
+ */
+struct MessageStats {
+    const struct MessageFilter* filter;  ///< Only matching messages are counted (NULL: all)
+    long total;                          ///< Number of messages counted
+    long totalBytes;                     ///< Sum of the message lengths
+    time_t first;                        ///< Oldest timestamp seen
+    time_t last;                         ///< Newest timestamp seen
+    long perHour[24];                    ///< Messages per hour of the day (local time)
+    long lengths[BUFFER_LENGTH + 1];     ///< Messages per text length, used for percentiles
+    struct NicknameMap nicknameIndex;    ///< Nickname -> 1 + index in users (slots NULL until used)
+    struct NicknameStats* users;         ///< Per-nickname counters, in order of first appearance
+    int userCapacity;                    ///< Counters allocated
+    int userCount;                       ///< Counters used
+    time_t hourStart;                    ///< Start of the cached local hour
+    int hour;                            ///< Hour of the day of the cached local hour
+};
+
+/**
+ * Computes the statistics of a message file in one streaming pass.
+ * The file is split into nbThreads ranges aggregated concurrently, then merged.
+ *
+ * @param filename The message file to read
+ * @param filter Criteria to apply (NULL counts every message)
+ * @param nbThreads Number of worker threads (at least 1)
+ * @param stats Filled with the merged statistics; release with freeMessageStats(), also on failure
+ * @return 0 on success, -1 on failure
+ */
+int computeMessageStats(const char* filename, const struct MessageFilter* filter, int nbThreads,
+                        struct MessageStats* stats);
+
+/**
+ * Prints the report: per-user counts, per-hour histogram and length percentiles.
+ */
+void printMessageStats(const struct MessageStats* stats, FILE* out);
+
+/**
+ * Releases the memory held by a MessageStats.
+ */
+void freeMessageStats(struct MessageStats* stats);
+
+#endif
@@ -1,22 +1,355 @@
 #include "message_store.h"
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
+
+#define SCAN_BLOCK_RECORDS 256   // Records read per pread() call by a scan worker
+#define MAX_SCAN_THREADS 256     // Upper bound on the number of scan workers
+#define MIN_SORT_RECORDS 16      // Smallest run the external sort works with, whatever the budget
+#define MAX_MERGE_FANIN 128      // Most run files merged (and kept open) at the same time
+#define FOLLOW_BLOCK_RECORDS 64  // Records decoded per read() while following a file
 
 static FILE* messageFile = NULL;             // File pointer for message history
 static char currentFilename[256] = {0};      // Stores the filename for later reuse (e.g., reading)
+static long long storedRecords = 0;          // Records in the file, checkpointed with the cursor
+static time_t lastTimestamp = 0;             // Timestamp of the last record in the file
+static int recordsSinceCheckpoint = 0;       // Saves since the last checkpoint was written
+static enum StoreDurability durabilityMode = STORE_FLUSH;  // How far each save is pushed
+
+#define CHECKPOINT_MAGIC 0x4D53434Bu  // "MSCK"
+
+// Cursor state saved next to the store, so recovery only validates the tail of the log
+struct StoreCheckpoint {
+    uint32_t magic;           // CHECKPOINT_MAGIC
+    uint32_t checksum;        // CRC-32 of the fields below
+    int64_t validLength;      // Bytes of the file known to hold intact records
+    int64_t records;          // Number of records in those bytes
+    int64_t lastTimestamp;    // Timestamp of the last of those records
+};
+
+// crcTable[0] is the classic byte table; crcTable[k][i] is the CRC of byte i followed by k zero bytes
+static uint32_t crcTable[8][256];
+static pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
+
+static void buildCrcTable(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        }
+        crcTable[0][i] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 256; i++) {
+            crcTable[k][i] = (crcTable[k - 1][i] >> 8) ^ crcTable[0][crcTable[k - 1][i] & 0xFF];
+        }
+    }
+}
+
+/**
+ * Slicing-by-8 CRC-32: eight bytes per step through eight tables, built on first use.
+ * Every record is checksummed on the event loop, so this is on the hot path.
+ */
+uint32_t crc32(const void* data, size_t length) {
+    pthread_once(&crcTableOnce, buildCrcTable);
+    const unsigned char* bytes = (const unsigned char*)data;
+    uint32_t crc = 0xFFFFFFFFu;
+    for (; length >= 8; length -= 8, bytes += 8) {
+        uint32_t low;
+        uint32_t high;
+        memcpy(&low, bytes, 4);  // Little-endian loads, alignment-safe
+        memcpy(&high, bytes + 4, 4);
+        low ^= crc;
+        crc = crcTable[7][low & 0xFF] ^ crcTable[6][(low >> 8) & 0xFF]
+            ^ crcTable[5][(low >> 16) & 0xFF] ^ crcTable[4][low >> 24]
+            ^ crcTable[3][high & 0xFF] ^ crcTable[2][(high >> 8) & 0xFF]
+            ^ crcTable[1][(high >> 16) & 0xFF] ^ crcTable[0][high >> 24];
+    }
+    for (size_t i = 0; i < length; i++) {
+        crc = crcTable[0][(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+/**
+ * A record is intact when its magic is present and its checksum matches.
+ */
+int validateRecord(const struct MessageRecord* record) {
+    return record->magic == RECORD_MAGIC
+        && record->checksum == crc32(&record->message, sizeof(struct Message));
+}
+
+// Path of the checkpoint file of the current store
+static void checkpointPath(char* path, size_t size) {
+    snprintf(path, size, "%s.ckpt", currentFilename);
+}
+
+// Writes the cursor state to a temporary file and renames it over the checkpoint
+static int writeCheckpoint(void) {
+    char path[sizeof(currentFilename) + 8];
+    char tmpPath[sizeof(path) + 4];
+    checkpointPath(path, sizeof(path));
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+
+    // Never vouch for records still sitting in the stdio buffer
+    if (messageFile != NULL) {
+        fflush(messageFile);
+    }
+
+    struct StoreCheckpoint checkpoint;
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    checkpoint.magic = CHECKPOINT_MAGIC;
+    checkpoint.validLength = storedRecords * (int64_t)sizeof(struct MessageRecord);
+    checkpoint.records = storedRecords;
+    checkpoint.lastTimestamp = lastTimestamp;
+    checkpoint.checksum = crc32(&checkpoint.validLength,
+                                sizeof(checkpoint) - offsetof(struct StoreCheckpoint, validLength));
+
+    FILE* file = fopen(tmpPath, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+    int ok = fwrite(&checkpoint, sizeof(checkpoint), 1, file) == 1;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmpPath, path) != 0) {
+        remove(tmpPath);
+        return -1;
+    }
+    recordsSinceCheckpoint = 0;
+    return 0;
+}
+
+// Returns the length up to which the checkpoint vouches for the file, 0 if it cannot be trusted
+static off_t readCheckpoint(int fd, off_t fileSize) {
+    char path[sizeof(currentFilename) + 8];
+    checkpointPath(path, sizeof(path));
+
+    struct StoreCheckpoint checkpoint;
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    int ok = fread(&checkpoint, sizeof(checkpoint), 1, file) == 1;
+    fclose(file);
+
+    if (!ok || checkpoint.magic != CHECKPOINT_MAGIC
+        || checkpoint.checksum != crc32(&checkpoint.validLength,
+                                        sizeof(checkpoint) - offsetof(struct StoreCheckpoint, validLength))
+        || checkpoint.validLength <= 0 || checkpoint.validLength > fileSize
+        || checkpoint.validLength != checkpoint.records * (int64_t)sizeof(struct MessageRecord)) {
+        return 0;
+    }
+
+    // The checkpoint must describe this very file: its last record has to be intact and match
+    struct MessageRecord last;
+    if (pread(fd, &last, sizeof(last), checkpoint.validLength - sizeof(last)) != sizeof(last)
+        || !validateRecord(&last) || last.message.timestamp != checkpoint.lastTimestamp) {
+        return 0;
+    }
+
+    storedRecords = checkpoint.records;
+    lastTimestamp = (time_t)checkpoint.lastTimestamp;
+    return (off_t)checkpoint.validLength;
+}
+
+// Tells whether a raw message looks like one: both strings terminated within their arrays
+static int plausibleMessage(const struct Message* message) {
+    return memchr(message->nickname, '\0', NAME_LENGTH) != NULL
+        && memchr(message->message, '\0', BUFFER_LENGTH) != NULL;
+}
+
+/**
+ * Rewrites a history saved before records had checksums (bare struct Message, back to
+ * back) into records. The original is kept as <file>.legacy; the file is left alone
+ * unless every message in it is plausible.
+ */
+static int convertLegacyStore(const char* filename, int fd, off_t size) {
+    if (size % sizeof(struct Message) != 0) {
+        return -1;
+    }
+    char tmpPath[PATH_MAX];
+    char legacyPath[PATH_MAX];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.converting", filename);
+    snprintf(legacyPath, sizeof(legacyPath), "%s.legacy", filename);
+    FILE* out = fopen(tmpPath, "wb");
+    if (out == NULL) {
+        perror("Failed to create the converted message store");
+        return -1;
+    }
+
+    struct Message messages[SCAN_BLOCK_RECORDS];
+    struct MessageRecord records[SCAN_BLOCK_RECORDS];
+    long long converted = 0;
+    int failed = 0;
+    for (off_t offset = 0; offset < size && !failed;) {
+        ssize_t bytes = pread(fd, messages, sizeof(messages), offset);
+        if (bytes <= 0 || bytes % sizeof(struct Message) != 0) {
+            failed = 1;
+            break;
+        }
+        size_t count = bytes / sizeof(struct Message);
+        for (size_t i = 0; i < count; i++) {
+            if (!plausibleMessage(&messages[i])) {
+                failed = 1;
+                break;
+            }
+            encodeRecord(&records[i], &messages[i]);
+        }
+        if (!failed && fwrite(records, sizeof(struct MessageRecord), count, out) != count) {
+            failed = 1;
+        }
+        offset += bytes;
+        converted += count;
+    }
+    if (fflush(out) != 0 || fsync(fileno(out)) < 0) {
+        failed = 1;
+    }
+    fclose(out);
+
+    // Keep the original, then move the converted file into its place
+    if (failed || rename(filename, legacyPath) < 0 || rename(tmpPath, filename) < 0) {
+        unlink(tmpPath);
+        return -1;
+    }
+    fprintf(stderr, "Converted %lld messages of the legacy history %s (original kept as %s)\n", converted,
+            filename, legacyPath);
+    return 0;
+}
+
+/**
+ * Appends the bytes of the store from offset to size to <file>.damaged and syncs them,
+ * so that a tail is never truncated without a copy.
+ */
+static int saveDamagedTail(const char* filename, int fd, off_t offset, off_t size) {
+    char damagedPath[PATH_MAX];
+    snprintf(damagedPath, sizeof(damagedPath), "%s.damaged", filename);
+    int out = open(damagedPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (out < 0) {
+        perror("Failed to create the damaged records file");
+        return -1;
+    }
+    char buffer[65536];
+    int failed = 0;
+    while (offset < size && !failed) {
+        size_t wanted = (size - offset < (off_t)sizeof(buffer)) ? (size_t)(size - offset) : sizeof(buffer);
+        ssize_t bytes = pread(fd, buffer, wanted, offset);
+        failed = bytes <= 0 || write(out, buffer, bytes) != bytes;
+        offset += (bytes > 0) ? bytes : 0;
+    }
+    if (failed || fsync(out) < 0) {
+        perror("Failed to save the damaged records");
+        failed = 1;
+    }
+    close(out);
+    return failed ? -1 : 0;
+}
+
+/**
+ * Validates the records written after the last checkpoint. A damaged record followed by
+ * intact ones is left in place (readers skip it); only a torn tail, after the last intact
+ * record, is truncated, once copied to <file>.damaged. A history from before checksums
+ * is converted.
+ */
+static int recoverMessageStore(const char* filename) {
+    storedRecords = 0;
+    lastTimestamp = 0;
+
+    int fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("Failed to open message store file for recovery");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("Failed to stat message store file");
+        close(fd);
+        return -1;
+    }
+
+    off_t checked = readCheckpoint(fd, st.st_size);
+    off_t validEnd = checked;       // End of the last intact record
+    long long skipped = 0;          // Damaged records with intact ones after them
+    long long pending = 0;          // Damaged records since the last intact one
+    struct MessageRecord record;
+    for (off_t offset = checked; offset + (off_t)sizeof(record) <= st.st_size; offset += sizeof(record)) {
+        if (pread(fd, &record, sizeof(record), offset) != sizeof(record)) {
+            perror("Failed to read message store file");
+            close(fd);
+            return -1;
+        }
+        if (!validateRecord(&record)) {
+            pending++;
+            continue;
+        }
+        skipped += pending;
+        pending = 0;
+        validEnd = offset + sizeof(record);
+        lastTimestamp = record.message.timestamp;
+    }
+    storedRecords = validEnd / (off_t)sizeof(record);
+    if (skipped > 0) {
+        fprintf(stderr, "Recovered message store: %lld damaged records kept in place, readers skip them\n",
+                skipped);
+    }
+
+    if (validEnd < st.st_size) {
+        // Never destroy a file that was not written with checksums in the first place
+        uint32_t magic = 0;
+        if (validEnd == 0 && (pread(fd, &magic, sizeof(magic), 0) != sizeof(magic) || magic != RECORD_MAGIC)) {
+            int converted = convertLegacyStore(filename, fd, st.st_size);
+            close(fd);
+            if (converted < 0) {
+                fprintf(stderr, "%s is not a message store, leaving it untouched\n", filename);
+                return -1;
+            }
+            return recoverMessageStore(filename);
+        }
+        if (saveDamagedTail(filename, fd, validEnd, st.st_size) < 0) {
+            fprintf(stderr, "%s has a damaged tail that could not be saved, leaving it untouched\n", filename);
+            close(fd);
+            return -1;
+        }
+        fprintf(stderr, "Recovered message store: moved %lld damaged bytes after %lld records to %s.damaged\n",
+                (long long)(st.st_size - validEnd), storedRecords, filename);
+        if (ftruncate(fd, validEnd) < 0) {
+            perror("Failed to truncate message store file");
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    // Checkpoint right away when anything had to be validated
+    if (validEnd != checked || validEnd < st.st_size) {
+        writeCheckpoint();
+    }
+    return 0;
+}
 
 /**
- * Initializes the message store by opening the file for appending.
+ * Initializes the message store by recovering the file, then opening it for appending.
  */
 int initMessageStore(const char* filename) {
     if (messageFile != NULL) {
-        fclose(messageFile); // Close if already open
+        closeMessageStore(); // Close if already open
     }
 
     strncpy(currentFilename, filename, sizeof(currentFilename) - 1);
 
+    if (recoverMessageStore(filename) < 0) {
+        return -1;
+    }
+
     // Open file in append mode to preserve history
     messageFile = fopen(filename, "a+");
     if (messageFile == NULL) {
@@ -28,18 +361,59 @@ int initMessageStore(const char* filename) {
 }
 
 /**
- * Saves a message to the currently opened message file.
+ * Wraps a message with its magic number and checksum.
+ */
+void encodeRecord(struct MessageRecord* record, const struct Message* message) {
+    record->magic = RECORD_MAGIC;
+    record->message = *message;
+    record->checksum = crc32(&record->message, sizeof(struct Message));
+}
+
+/**
+ * Saves a message, with its checksum, to the currently opened message file.
  */
 int saveMessage(const struct Message* message) {
-    if (messageFile == NULL || message == NULL) {
+    if (message == NULL) {
+        return -1;
+    }
+    struct MessageRecord record;
+    encodeRecord(&record, message);
+    return saveRecord(&record);
+}
+
+/**
+ * Appends an encoded record as is.
+ */
+int saveRecord(const struct MessageRecord* record) {
+    if (messageFile == NULL || record == NULL) {
+        return -1;
+    }
+
+    // Write binary message record to file
+    size_t written = fwrite(record, sizeof(*record), 1, messageFile);
+    if (durabilityMode != STORE_BUFFERED) {
+        fflush(messageFile);  // Force flush to disk for durability
+    }
+    if (durabilityMode == STORE_FSYNC) {
+        fdatasync(fileno(messageFile));
+    }
+    if (written != 1) {
         return -1;
     }
 
-    // Write binary message struct to file
-    size_t written = fwrite(message, sizeof(struct Message), 1, messageFile);
-    fflush(messageFile);  // Force flush to disk for durability
+    storedRecords++;
+    lastTimestamp = record->message.timestamp;
+    if (++recordsSinceCheckpoint >= CHECKPOINT_INTERVAL) {
+        writeCheckpoint();
+    }
+    return 0;
+}
 
-    return (written == 1) ? 0 : -1;
+/**
+ * Changes how saveMessage() flushes records.
+ */
+void setStoreDurability(enum StoreDurability durability) {
+    durabilityMode = durability;
 }
 
 // Comparison function for qsort — sorts by timestamp
@@ -61,79 +435,789 @@ static int compareByNickname(const void* a, const void* b) {
 }
 
 /**
- * Loads messages from the file into memory, sorts them, and copies a limited
- * number into the provided buffer.
+ * Sorts messages with qsort, then reverses them if descending order is requested.
  */
-int loadMessages(struct Message* messages, int maxMessages, int sortByTime, int ascending) {
-    if (messages == NULL || maxMessages <= 0) {
+void sortMessages(struct Message* messages, int numMessages, int sortByTime, int ascending) {
+    if (messages == NULL || numMessages <= 1) {
+        return;
+    }
+
+    // Sort messages using selected criteria
+    if (sortByTime) {
+        qsort(messages, numMessages, sizeof(struct Message), compareByTime);
+    } else {
+        qsort(messages, numMessages, sizeof(struct Message), compareByNickname);
+    }
+
+    // Reverse the array in-place if descending order requested
+    if (!ascending) {
+        for (int i = 0; i < numMessages / 2; i++) {
+            struct Message temp = messages[i];
+            messages[i] = messages[numMessages - 1 - i];
+            messages[numMessages - 1 - i] = temp;
+        }
+    }
+}
+
+/**
+ * Checks a message against every enabled criterion of the filter.
+ */
+int matchMessage(const struct Message* message, const struct MessageFilter* filter) {
+    if (filter == NULL) {
+        return 1;
+    }
+    if (filter->since != 0 && message->timestamp < filter->since) {
+        return 0;
+    }
+    if (filter->until != 0 && message->timestamp > filter->until) {
+        return 0;
+    }
+    if (filter->nickname[0] != '\0'
+        && strncmp(message->nickname, filter->nickname, NAME_LENGTH) != 0) {
+        return 0;
+    }
+    if (filter->substring != NULL && filter->substring[0] != '\0') {
+        // Records come straight from disk: never trust them to be NUL-terminated
+        char text[BUFFER_LENGTH + 1];
+        memcpy(text, message->message, BUFFER_LENGTH);
+        text[BUFFER_LENGTH] = '\0';
+        if (strstr(text, filter->substring) == NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Work assigned to one scan thread: a record-aligned range of the file
+struct ScanChunk {
+    int fd;                  // Shared read-only descriptor (pread keeps no cursor)
+    long firstRecord;        // Index of the first record of the range
+    long nbRecords;          // Number of records in the range
+    MessageVisitor visitor;  // Called for every record of the range
+    void* context;           // Per-range context handed to the visitor
+    int failed;              // Set on read error or when the visitor fails
+};
+
+// Thread body: reads its range block by block and visits every record
+static void* scanChunk(void* arg) {
+    struct ScanChunk* chunk = (struct ScanChunk*)arg;
+    struct MessageRecord* block = malloc(SCAN_BLOCK_RECORDS * sizeof(struct MessageRecord));
+    if (block == NULL) {
+        chunk->failed = 1;
+        return NULL;
+    }
+
+    long done = 0;
+    while (done < chunk->nbRecords) {
+        long wanted = chunk->nbRecords - done;
+        if (wanted > SCAN_BLOCK_RECORDS) {
+            wanted = SCAN_BLOCK_RECORDS;
+        }
+
+        off_t offset = (off_t)(chunk->firstRecord + done) * (off_t)sizeof(struct MessageRecord);
+        ssize_t got = pread(chunk->fd, block, wanted * sizeof(struct MessageRecord), offset);
+        if (got <= 0) {
+            chunk->failed = (got < 0);
+            break;  // A short file simply ends the range
+        }
+
+        long records = got / (long)sizeof(struct MessageRecord);
+        for (long i = 0; i < records; i++) {
+            // Damaged records are skipped; the writer truncates torn ones on its next start
+            if (!validateRecord(&block[i])) {
+                continue;
+            }
+            if (chunk->visitor(&block[i].message, chunk->context) != 0) {
+                chunk->failed = 1;
+                free(block);
+                return NULL;
+            }
+        }
+
+        if (records < wanted) {
+            break;
+        }
+        done += records;
+    }
+
+    free(block);
+    return NULL;
+}
+
+/**
+ * Splits the file into record-aligned ranges and visits them on worker threads,
+ * the calling thread taking the first range itself.
+ */
+int visitMessagesParallel(const char* filename, int nbThreads, MessageVisitor visitor, void** contexts) {
+    if (filename == NULL || visitor == NULL || contexts == NULL || nbThreads < 1) {
         return -1;
     }
 
-    // Reopen file if it wasn't already opened by initMessageStore
-    if (messageFile == NULL) {
-        messageFile = fopen(currentFilename, "r");
-        if (messageFile == NULL) {
-            perror("Failed to open message store file for reading");
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open message store file for scanning");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("Failed to stat message store file");
+        close(fd);
+        return -1;
+    }
+
+    long nbRecords = (long)(st.st_size / (off_t)sizeof(struct MessageRecord));
+    if (nbThreads > MAX_SCAN_THREADS) {
+        nbThreads = MAX_SCAN_THREADS;
+    }
+    // Not worth waking threads for less than a block each
+    if (nbThreads > 1 && nbRecords / nbThreads < SCAN_BLOCK_RECORDS) {
+        nbThreads = (int)(nbRecords / SCAN_BLOCK_RECORDS);
+        if (nbThreads < 1) {
+            nbThreads = 1;
+        }
+    }
+
+    struct ScanChunk* chunks = calloc(nbThreads, sizeof(struct ScanChunk));
+    pthread_t* threads = calloc(nbThreads, sizeof(pthread_t));
+    if (chunks == NULL || threads == NULL) {
+        free(chunks);
+        free(threads);
+        close(fd);
+        return -1;
+    }
+
+    // Record-aligned ranges: the first (nbRecords % nbThreads) chunks get one extra record
+    long first = 0;
+    for (int i = 0; i < nbThreads; i++) {
+        chunks[i].fd = fd;
+        chunks[i].visitor = visitor;
+        chunks[i].context = contexts[i];
+        chunks[i].firstRecord = first;
+        chunks[i].nbRecords = nbRecords / nbThreads + (i < nbRecords % nbThreads ? 1 : 0);
+        first += chunks[i].nbRecords;
+    }
+
+    // The calling thread works on the first chunk itself
+    int started = 1;
+    for (; started < nbThreads; started++) {
+        if (pthread_create(&threads[started], NULL, scanChunk, &chunks[started]) != 0) {
+            break;
+        }
+    }
+    scanChunk(&chunks[0]);
+    // Chunks whose thread could not be created are scanned inline
+    for (int i = started; i < nbThreads; i++) {
+        scanChunk(&chunks[i]);
+    }
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    close(fd);
+
+    int failed = 0;
+    for (int i = 0; i < nbThreads; i++) {
+        failed |= chunks[i].failed;
+    }
+    free(chunks);
+    free(threads);
+    return failed ? -1 : nbThreads;
+}
+
+// Matching messages of one range, in file order
+struct MatchList {
+    const struct MessageFilter* filter;
+    struct Message* matches;
+    int nbMatches;
+    int capacity;
+};
+
+// Visitor of scanMessages: appends a matching message, growing the array if needed
+static int appendMatch(const struct Message* message, void* context) {
+    struct MatchList* list = (struct MatchList*)context;
+    if (!matchMessage(message, list->filter)) {
+        return 0;
+    }
+    if (list->nbMatches >= list->capacity) {
+        int capacity = (list->capacity == 0) ? 64 : list->capacity * 2;
+        struct Message* newBuffer = realloc(list->matches, capacity * sizeof(struct Message));
+        if (newBuffer == NULL) {
             return -1;
         }
+        list->matches = newBuffer;
+        list->capacity = capacity;
     }
+    list->matches[list->nbMatches++] = *message;
+    return 0;
+}
 
-    rewind(messageFile);  // Reset file cursor to beginning
+/**
+ * Filters every range into its own list, then concatenates the lists in file order.
+ */
+int scanMessages(const char* filename, const struct MessageFilter* filter, int nbThreads,
+                 struct Message** results) {
+    if (filename == NULL || results == NULL) {
+        return -1;
+    }
+    *results = NULL;
+    if (nbThreads < 1) {
+        nbThreads = 1;
+    }
+    if (nbThreads > MAX_SCAN_THREADS) {
+        nbThreads = MAX_SCAN_THREADS;
+    }
 
-    // Read messages into dynamically sized array
-    struct Message* allMessages = NULL;
-    int numMessages = 0;
-    int capacity = 100;  // Start with space for 100 messages
+    struct MatchList* lists = calloc(nbThreads, sizeof(struct MatchList));
+    void** contexts = calloc(nbThreads, sizeof(void*));
+    if (lists == NULL || contexts == NULL) {
+        free(lists);
+        free(contexts);
+        return -1;
+    }
+    for (int i = 0; i < nbThreads; i++) {
+        lists[i].filter = filter;
+        contexts[i] = &lists[i];
+    }
+
+    int failed = visitMessagesParallel(filename, nbThreads, appendMatch, contexts) < 0;
+
+    // Merge partial results in file order
+    long total = 0;
+    for (int i = 0; i < nbThreads; i++) {
+        total += lists[i].nbMatches;
+    }
+
+    struct Message* merged = NULL;
+    if (!failed && total > 0) {
+        merged = malloc(total * sizeof(struct Message));
+        failed = (merged == NULL);
+    }
+    long position = 0;
+    for (int i = 0; i < nbThreads; i++) {
+        if (!failed && lists[i].nbMatches > 0) {
+            memcpy(&merged[position], lists[i].matches, lists[i].nbMatches * sizeof(struct Message));
+            position += lists[i].nbMatches;
+        }
+        free(lists[i].matches);
+    }
+    free(lists);
+    free(contexts);
 
-    allMessages = malloc(capacity * sizeof(struct Message));
-    if (allMessages == NULL) {
+    if (failed) {
+        free(merged);
         return -1;
     }
 
-    while (fread(&allMessages[numMessages], sizeof(struct Message), 1, messageFile) == 1) {
-        numMessages++;
+    *results = merged;
+    return (int)total;
+}
+
+// One sorted run being merged: a temporary file read through a small buffer
+struct MergeRun {
+    FILE* file;
+    struct Message* buffer;
+    int count;       // Messages currently in the buffer
+    int position;    // Next message to hand out
+    int exhausted;   // Set once the file and the buffer are both empty
+};
 
-        // Expand array if needed
-        if (numMessages >= capacity) {
-            capacity *= 2;
-            struct Message* newBuffer = realloc(allMessages, capacity * sizeof(struct Message));
-            if (newBuffer == NULL) {
-                free(allMessages);
-                return -1;
+// State shared by the loser tree comparisons
+struct MergeState {
+    struct MergeRun* runs;
+    int nbRuns;
+    int* tree;        // tree[1..nbRuns-1] hold the losers, leaves are nodes nbRuns..2*nbRuns-1
+    int sortByTime;
+    int ascending;
+};
+
+// Refills the buffer of a run, marks it exhausted at end of file
+static int refillRun(struct MergeRun* run, int capacity) {
+    run->count = (int)fread(run->buffer, sizeof(struct Message), capacity, run->file);
+    run->position = 0;
+    if (run->count == 0) {
+        run->exhausted = 1;
+        return ferror(run->file) ? -1 : 0;
+    }
+    return 0;
+}
+
+// Returns 1 if the head of run a must be emitted before the head of run b
+static int runBefore(const struct MergeState* state, int a, int b) {
+    const struct MergeRun* runA = &state->runs[a];
+    const struct MergeRun* runB = &state->runs[b];
+    if (runA->exhausted || runB->exhausted) {
+        return !runA->exhausted;
+    }
+
+    const struct Message* msgA = &runA->buffer[runA->position];
+    const struct Message* msgB = &runB->buffer[runB->position];
+    int order = state->sortByTime ? compareByTime(msgA, msgB) : compareByNickname(msgA, msgB);
+    if (!state->ascending) {
+        order = -order;
+    }
+    // Ties go to the earlier run so the merge is deterministic
+    return (order != 0) ? (order < 0) : (a < b);
+}
+
+// Plays the matches below a node, stores the losers and returns the winner
+static int buildLoserTree(struct MergeState* state, int node) {
+    if (node >= state->nbRuns) {
+        return node - state->nbRuns;
+    }
+    int left = buildLoserTree(state, 2 * node);
+    int right = buildLoserTree(state, 2 * node + 1);
+    if (runBefore(state, left, right)) {
+        state->tree[node] = right;
+        return left;
+    }
+    state->tree[node] = left;
+    return right;
+}
+
+// Replays the matches from a leaf up to the root after its run advanced
+static int replayLoserTree(struct MergeState* state, int winner) {
+    for (int node = (winner + state->nbRuns) / 2; node >= 1; node /= 2) {
+        if (runBefore(state, state->tree[node], winner)) {
+            int loser = winner;
+            winner = state->tree[node];
+            state->tree[node] = loser;
+        }
+    }
+    return winner;
+}
+
+// Visitor used by intermediate merge passes: appends each message to a run file
+static int writeToRun(const struct Message* message, void* context) {
+    return (fwrite(message, sizeof(struct Message), 1, (FILE*)context) == 1) ? 0 : -1;
+}
+
+/**
+ * Merges nbRuns sorted run files with a loser tree, handing every message to the visitor.
+ * Each run gets bufferRecords messages of read buffer. Returns the number of messages
+ * visited, or -1 on failure; sets *stopped if the visitor asked to stop.
+ */
+static long mergeRuns(FILE** files, int nbRuns, int bufferRecords, int sortByTime, int ascending,
+                      MessageVisitor visitor, void* context, int* stopped) {
+    struct MergeState state;
+    state.nbRuns = nbRuns;
+    state.sortByTime = sortByTime;
+    state.ascending = ascending;
+    state.runs = calloc(nbRuns, sizeof(struct MergeRun));
+    state.tree = calloc(nbRuns, sizeof(int));
+    long visited = -1;
+
+    if (state.runs == NULL || state.tree == NULL) {
+        goto cleanup;
+    }
+    for (int i = 0; i < nbRuns; i++) {
+        state.runs[i].file = files[i];
+        state.runs[i].buffer = malloc(bufferRecords * sizeof(struct Message));
+        if (state.runs[i].buffer == NULL) {
+            goto cleanup;
+        }
+        rewind(files[i]);
+        if (refillRun(&state.runs[i], bufferRecords) < 0) {
+            goto cleanup;
+        }
+    }
+
+    visited = 0;
+    int winner = buildLoserTree(&state, 1);
+    while (!state.runs[winner].exhausted) {
+        struct MergeRun* run = &state.runs[winner];
+        visited++;
+        if (visitor(&run->buffer[run->position], context) != 0) {
+            *stopped = 1;
+            break;
+        }
+
+        if (++run->position >= run->count && refillRun(run, bufferRecords) < 0) {
+            visited = -1;
+            break;
+        }
+        winner = replayLoserTree(&state, winner);
+    }
+
+cleanup:
+    if (state.runs != NULL) {
+        for (int i = 0; i < nbRuns; i++) {
+            free(state.runs[i].buffer);
+        }
+    }
+    free(state.runs);
+    free(state.tree);
+    return visited;
+}
+
+/**
+ * Builds sorted runs that fit the memory budget, spills them to temporary files
+ * and merges them. A single run is handed out straight from memory.
+ */
+int sortMessagesExternal(const char* filename, const struct MessageFilter* filter, long memoryBudget,
+                         int sortByTime, int ascending, MessageVisitor visitor, void* context) {
+    if (filename == NULL || visitor == NULL) {
+        return -1;
+    }
+
+    long runRecords = memoryBudget / (long)sizeof(struct Message);
+    if (runRecords < MIN_SORT_RECORDS) {
+        runRecords = MIN_SORT_RECORDS;
+    }
+    if (runRecords > INT_MAX) {
+        runRecords = INT_MAX;
+    }
+
+    FILE* input = fopen(filename, "rb");
+    if (input == NULL) {
+        perror("Failed to open message store file for sorting");
+        return -1;
+    }
+
+    struct Message* run = malloc(runRecords * sizeof(struct Message));
+    FILE** runFiles = NULL;
+    int nbRuns = 0;
+    int runCapacity = 0;
+    long result = -1;
+    int stopped = 0;
+    if (run == NULL) {
+        fclose(input);
+        return -1;
+    }
+
+    // Phase 1: fill the buffer with matching messages, sort it, spill it
+    int endOfInput = 0;
+    while (!endOfInput) {
+        int count = 0;
+        struct MessageRecord record;
+        while (count < runRecords) {
+            if (fread(&record, sizeof(record), 1, input) != 1) {
+                endOfInput = 1;
+                break;
+            }
+            if (validateRecord(&record) && matchMessage(&record.message, filter)) {
+                run[count++] = record.message;
             }
-            allMessages = newBuffer;
+        }
+        if (ferror(input)) {
+            goto cleanup;
+        }
+
+        sortMessages(run, count, sortByTime, ascending);
+
+        // Everything fit in memory: no temporary file needed
+        if (endOfInput && nbRuns == 0) {
+            result = 0;
+            for (int i = 0; i < count; i++) {
+                result++;
+                if (visitor(&run[i], context) != 0) {
+                    break;
+                }
+            }
+            goto cleanup;
+        }
+        if (count == 0) {
+            break;
+        }
+
+        if (nbRuns >= runCapacity) {
+            runCapacity = (runCapacity == 0) ? 16 : runCapacity * 2;
+            FILE** newFiles = realloc(runFiles, runCapacity * sizeof(FILE*));
+            if (newFiles == NULL) {
+                goto cleanup;
+            }
+            runFiles = newFiles;
+        }
+        runFiles[nbRuns] = tmpfile();
+        if (runFiles[nbRuns] == NULL) {
+            perror("Failed to create temporary run file");
+            goto cleanup;
+        }
+        nbRuns++;
+        if (fwrite(run, sizeof(struct Message), count, runFiles[nbRuns - 1]) != (size_t)count) {
+            perror("Failed to write temporary run file");
+            goto cleanup;
         }
     }
+    free(run);
+    run = NULL;
 
-    // Sort messages using selected criteria
-    if (sortByTime) {
-        qsort(allMessages, numMessages, sizeof(struct Message), compareByTime);
-    } else {
-        qsort(allMessages, numMessages, sizeof(struct Message), compareByNickname);
+    // Phase 2: merge passes, at most MAX_MERGE_FANIN runs at a time, until one pass can finish
+    while (nbRuns > MAX_MERGE_FANIN) {
+        FILE* merged = tmpfile();
+        if (merged == NULL) {
+            perror("Failed to create temporary run file");
+            goto cleanup;
+        }
+        long bufferRecords = runRecords / (MAX_MERGE_FANIN + 1);
+        // writeToRun only stops the merge when a write fails
+        if (mergeRuns(runFiles, MAX_MERGE_FANIN, bufferRecords > 0 ? (int)bufferRecords : 1,
+                      sortByTime, ascending, writeToRun, merged, &stopped) < 0 || stopped) {
+            perror("Failed to merge temporary run files");
+            fclose(merged);
+            goto cleanup;
+        }
+        for (int i = 0; i < MAX_MERGE_FANIN; i++) {
+            fclose(runFiles[i]);
+        }
+        // The merged run holds the earliest input, so it goes first: runBefore() gives ties to
+        // the lower run index, and equal messages of different runs keep their input order
+        memmove(&runFiles[1], &runFiles[MAX_MERGE_FANIN], (nbRuns - MAX_MERGE_FANIN) * sizeof(FILE*));
+        nbRuns -= MAX_MERGE_FANIN - 1;
+        runFiles[0] = merged;
     }
 
-    // Reverse the array in-place if descending order requested
-    if (!ascending) {
-        for (int i = 0; i < numMessages / 2; i++) {
-            struct Message temp = allMessages[i];
-            allMessages[i] = allMessages[numMessages - 1 - i];
-            allMessages[numMessages - 1 - i] = temp;
+    long bufferRecords = runRecords / (nbRuns > 0 ? nbRuns : 1);
+    result = (nbRuns == 0) ? 0
+           : mergeRuns(runFiles, nbRuns, bufferRecords > 0 ? (int)bufferRecords : 1,
+                       sortByTime, ascending, visitor, context, &stopped);
+
+cleanup:
+    free(run);
+    for (int i = 0; i < nbRuns; i++) {
+        fclose(runFiles[i]);
+    }
+    free(runFiles);
+    fclose(input);
+    return (result > INT_MAX) ? INT_MAX : (int)result;
+}
+
+// Output buffer filled by loadMessages through the external sort
+struct LoadContext {
+    struct Message* messages;
+    int maxMessages;
+    int count;
+};
+
+static int collectMessage(const struct Message* message, void* context) {
+    struct LoadContext* load = (struct LoadContext*)context;
+    load->messages[load->count++] = *message;
+    return load->count >= load->maxMessages;  // Stop once the caller's buffer is full
+}
+
+/**
+ * Sorts the file with the external sort and copies the first maxMessages
+ * messages into the provided buffer.
+ */
+int loadMessages(struct Message* messages, int maxMessages, int sortByTime, int ascending) {
+    if (messages == NULL || maxMessages <= 0 || currentFilename[0] == '\0') {
+        return -1;
+    }
+
+    // Make sure every message saved so far is visible to the reader
+    if (messageFile != NULL) {
+        fflush(messageFile);
+    }
+
+    struct LoadContext load = { messages, maxMessages, 0 };
+    if (sortMessagesExternal(currentFilename, NULL, DEFAULT_SORT_MEMORY,
+                             sortByTime, ascending, collectMessage, &load) < 0) {
+        return -1;
+    }
+    return load.count;
+}
+
+/**
+ * Reads the last records of the file with one pread(), skipping damaged ones.
+ * The file is not flushed: the store may be written by another thread.
+ */
+int readLastMessages(struct Message* messages, int maxMessages) {
+    if (messages == NULL || maxMessages <= 0 || currentFilename[0] == '\0') {
+        return -1;
+    }
+    int fd = open(currentFilename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) < 0) {
+        close(fd);
+        return -1;
+    }
+    // A record being appended is left out
+    off_t available = status.st_size / (off_t)sizeof(struct MessageRecord);
+    off_t wanted = (available < maxMessages) ? available : maxMessages;
+    struct MessageRecord* records = malloc((wanted > 0 ? wanted : 1) * sizeof(struct MessageRecord));
+    if (records == NULL) {
+        close(fd);
+        return -1;
+    }
+    ssize_t got = pread(fd, records, wanted * sizeof(struct MessageRecord),
+                        (available - wanted) * (off_t)sizeof(struct MessageRecord));
+    close(fd);
+    if (got < 0) {
+        free(records);
+        return -1;
+    }
+
+    int count = 0;
+    for (ssize_t i = 0; i < got / (ssize_t)sizeof(struct MessageRecord); i++) {
+        if (validateRecord(&records[i])) {
+            messages[count++] = records[i].message;
         }
     }
+    free(records);
+    return count;
+}
 
-    // Copy up to maxMessages into the output buffer
-    int messagesToCopy = (numMessages < maxMessages) ? numMessages : maxMessages;
-    memcpy(messages, allMessages, messagesToCopy * sizeof(struct Message));
+/**
+ * Looks for one intact record, stopping at the first: a healthy file costs a single read.
+ */
+int containsValidRecord(const char* filename) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct MessageRecord* block = malloc(SCAN_BLOCK_RECORDS * sizeof(struct MessageRecord));
+    if (block == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    int found = 0;
+    off_t offset = 0;
+    ssize_t got;
+    while (!found && (got = pread(fd, block, SCAN_BLOCK_RECORDS * sizeof(struct MessageRecord), offset)) > 0) {
+        for (ssize_t i = 0; i < got / (ssize_t)sizeof(struct MessageRecord) && !found; i++) {
+            found = validateRecord(&block[i]);
+        }
+        offset += got;
+    }
+    free(block);
+    close(fd);
+    return (!found && got < 0) ? -1 : found;
+}
+
+// Decodes every complete record between *offset and the end of the file
+static int readAppended(int fd, off_t* offset, const struct MessageFilter* filter,
+                        MessageVisitor visitor, void* context, int* stopped) {
+    struct MessageRecord block[FOLLOW_BLOCK_RECORDS];
+    while (1) {
+        ssize_t got = pread(fd, block, sizeof(block), *offset);
+        if (got < 0) {
+            perror("Failed to read followed message file");
+            return -1;
+        }
 
-    free(allMessages);
-    return messagesToCopy;
+        // A record still being written stays in the file until the next wake-up
+        long records = got / (long)sizeof(struct MessageRecord);
+        for (long i = 0; i < records; i++) {
+            *offset += sizeof(struct MessageRecord);
+            if (validateRecord(&block[i]) && matchMessage(&block[i].message, filter)
+                && visitor(&block[i].message, context) != 0) {
+                *stopped = 1;
+                return 0;
+            }
+        }
+        if (records < FOLLOW_BLOCK_RECORDS) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * Replays the backlog, then alternates between waiting for a change and decoding
+ * the records appended since the last offset.
+ */
+int followMessages(const char* filename, const struct MessageFilter* filter, int backlog,
+                   MessageVisitor visitor, void* context) {
+    if (filename == NULL || visitor == NULL) {
+        return -1;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open message store file for following");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("Failed to stat message store file");
+        close(fd);
+        return -1;
+    }
+
+    // Start `backlog` whole records before the end of the file
+    off_t recordsInFile = st.st_size / (off_t)sizeof(struct MessageRecord);
+    off_t skipped = recordsInFile - (backlog > 0 ? backlog : 0);
+    if (skipped < 0) {
+        skipped = 0;
+    }
+    off_t offset = skipped * (off_t)sizeof(struct MessageRecord);
+
+    // Watch the directory rather than the file so a replacement file is noticed too
+    char directory[sizeof(currentFilename)];
+    strncpy(directory, filename, sizeof(directory) - 1);
+    directory[sizeof(directory) - 1] = '\0';
+    int notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notifyFd >= 0
+        && inotify_add_watch(notifyFd, dirname(directory),
+                             IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) {
+        close(notifyFd);
+        notifyFd = -1;
+    }
+
+    int stopped = 0;
+    int result = 0;
+    while (!stopped) {
+        if (readAppended(fd, &offset, filter, visitor, context, &stopped) < 0) {
+            result = -1;
+            break;
+        }
+        if (stopped) {
+            break;
+        }
+
+        // Wait for a change; the timeout also covers filesystems inotify cannot see
+        if (notifyFd >= 0) {
+            struct pollfd pfd = { notifyFd, POLLIN, 0 };
+            if (poll(&pfd, 1, 1000) > 0) {
+                char events[4096];
+                while (read(notifyFd, events, sizeof(events)) > 0) {
+                    // Only the wake-up matters: the file itself is checked below
+                }
+            }
+        } else {
+            poll(NULL, 0, FOLLOW_POLL_INTERVAL_MS);
+        }
+
+        // Truncated in place: start over
+        if (fstat(fd, &st) == 0 && st.st_size < offset) {
+            offset = 0;
+        }
+
+        // Rotated: finish the old file, then follow the new one from its beginning
+        struct stat current;
+        if (stat(filename, &current) == 0
+            && (current.st_ino != st.st_ino || current.st_dev != st.st_dev)) {
+            if (readAppended(fd, &offset, filter, visitor, context, &stopped) < 0) {
+                result = -1;
+                break;
+            }
+            int newFd = open(filename, O_RDONLY);
+            if (newFd >= 0) {
+                close(fd);
+                fd = newFd;
+                offset = 0;
+            }
+        }
+    }
+
+    if (notifyFd >= 0) {
+        close(notifyFd);
+    }
+    close(fd);
+    return result;
 }
 
 /**
- * Closes the message file if open.
+ * Checkpoints and closes the message file if open.
  */
 void closeMessageStore() {
     if (messageFile != NULL) {
+        fflush(messageFile);
+        writeCheckpoint();
         fclose(messageFile);
         messageFile = NULL;
     }
@@ -3,10 +3,64 @@
 
 #include "chat.h"
 
+#include <stdint.h>
+#include <time.h>
+
+#define RECORD_MAGIC 0x4D534731u     ///< "MSG1": marks the start of every record in the store
+#define CHECKPOINT_INTERVAL 1024     ///< Records saved between two checkpoints of the store
+#define FOLLOW_POLL_INTERVAL_MS 250  ///< File size polling period of followMessages() without inotify
+#define DEFAULT_SORT_MEMORY (64L * 1024 * 1024)  ///< Default memory budget of the external sort, in bytes
+
+/**
+ * How hard saveMessage() pushes each record towards the disk.
+ */
+enum StoreDurability {
+    STORE_BUFFERED,  ///< Records stay in the stdio buffer until it fills or the store is closed
+    STORE_FLUSH,     ///< Every record is flushed to the kernel (default: survives a process crash)
+    STORE_FSYNC      ///< Every record is also synced to the device (survives a power loss)
+};
+
+/**
+ * On-disk layout of a stored message: the message is preceded by a magic number and
+ * its CRC-32, so a torn or corrupted record is detected instead of shifting every
+ * following fixed-size read.
+ */
+struct MessageRecord {
+    uint32_t magic;          ///< RECORD_MAGIC
+    uint32_t checksum;       ///< CRC-32 of the message bytes
+    struct Message message;  ///< The message itself
+};
+
+/**
+ * Receives the messages produced by sortMessagesExternal(), one at a time and in order.
+ * Returning a non-zero value stops the sort after this message (e.g. once enough were shown).
+ */
+typedef int (*MessageVisitor)(const struct Message* message, void* context);
+
+/**
+ * Criteria applied to every record while scanning the store.
+ * A zero or empty field disables the corresponding test.
+ */
+struct MessageFilter {
+    time_t since;                ///< Keep messages sent at or after this time (0: no lower bound)
+    time_t until;                ///< Keep messages sent at or before this time (0: no upper bound)
+    char nickname[NAME_LENGTH];  ///< Keep messages sent by this nickname only (empty: any sender)
+    const char* substring;       ///< Keep messages whose text contains this string (NULL: any text)
+};
+
 /**
  * Initializes the message store by opening the specified file.
  * Must be called before saving or loading messages.
  *
+ * The file is first recovered from a crash: if the "<filename>.ckpt" checkpoint matches
+ * the file, only the records written after it are validated, otherwise the whole file is.
+ * A damaged record followed by intact ones stays in place, since readers skip it. A torn
+ * tail after the last intact record is appended to "<filename>.damaged", then truncated.
+ * A fresh checkpoint is then written. A file without a single checksummed record that
+ * holds plausible bare messages (a history from before checksums were added) is
+ * converted into records first, the original being renamed to "<filename>.legacy"; a
+ * file that looks like neither is left untouched and the call fails.
+ *
  * @param filename The file used to persist messages
  * @return 0 on success, -1 on failure
  */
@@ -14,17 +68,39 @@ int initMessageStore(const char* filename);
 
 /**
  * Appends a new message to the store.
- * The message is written in binary format.
+ * The message is written in binary format, as a checksummed MessageRecord.
+ * A checkpoint is written every CHECKPOINT_INTERVAL records.
  *
  * @param message The message to be stored
  * @return 0 on success, -1 on failure
  */
 int saveMessage(const struct Message* message);
 
+/**
+ * Appends a record already encoded with encodeRecord(), with the same durability and
+ * checkpointing as saveMessage(). Lets a caller checksum a message once and reuse the
+ * record bytes, e.g. to send the message part of it to clients.
+ *
+ * @param record Record to append
+ * @return 0 on success, -1 on failure
+ */
+int saveRecord(const struct MessageRecord* record);
+
+/**
+ * Fills a record with the magic number, the message and its CRC-32.
+ */
+void encodeRecord(struct MessageRecord* record, const struct Message* message);
+
+/**
+ * Selects the durability of the following saveMessage() calls (STORE_FLUSH by default).
+ */
+void setStoreDurability(enum StoreDurability durability);
+
 /**
  * Loads up to maxMessages from the store into the provided buffer.
  * Supports sorting by time or nickname and ordering (asc/desc).
- * Messages are read from a binary file written using saveMessage().
+ * Messages are read from a binary file written using saveMessage(), through
+ * sortMessagesExternal() with DEFAULT_SORT_MEMORY so large histories keep memory bounded.
  *
  * @param messages Output array to fill with loaded messages
  * @param maxMessages Maximum number of messages to load
@@ -34,9 +110,128 @@ int saveMessage(const struct Message* message);
  */
 int loadMessages(struct Message* messages, int maxMessages, int sortByTime, int ascending);
 
+/**
+ * Reads the most recent messages of the store, straight from the end of the file.
+ * Unlike loadMessages() nothing is sorted: messages come in the order they were saved,
+ * oldest first, and damaged records are skipped. Records still in the stdio buffer of
+ * the store are not seen.
+ *
+ * @param messages Output array
+ * @param maxMessages Most messages to read
+ * @return Number of messages read, or -1 on failure
+ */
+int readLastMessages(struct Message* messages, int maxMessages);
+
+/**
+ * Sorts an array of messages in place, by time or nickname and in the requested order.
+ *
+ * @param messages Array of messages to sort
+ * @param numMessages Number of messages in the array
+ * @param sortByTime If true, sort by timestamp; otherwise by nickname
+ * @param ascending If true, sort in ascending order; false for descending
+ */
+void sortMessages(struct Message* messages, int numMessages, int sortByTime, int ascending);
+
+/**
+ * Returns 1 if the message satisfies every criterion of the filter, 0 otherwise.
+ * A NULL filter matches every message.
+ */
+int matchMessage(const struct Message* message, const struct MessageFilter* filter);
+
+/**
+ * Visits every record of a message file on several threads.
+ * The file is split into nbThreads record-aligned ranges (fewer for small files); range i
+ * is read sequentially by one thread and each record is handed to the visitor with
+ * contexts[i], so contexts need no locking. Ranges are numbered in file order.
+ * A non-zero visitor result aborts that range and makes the call fail.
+ *
+ * @param filename The message file to scan
+ * @param nbThreads Number of ranges and worker threads (at least 1)
+ * @param visitor Called for every record
+ * @param contexts Array of nbThreads per-range contexts
+ * @return Number of ranges actually used, or -1 on failure
+ */
+int visitMessagesParallel(const char* filename, int nbThreads, MessageVisitor visitor, void** contexts);
+
+/**
+ * Scans a message file in parallel and returns the messages matching the filter.
+ * Built on visitMessagesParallel(): every worker filters its own range and the partial
+ * results are concatenated in file order.
+ * Does not depend on initMessageStore().
+ *
+ * @param filename The message file to scan
+ * @param filter Criteria to apply (NULL keeps every message)
+ * @param nbThreads Number of worker threads (values below 1 use one thread)
+ * @param results Set to a malloc'ed array of matching messages, to be freed by the caller
+ * @return Number of matching messages, or -1 on failure
+ */
+int scanMessages(const char* filename, const struct MessageFilter* filter, int nbThreads,
+                 struct Message** results);
+
+/**
+ * Sorts a message file of any size using at most about memoryBudget bytes of message buffers.
+ * Matching messages are read in runs that fit the budget; each run is sorted in memory and,
+ * unless the whole input fits in a single run, spilled to a temporary file. The runs are then
+ * merged with a loser tree (in several passes if there are too many to open at once) and
+ * handed to the visitor in order. The sort is not stable: equal messages of different runs
+ * keep their input order, but qsort() may reorder equal messages within a run.
+ *
+ * @param filename The message file to sort
+ * @param filter Criteria to apply (NULL keeps every message)
+ * @param memoryBudget Bytes available for message buffers (at least a few records are always used)
+ * @param sortByTime If true, sort by timestamp; otherwise by nickname
+ * @param ascending If true, sort in ascending order; false for descending
+ * @param visitor Called once per message in sorted order
+ * @param context Opaque pointer handed to the visitor
+ * @return Number of messages handed to the visitor, or -1 on failure
+ */
+int sortMessagesExternal(const char* filename, const struct MessageFilter* filter, long memoryBudget,
+                         int sortByTime, int ascending, MessageVisitor visitor, void* context);
+
+/**
+ * Follows a message file like `tail -f`: hands the last `backlog` records to the visitor,
+ * then waits for the file to grow and decodes only the records appended since the last
+ * offset. Waiting uses inotify on the file's directory, or polls the file size every
+ * FOLLOW_POLL_INTERVAL_MS when inotify is not available. A file truncated in place is
+ * read again from the start; a file replaced by a new one (rotation) is drained, then the
+ * new file is followed from its beginning. A partially written record is only decoded once
+ * it is complete. Returns when the visitor returns non-zero.
+ *
+ * @param filename The message file to follow
+ * @param filter Criteria to apply (NULL keeps every message)
+ * @param backlog Number of existing records to replay before following (0: none)
+ * @param visitor Called for every matching message, in file order
+ * @param context Opaque pointer handed to the visitor
+ * @return 0 when the visitor stopped, -1 on failure
+ */
+int followMessages(const char* filename, const struct MessageFilter* filter, int backlog,
+                   MessageVisitor visitor, void* context);
+
+/**
+ * Computes the CRC-32 (IEEE 802.3) of a buffer.
+ */
+uint32_t crc32(const void* data, size_t length);
+
+/**
+ * Checks the magic number and checksum of a record read from the store.
+ *
+ * @return 1 if the record is intact, 0 otherwise
+ */
+int validateRecord(const struct MessageRecord* record);
+
+/**
+ * Tells whether a message file holds at least one intact record, stopping at the first.
+ * Readers skip damaged records, so a file where none is intact (e.g. a legacy history
+ * the server has not converted yet) would otherwise just look empty.
+ *
+ * @return 1 if an intact record was found, 0 if none, -1 if the file cannot be read
+ */
+int containsValidRecord(const char* filename);
+
 /**
  * Closes the underlying file used for message storage.
  * Should be called at the end of the program or after loading/saving is done.
+ * Writes a last checkpoint so the next start has nothing to validate.
  */
 void closeMessageStore();
 
@@ -0,0 +1,121 @@
+#include "nickname_map.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// FNV-1a over the nickname, which is at most NAME_LENGTH bytes
+static uint32_t hashNickname(const char* nickname) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < NAME_LENGTH && nickname[i] != '\0'; i++) {
+        hash = (hash ^ (unsigned char)nickname[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int sameNickname(const struct NicknameEntry* entry, const char* nickname) {
+    return entry->connection > 0 && strncmp(entry->nickname, nickname, NAME_LENGTH) == 0;
+}
+
+// Slot holding the nickname, or -1; probing stops at the first free slot
+static int findSlot(const struct NicknameMap* map, const char* nickname) {
+    int mask = map->capacity - 1;
+    for (int slot = hashNickname(nickname) & mask;; slot = (slot + 1) & mask) {
+        const struct NicknameEntry* entry = &map->slots[slot];
+        if (entry->connection == 0) {
+            return -1;
+        }
+        if (sameNickname(entry, nickname)) {
+            return slot;
+        }
+    }
+}
+
+int initNicknameMap(struct NicknameMap* map) {
+    map->capacity = NICKNAME_MAP_INITIAL_SLOTS;
+    map->count = 0;
+    map->tombstones = 0;
+    map->slots = calloc(map->capacity, sizeof(struct NicknameEntry));
+    return (map->slots == NULL) ? -1 : 0;
+}
+
+// Rebuilds the map into `capacity` slots, dropping the tombstones
+static int resizeMap(struct NicknameMap* map, int capacity) {
+    struct NicknameEntry* slots = calloc(capacity, sizeof(struct NicknameEntry));
+    if (slots == NULL) {
+        return -1;
+    }
+    int mask = capacity - 1;
+    for (int i = 0; i < map->capacity; i++) {
+        const struct NicknameEntry* entry = &map->slots[i];
+        if (entry->connection <= 0) {
+            continue;
+        }
+        int slot = hashNickname(entry->nickname) & mask;
+        while (slots[slot].connection != 0) {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = *entry;
+    }
+    free(map->slots);
+    map->slots = slots;
+    map->capacity = capacity;
+    map->tombstones = 0;
+    return 0;
+}
+
+int findNickname(const struct NicknameMap* map, const char* nickname) {
+    int slot = findSlot(map, nickname);
+    return (slot < 0) ? 0 : map->slots[slot].connection;
+}
+
+int insertNickname(struct NicknameMap* map, const char* nickname, int connection) {
+    if (findSlot(map, nickname) >= 0) {
+        return -1;
+    }
+    // Keep at least half of the slots free so probe sequences stay short
+    if ((map->count + map->tombstones + 1) * 2 > map->capacity) {
+        int capacity = ((map->count + 1) * 4 > map->capacity) ? map->capacity * 2 : map->capacity;
+        if (resizeMap(map, capacity) < 0) {
+            return -1;
+        }
+    }
+
+    // First free or removed slot of the probe sequence
+    int mask = map->capacity - 1;
+    int slot = hashNickname(nickname) & mask;
+    while (map->slots[slot].connection > 0) {
+        slot = (slot + 1) & mask;
+    }
+    if (map->slots[slot].connection < 0) {
+        map->tombstones--;
+    }
+    strncpy(map->slots[slot].nickname, nickname, NAME_LENGTH - 1);
+    map->slots[slot].nickname[NAME_LENGTH - 1] = '\0';
+    map->slots[slot].connection = connection;
+    map->count++;
+    return 0;
+}
+
+void moveNickname(struct NicknameMap* map, const char* nickname, int connection) {
+    int slot = findSlot(map, nickname);
+    if (slot >= 0) {
+        map->slots[slot].connection = connection;
+    }
+}
+
+void removeNickname(struct NicknameMap* map, const char* nickname) {
+    int slot = findSlot(map, nickname);
+    if (slot >= 0) {
+        map->slots[slot].connection = -1;
+        map->count--;
+        map->tombstones++;
+    }
+}
+
+void freeNicknameMap(struct NicknameMap* map) {
+    free(map->slots);
+    map->slots = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
@@ -0,0 +1,62 @@
+#ifndef NICKNAME_MAP_H
+#define NICKNAME_MAP_H
+
+#include "chat.h"
+
+#define NICKNAME_MAP_INITIAL_SLOTS 64   ///< Slots allocated by initNicknameMap() (power of two)
+
+/**
+ * One slot of the map. connection is 0 for a free slot and -1 for a removed entry
+ * (a tombstone, which keeps the probe sequences of the other entries intact).
+ */
+struct NicknameEntry {
+    char nickname[NAME_LENGTH];  ///< Key, NUL-terminated
+    int connection;              ///< Value: index of the connection in the server arrays
+};
+
+/**
+ * Open-addressing hash map from nickname to connection index, with linear probing.
+ * It is grown when more than half of the slots are used or removed.
+ */
+struct NicknameMap {
+    struct NicknameEntry* slots;
+    int capacity;    ///< Number of slots (power of two)
+    int count;       ///< Live entries
+    int tombstones;  ///< Removed entries still occupying a slot
+};
+
+/**
+ * Allocates an empty map.
+ *
+ * @return 0 on success, -1 if memory is exhausted
+ */
+int initNicknameMap(struct NicknameMap* map);
+
+/**
+ * Returns the connection holding a nickname, 0 if none does.
+ */
+int findNickname(const struct NicknameMap* map, const char* nickname);
+
+/**
+ * Gives a nickname to a connection.
+ *
+ * @return 0 on success, -1 if another connection holds the nickname or memory is exhausted
+ */
+int insertNickname(struct NicknameMap* map, const char* nickname, int connection);
+
+/**
+ * Points an existing nickname to another connection index (e.g. after compaction).
+ */
+void moveNickname(struct NicknameMap* map, const char* nickname, int connection);
+
+/**
+ * Frees a nickname; does nothing if it is not in the map.
+ */
+void removeNickname(struct NicknameMap* map, const char* nickname);
+
+/**
+ * Frees the slots.
+ */
+void freeNicknameMap(struct NicknameMap* map);
+
+#endif
@@ -0,0 +1,242 @@
+#include "output_queue.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "server_stats.h"
+
+// Lanes in the order they are served within a round, and their share of a round
+static const enum MessageClass laneOrder[MESSAGE_CLASSES] = { MESSAGE_CONTROL, MESSAGE_INTERACTIVE, MESSAGE_BULK };
+static const int laneWeights[MESSAGE_CLASSES] = {
+    [MESSAGE_INTERACTIVE] = INTERACTIVE_WEIGHT,
+    [MESSAGE_CONTROL] = CONTROL_WEIGHT,
+    [MESSAGE_BULK] = BULK_WEIGHT,
+};
+
+void initOutbox(struct Outbox* outbox) {
+    memset(outbox, 0, sizeof(*outbox));
+    outbox->current = -1;
+    for (int i = 0; i < MESSAGE_CLASSES; i++) {
+        outbox->credits[i] = laneWeights[i];
+    }
+}
+
+int outboxPush(struct Outbox* outbox, struct Frame* frame) {
+    struct MessageQueue* queue = &outbox->lanes[messageClass(frameMessage(frame))];
+    if (queue->count == OUTPUT_QUEUE_LIMIT) {
+        return -1;
+    }
+
+    if (queue->count == queue->capacity) {
+        int capacity = (queue->capacity == 0) ? 16 : queue->capacity * 2;
+        struct Frame** items = malloc(capacity * sizeof(struct Frame*));
+        if (items == NULL) {
+            return -1;
+        }
+        // Unwrap the ring into the new array
+        for (int i = 0; i < queue->count; i++) {
+            items[i] = queue->items[(queue->head + i) % queue->capacity];
+        }
+        free(queue->items);
+        queue->items = items;
+        queue->head = 0;
+        queue->capacity = capacity;
+    }
+
+    queue->items[(queue->head + queue->count) % queue->capacity] = retainFrame(frame);
+    queue->count++;
+    return 0;
+}
+
+int outboxPending(const struct Outbox* outbox) {
+    for (int i = 0; i < MESSAGE_CLASSES; i++) {
+        if (outbox->lanes[i].count > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Picks the lane of the next message: the first lane in order that has messages and credit
+// left; when every waiting lane spent its credit, a new round starts
+static int nextLane(struct Outbox* outbox) {
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < MESSAGE_CLASSES; i++) {
+            int lane = laneOrder[i];
+            if (outbox->lanes[lane].count > 0 && outbox->credits[lane] > 0) {
+                return lane;
+            }
+        }
+        for (int i = 0; i < MESSAGE_CLASSES; i++) {
+            outbox->credits[i] = laneWeights[i];
+        }
+    }
+    return -1;
+}
+
+// Returns the head message of the lane scheduled next (the one partly sent, if any), NULL if
+// the outbox is empty
+static struct Frame* headFrame(struct Outbox* outbox) {
+    if (outbox->current < 0) {
+        outbox->current = nextLane(outbox);
+        if (outbox->current < 0) {
+            return NULL;
+        }
+        outbox->credits[outbox->current]--;
+        outbox->sentBytes = 0;
+    }
+    struct MessageQueue* queue = &outbox->lanes[outbox->current];
+    return queue->items[queue->head];
+}
+
+// Drops the head message of the current lane once it is fully sent
+static void popFrame(struct Outbox* outbox) {
+    struct MessageQueue* queue = &outbox->lanes[outbox->current];
+    releaseFrame(queue->items[queue->head]);
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    outbox->current = -1;
+}
+
+// Writes as much as possible, with or without blocking
+static int writeOutbox(struct Outbox* outbox, int fd, int flags, OutboxSentHook onSent, int* sent) {
+    struct Frame* frame;
+    while ((frame = headFrame(outbox)) != NULL) {
+        const char* data = (const char*)frameMessage(frame);
+        if (outbox->sentBytes == 0 && onSent != NULL) {
+            outbox->startNs = monotonicNs();
+        }
+        ssize_t bytes = send(fd, data + outbox->sentBytes, frameLength(frame) - outbox->sentBytes,
+                             MSG_NOSIGNAL | flags);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+        }
+
+        outbox->sentBytes += bytes;
+        outbox->bytesWritten += bytes;
+        if (outbox->sentBytes == frameLength(frame)) {
+            if (onSent != NULL) {
+                onSent(fd, frame, outbox->startNs, monotonicNs());
+            }
+            popFrame(outbox);
+            (*sent)++;
+        }
+    }
+    return 0;
+}
+
+int outboxFlush(struct Outbox* outbox, int fd, OutboxSentHook onSent, int* sent) {
+    return writeOutbox(outbox, fd, MSG_DONTWAIT, onSent, sent);
+}
+
+int outboxFlushTo(struct Outbox* outbox, int (*take)(void* context, const struct Frame* frame), void* context,
+                  int* sent) {
+    struct Frame* frame;
+    while ((frame = headFrame(outbox)) != NULL) {
+        if (!take(context, frame)) {
+            return 1;
+        }
+        outbox->bytesWritten += frameLength(frame);
+        popFrame(outbox);
+        (*sent)++;
+    }
+    return 0;
+}
+
+// Appends one frame to a stream built by outboxSave()
+static unsigned char* saveFrame(unsigned char* out, const struct Frame* frame) {
+    uint32_t length = (uint32_t)frameLength(frame);
+    memcpy(out, &length, sizeof(length));
+    memcpy(out + sizeof(length), frameMessage(frame), length);
+    return out + sizeof(length) + length;
+}
+
+unsigned char* outboxSave(struct Outbox* outbox, size_t* length, uint32_t* sentBytes) {
+    *length = 0;
+    *sentBytes = 0;
+    for (int i = 0; i < MESSAGE_CLASSES; i++) {
+        struct MessageQueue* queue = &outbox->lanes[i];
+        for (int j = 0; j < queue->count; j++) {
+            *length += sizeof(uint32_t) + frameLength(queue->items[(queue->head + j) % queue->capacity]);
+        }
+    }
+    if (*length == 0) {
+        return NULL;
+    }
+    unsigned char* stream = malloc(*length);
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    unsigned char* out = stream;
+    if (outbox->current >= 0) {
+        struct MessageQueue* queue = &outbox->lanes[outbox->current];
+        out = saveFrame(out, queue->items[queue->head]);
+        *sentBytes = (uint32_t)outbox->sentBytes;
+    }
+    for (int i = 0; i < MESSAGE_CLASSES; i++) {
+        struct MessageQueue* queue = &outbox->lanes[i];
+        for (int j = (i == outbox->current) ? 1 : 0; j < queue->count; j++) {
+            out = saveFrame(out, queue->items[(queue->head + j) % queue->capacity]);
+        }
+    }
+    return stream;
+}
+
+int outboxRestore(struct Outbox* outbox, const unsigned char* stream, size_t length, uint32_t sentBytes) {
+    size_t offset = 0;
+    int first = 1;
+    while (offset < length) {
+        uint32_t frameBytes;
+        if (length - offset < sizeof(frameBytes)) {
+            return -1;
+        }
+        memcpy(&frameBytes, stream + offset, sizeof(frameBytes));
+        offset += sizeof(frameBytes);
+        if (frameBytes < sizeof(struct Message) || length - offset < frameBytes) {
+            return -1;
+        }
+
+        struct Message message;  // Copied out: the stream is not aligned
+        memcpy(&message, stream + offset, sizeof(message));
+        struct Frame* frame = createBatchFrame(&message, stream + offset + sizeof(message),
+                                               frameBytes - sizeof(message));
+        if (frame == NULL) {
+            return -1;
+        }
+        int pushed = outboxPush(outbox, frame);
+        releaseFrame(frame);
+        if (pushed < 0) {
+            return -1;
+        }
+        offset += frameBytes;
+
+        // The partly sent message is the head of its lane in the empty outbox: finish it first
+        if (first && sentBytes > 0 && sentBytes < frameBytes) {
+            outbox->current = messageClass(&message);
+            outbox->credits[outbox->current]--;
+            outbox->sentBytes = sentBytes;
+        }
+        first = 0;
+    }
+    return 0;
+}
+
+void freeOutbox(struct Outbox* outbox) {
+    for (int i = 0; i < MESSAGE_CLASSES; i++) {
+        struct MessageQueue* queue = &outbox->lanes[i];
+        for (int j = 0; j < queue->count; j++) {
+            releaseFrame(queue->items[(queue->head + j) % queue->capacity]);
+        }
+        free(outbox->lanes[i].items);
+        outbox->lanes[i].items = NULL;
+        outbox->lanes[i].count = 0;
+        outbox->lanes[i].capacity = 0;
+    }
+    outbox->current = -1;
+}
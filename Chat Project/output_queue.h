@@ -0,0 +1,109 @@
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chat.h"
+#include "frame.h"
+
+#define OUTPUT_QUEUE_LIMIT 1024   ///< Messages queued per class and connection before the class overflows
+#define CONTROL_WEIGHT 16         ///< Messages the control lane may send per scheduling round
+#define INTERACTIVE_WEIGHT 8      ///< Messages the interactive lane may send per scheduling round
+#define BULK_WEIGHT 1             ///< Messages the bulk lane may send per scheduling round
+
+/**
+ * Growable ring of frames waiting to be sent; each holds a reference on its frame.
+ */
+struct MessageQueue {
+    struct Frame** items;
+    int head;       ///< Index of the oldest message
+    int count;      ///< Messages queued
+    int capacity;   ///< Allocated slots (0 until the first push)
+};
+
+/**
+ * Output of one connection: one lane per message class, drained by a weighted
+ * round-robin scheduler. A message, once started, is always finished before
+ * another lane is served, since the stream carries whole messages back to back.
+ */
+struct Outbox {
+    struct MessageQueue lanes[MESSAGE_CLASSES];
+    int credits[MESSAGE_CLASSES];   ///< Messages each lane may still send in the current round
+    int current;                    ///< Lane whose head message is partly sent, -1 if none
+    size_t sentBytes;               ///< Bytes of that message already written
+    uint64_t startNs;               ///< When its first byte was offered to the socket
+    uint64_t bytesWritten;          ///< Bytes written since the outbox was initialised
+};
+
+/**
+ * Prepares an empty outbox (allocates nothing).
+ */
+void initOutbox(struct Outbox* outbox);
+
+/**
+ * Queues a frame in the lane of its message's class, taking a reference on it (no copy).
+ *
+ * @return 0 on success, -1 if the lane already holds OUTPUT_QUEUE_LIMIT messages or memory is exhausted
+ */
+int outboxPush(struct Outbox* outbox, struct Frame* frame);
+
+/**
+ * Called for each message fully written, with the time its first byte was offered to the
+ * socket and the time its last byte was taken (monotonicNs()); a message cut short by a
+ * full socket also spans the wait for POLLOUT.
+ */
+typedef void (*OutboxSentHook)(int fd, const struct Frame* frame, uint64_t startNs, uint64_t endNs);
+
+/**
+ * Writes queued messages to a non-blocking socket until it would block or the outbox is empty.
+ *
+ * @param outbox Outbox of the connection
+ * @param fd Non-blocking (or MSG_DONTWAIT-friendly) socket
+ * @param onSent Called for each message fully written, NULL if not needed
+ * @param sent Incremented by the number of messages fully written
+ * @return 0 if the outbox is empty, 1 if messages remain (wait for POLLOUT), -1 on socket error
+ */
+int outboxFlush(struct Outbox* outbox, int fd, OutboxSentHook onSent, int* sent);
+
+/**
+ * Hands queued messages, in scheduling order, to a transport that takes whole messages
+ * (a shared-memory ring) until it refuses one.
+ *
+ * @param take Called with each message; returns 1 if it took it, 0 if it is full
+ * @param context Passed to take
+ * @param sent Incremented by the number of messages taken
+ * @return 0 if the outbox is empty, 1 if messages remain (retry once the transport has room)
+ */
+int outboxFlushTo(struct Outbox* outbox, int (*take)(void* context, const struct Frame* frame), void* context,
+                  int* sent);
+
+/**
+ * Returns non-zero if messages are waiting.
+ */
+int outboxPending(const struct Outbox* outbox);
+
+/**
+ * Serializes the queued messages to hand them to another process, the partly sent one
+ * first: for each, its length as a uint32_t, then its wire bytes.
+ *
+ * @param length Receives the length of the stream
+ * @param sentBytes Receives the bytes of the first message already written
+ * @return The stream, to free(); NULL if the outbox is empty (*length is 0) or memory is exhausted
+ */
+unsigned char* outboxSave(struct Outbox* outbox, size_t* length, uint32_t* sentBytes);
+
+/**
+ * Refills an empty outbox from a stream built by outboxSave(), so sending resumes exactly
+ * where the other process stopped.
+ *
+ * @return 0 on success, -1 if the stream is malformed or memory is exhausted
+ */
+int outboxRestore(struct Outbox* outbox, const unsigned char* stream, size_t length, uint32_t sentBytes);
+
+/**
+ * Releases the queued frames.
+ */
+void freeOutbox(struct Outbox* outbox);
+
+#endif
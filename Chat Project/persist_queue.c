@@ -0,0 +1,145 @@
+#include "persist_queue.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "server_stats.h"
+#include "trace.h"
+
+// Single-producer (event loop) single-consumer (writer thread) ring of frames
+static struct Frame* slots[PERSIST_QUEUE_SLOTS];
+static _Alignas(64) atomic_uint_fast64_t head = 0;  // Frames written (consumer)
+static _Alignas(64) atomic_uint_fast64_t tail = 0;  // Frames queued (producer)
+static atomic_int running = 0;
+static pthread_t writerThread;
+static atomic_int writerIdle = 0;    // Set while the writer waits for frames on queuedEvent
+static atomic_int producerFull = 0;  // Set while the event loop waits for room on freedEvent
+static int queuedEvent = -1;         // Rung by the event loop when the idle writer has work
+static int freedEvent = -1;          // Rung by the writer when the full queue has room again
+
+// Appends one frame to the store and accounts for it
+static int writeFrame(struct Frame* frame) {
+    uint64_t startNs = monotonicNs();
+    int saved = saveRecord(&frame->record);
+    if (saved < 0) {
+        atomic_fetch_add_explicit(&serverStats.persistDrops, 1, memory_order_relaxed);
+        logMessage(LOG_WARNING, "Failed to save message to history");
+    }
+    uint64_t persistedNs = monotonicNs();
+    traceEvent(frame->traceId, "persist-commit", TRACE_PIPELINE_TRACK, startNs, persistedNs);
+    histogramRecord(&serverStats.persistence, persistedNs - frame->readNs);
+    releaseFrame(frame);
+    return saved;
+}
+
+// Rings an eventfd; the counter keeps the wakeup until the waiter reads it
+static void ring(int event) {
+    uint64_t one = 1;
+    while (write(event, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+// Blocks until an eventfd is rung
+static void waitRing(int event) {
+    uint64_t count;
+    while (read(event, &count, sizeof(count)) < 0 && errno == EINTR) {
+    }
+}
+
+// Writes every queued frame, returns how many
+static int drainQueue(void) {
+    uint64_t first = atomic_load_explicit(&head, memory_order_relaxed);
+    uint64_t last = atomic_load_explicit(&tail, memory_order_acquire);
+    for (uint64_t i = first; i != last; i++) {
+        writeFrame(slots[i & (PERSIST_QUEUE_SLOTS - 1)]);
+    }
+    atomic_store(&head, last);  // Sequentially consistent: ordered before reading producerFull
+    if (last != first && atomic_load(&producerFull)) {
+        ring(freedEvent);
+    }
+    return (int)(last - first);
+}
+
+// Writer thread: drains the queue, sleeps on queuedEvent when there is nothing to do
+static void* runWriter(void* arg) {
+    (void)arg;
+    while (atomic_load(&running)) {
+        if (drainQueue() != 0) {
+            continue;
+        }
+        // Announce the sleep, then look again: a frame queued in between rings queuedEvent
+        atomic_store(&writerIdle, 1);
+        if (atomic_load(&tail) == atomic_load_explicit(&head, memory_order_relaxed) && atomic_load(&running)) {
+            waitRing(queuedEvent);
+        }
+        atomic_store(&writerIdle, 0);
+    }
+    drainQueue();
+    return NULL;
+}
+
+int startPersistence(void) {
+    queuedEvent = eventfd(0, EFD_CLOEXEC);
+    freedEvent = eventfd(0, EFD_CLOEXEC);
+    if (queuedEvent < 0 || freedEvent < 0) {
+        stopPersistence();
+        return -1;
+    }
+    atomic_store(&running, 1);
+    if (pthread_create(&writerThread, NULL, runWriter, NULL) != 0) {
+        atomic_store(&running, 0);
+        stopPersistence();
+        return -1;
+    }
+    return 0;
+}
+
+int persistBacklogged(void) {
+    uint64_t queued = atomic_load_explicit(&tail, memory_order_relaxed)
+                      - atomic_load_explicit(&head, memory_order_relaxed);
+    return queued >= PERSIST_QUEUE_SLOTS - PERSIST_QUEUE_HEADROOM;
+}
+
+int persistFrame(struct Frame* frame) {
+    if (!atomic_load_explicit(&running, memory_order_relaxed)) {
+        return writeFrame(retainFrame(frame));
+    }
+
+    uint64_t position = atomic_load_explicit(&tail, memory_order_relaxed);
+    if (position - atomic_load_explicit(&head, memory_order_acquire) == PERSIST_QUEUE_SLOTS) {
+        // Reads stop well before this (persistBacklogged()): only the headroom overflowed, so
+        // wait for the writer rather than lose the message
+        atomic_fetch_add_explicit(&serverStats.persistStalls, 1, memory_order_relaxed);
+        logMessage(LOG_WARNING, "History writer %d messages behind, waiting for it", PERSIST_QUEUE_SLOTS);
+        atomic_store(&producerFull, 1);
+        while (position - atomic_load(&head) == PERSIST_QUEUE_SLOTS) {
+            waitRing(freedEvent);
+        }
+        atomic_store(&producerFull, 0);
+    }
+    slots[position & (PERSIST_QUEUE_SLOTS - 1)] = retainFrame(frame);
+    atomic_store(&tail, position + 1);  // Sequentially consistent: ordered before reading writerIdle
+    if (atomic_load(&writerIdle)) {
+        ring(queuedEvent);
+    }
+    return 0;
+}
+
+void stopPersistence(void) {
+    if (atomic_exchange(&running, 0)) {
+        ring(queuedEvent);
+        pthread_join(writerThread, NULL);
+    }
+    if (queuedEvent >= 0) {
+        close(queuedEvent);
+        queuedEvent = -1;
+    }
+    if (freedEvent >= 0) {
+        close(freedEvent);
+        freedEvent = -1;
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef PERSIST_QUEUE_H
+#define PERSIST_QUEUE_H
+
+#include "frame.h"
+
+#define PERSIST_QUEUE_SLOTS 4096   ///< Frames waiting to be written (power of two)
+#define PERSIST_QUEUE_HEADROOM 512 ///< Slots kept for messages already read when clients are paused
+#define PERSIST_BACKOFF_MS 1       ///< Pause of client reads while the queue is backlogged
+
+/**
+ * Starts the background thread appending queued frames to the message store.
+ * Until it is started, persistFrame() saves synchronously.
+ *
+ * @return 0 on success, -1 if the thread could not be started
+ */
+int startPersistence(void);
+
+/**
+ * Queues a frame for the message store, taking a reference on it.
+ * The event loop only pushes a pointer; the record was checksummed once by createFrame().
+ * No message is dropped: when the queue is full the call waits for the writer thread, which
+ * the event loop avoids by pausing client reads while persistBacklogged().
+ *
+ * @return 0 on success, -1 if, synchronously, the frame could not be saved
+ */
+int persistFrame(struct Frame* frame);
+
+/**
+ * Tells whether the queue is within PERSIST_QUEUE_HEADROOM of full, in which case clients
+ * must not be read until the writer thread catches up.
+ */
+int persistBacklogged(void);
+
+/**
+ * Writes every queued frame, then stops the background thread.
+ * Must be called before closeMessageStore().
+ */
+void stopPersistence(void);
+
+#endif
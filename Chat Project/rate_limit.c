@@ -0,0 +1,35 @@
+#include "rate_limit.h"
+
+void initTokenBucket(struct TokenBucket* bucket, double rate, double minBurst, uint64_t nowNs) {
+    bucket->rate = rate;
+    bucket->burst = (rate > minBurst) ? rate : minBurst;
+    bucket->tokens = bucket->burst;
+    bucket->lastNs = nowNs;
+}
+
+int tokenBucketReady(struct TokenBucket* bucket, uint64_t nowNs) {
+    if (bucket->rate <= 0) {
+        return 1;
+    }
+    if (nowNs > bucket->lastNs) {
+        bucket->tokens += (nowNs - bucket->lastNs) * bucket->rate / 1e9;
+        if (bucket->tokens > bucket->burst) {
+            bucket->tokens = bucket->burst;
+        }
+        bucket->lastNs = nowNs;
+    }
+    return bucket->tokens > 0;
+}
+
+void tokenBucketCharge(struct TokenBucket* bucket, double amount) {
+    if (bucket->rate > 0) {
+        bucket->tokens -= amount;
+    }
+}
+
+uint64_t tokenBucketWaitNs(const struct TokenBucket* bucket) {
+    if (bucket->rate <= 0 || bucket->tokens > 0) {
+        return 0;
+    }
+    return (uint64_t)(-bucket->tokens / bucket->rate * 1e9) + 1000;  // Just past zero
+}
@@ -0,0 +1,52 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdint.h>
+
+/**
+ * Token bucket: holds up to `burst` tokens, refilled at `rate` tokens per second.
+ * Work is admitted while the balance is positive and charged afterwards, so the
+ * balance may go negative (a debt paid back before the next admission).
+ * A rate of 0 means unlimited.
+ */
+struct TokenBucket {
+    double tokens;        ///< Current balance
+    double rate;          ///< Tokens added per second, 0 for no limit
+    double burst;         ///< Largest balance
+    uint64_t lastNs;      ///< monotonicNs() of the last refill
+};
+
+/**
+ * Limits applied by the server; 0 disables a limit.
+ */
+struct RateLimits {
+    double messagesPerSecond;        ///< Per connection
+    double bytesPerSecond;           ///< Per connection
+    double globalMessagesPerSecond;  ///< All connections together
+    double globalBytesPerSecond;     ///< All connections together
+    double acceptsPerSecond;         ///< New connections
+};
+
+/**
+ * Sets up a full bucket; the burst is one second worth of tokens, and at least `minBurst`.
+ */
+void initTokenBucket(struct TokenBucket* bucket, double rate, double minBurst, uint64_t nowNs);
+
+/**
+ * Refills the bucket and tells whether work may be admitted.
+ *
+ * @return 1 if the balance is positive (or the bucket is unlimited), 0 otherwise
+ */
+int tokenBucketReady(struct TokenBucket* bucket, uint64_t nowNs);
+
+/**
+ * Charges admitted work; does nothing on an unlimited bucket.
+ */
+void tokenBucketCharge(struct TokenBucket* bucket, double amount);
+
+/**
+ * Returns the time until the balance becomes positive again, 0 if it already is.
+ */
+uint64_t tokenBucketWaitNs(const struct TokenBucket* bucket);
+
+#endif
@@ -0,0 +1,174 @@
+#include "relay.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Highest sequence delivered for one origin
+struct OriginSeen {
+    uint32_t origin;
+    uint64_t sequence;
+};
+
+static uint32_t selfOrigin = 0;
+static uint64_t nextSequence = 0;
+static struct RelayPeer peers[MAX_RELAY_PEERS];
+static int nbPeers = 0;
+static struct OriginSeen seen[MAX_RELAY_ORIGINS];  // Few servers: a linear scan is enough
+static int nbSeen = 0;
+
+void initRelay(uint32_t origin) {
+    selfOrigin = origin;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    nextSequence = (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+uint32_t relayOrigin(void) {
+    return selfOrigin;
+}
+
+int addRelayPeer(const char* address) {
+    const char* colon = strrchr(address, ':');
+    if (nbPeers == MAX_RELAY_PEERS || colon == NULL || colon == address
+        || (size_t)(colon - address) >= sizeof(peers[0].host)) {
+        return -1;
+    }
+    int port = atoi(colon + 1);
+    if (port <= 0 || port > 65535) {
+        return -1;
+    }
+
+    struct RelayPeer* peer = &peers[nbPeers];
+    memset(peer, 0, sizeof(*peer));
+    memcpy(peer->host, address, colon - address);
+    peer->port = (uint16_t)port;
+
+    // Resolved now, before the event loop runs: getaddrinfo() may block on DNS
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* result;
+    if (getaddrinfo(peer->host, colon + 1, &hints, &result) != 0) {
+        return -1;
+    }
+    memcpy(&peer->address, result->ai_addr, sizeof(peer->address));
+    freeaddrinfo(result);
+    nbPeers++;
+    return 0;
+}
+
+struct RelayPeer* relayPeers(int* count) {
+    *count = nbPeers;
+    return peers;
+}
+
+int relayListen(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in address = setupServer(port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int relayDial(const struct RelayPeer* peer, int* connecting) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    // Relayed messages are small and latency-bound: do not wait to fill segments
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    *connecting = 0;
+    if (connect(fd, (const struct sockaddr*)&peer->address, sizeof(peer->address)) < 0) {
+        if (errno != EINPROGRESS) {
+            close(fd);
+            return -1;
+        }
+        *connecting = 1;
+    }
+    return fd;
+}
+
+int relayConnected(int fd) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0) {
+        return -1;
+    }
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+// Queues the message, then the relay fields as the payload: on the wire, a RelayFrame
+static struct Frame* wrapRelayFrame(const struct RelayFrame* relayFrame) {
+    return createBatchFrame(&relayFrame->message, &relayFrame->magic,
+                            sizeof(struct RelayFrame) - offsetof(struct RelayFrame, magic));
+}
+
+struct Frame* createRelayHello(void) {
+    struct RelayFrame hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.magic = RELAY_MAGIC;
+    hello.origin = selfOrigin;
+    hello.message.flags = MESSAGE_CONTROL;  // Sent ahead of anything already queued
+    return wrapRelayFrame(&hello);
+}
+
+struct Frame* createRelayFrame(const struct Message* message) {
+    struct RelayFrame relayFrame;
+    relayFrame.message = *message;
+    relayFrame.magic = RELAY_MAGIC;
+    relayFrame.origin = selfOrigin;
+    relayFrame.sequence = nextSequence++;
+    return wrapRelayFrame(&relayFrame);
+}
+
+int acceptRelayFrame(const struct RelayFrame* frame) {
+    if (frame->origin == selfOrigin) {
+        return 0;
+    }
+
+    for (int i = 0; i < nbSeen; i++) {
+        if (seen[i].origin == frame->origin) {
+            if (frame->sequence <= seen[i].sequence) {
+                return 0;  // Already delivered through another link
+            }
+            seen[i].sequence = frame->sequence;
+            return 1;
+        }
+    }
+
+    // First message of this origin; when the table is full, forget the oldest entry
+    if (nbSeen == MAX_RELAY_ORIGINS) {
+        memmove(&seen[0], &seen[1], (MAX_RELAY_ORIGINS - 1) * sizeof(struct OriginSeen));
+        nbSeen--;
+    }
+    seen[nbSeen].origin = frame->origin;
+    seen[nbSeen].sequence = frame->sequence;
+    nbSeen++;
+    return 1;
+}
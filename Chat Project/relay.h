@@ -0,0 +1,125 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chat.h"
+#include "frame.h"
+
+#define RELAY_MAGIC 0x594C4552u     ///< "RELY" in little-endian, first field of every relay frame
+#define MAX_RELAY_PEERS 32          ///< Peers a server dials with -P
+#define MAX_RELAY_ORIGINS 256       ///< Servers whose sequence numbers are remembered
+#define RELAY_RETRY_MS 1000         ///< Delay between two attempts to reach a peer that is down
+
+/**
+ * Unit of the server-to-server protocol: a message and where it comes from.
+ * The first frame sent on a link is a hello with sequence 0 and an empty message.
+ * The message comes first so a relay frame is queued like a batch: the message, then
+ * the rest of the frame as its payload.
+ */
+struct RelayFrame {
+    struct Message message;   ///< Message, already timestamped by its origin
+    uint32_t magic;           ///< RELAY_MAGIC
+    uint32_t origin;          ///< Id of the server where the message was posted
+    uint64_t sequence;        ///< Increasing per origin, also across restarts; 0 for the hello
+};
+
+_Static_assert(offsetof(struct RelayFrame, magic) == sizeof(struct Message),
+               "the relay fields must follow the message with no padding");
+
+/**
+ * State of one link to a peer server, kept next to its connection.
+ */
+struct RelayLink {
+    size_t received;            ///< Bytes of `pending` received so far
+    struct RelayFrame pending;  ///< Frame being reassembled
+    uint32_t origin;            ///< Id of the peer, known once its hello arrived (0 before)
+    int outbound;               ///< Index of the peer dialled with -P, -1 for an accepted link
+    int connecting;             ///< Set until the non-blocking connect to the peer completes
+};
+
+/**
+ * A peer this server dials, and redials when the link drops.
+ */
+struct RelayPeer {
+    char host[64];
+    uint16_t port;
+    struct sockaddr_in address; ///< Resolved once by addRelayPeer(), so dialling never waits on DNS
+    int linked;                 ///< Set while a link to the peer is open or being opened
+    uint64_t nextAttemptNs;     ///< monotonicNs() of the next connection attempt
+};
+
+/**
+ * Sets the id this server stamps on the messages it originates.
+ * Sequence numbers start from the wall clock, so a restarted server is not taken for a replay.
+ *
+ * @param origin Non-zero id, unique among the federated servers
+ */
+void initRelay(uint32_t origin);
+
+/**
+ * Returns the id set by initRelay().
+ */
+uint32_t relayOrigin(void);
+
+/**
+ * Adds a peer to dial, given as "host:port", and resolves its address.
+ *
+ * @return 0 on success, -1 if the address is invalid or unknown, or too many peers were given
+ */
+int addRelayPeer(const char* address);
+
+/**
+ * Returns the peers added with addRelayPeer() and their number.
+ */
+struct RelayPeer* relayPeers(int* count);
+
+/**
+ * Creates the non-blocking socket accepting links from peer servers.
+ *
+ * @return The listening socket, -1 on failure
+ */
+int relayListen(uint16_t port);
+
+/**
+ * Starts connecting a non-blocking socket to a peer; the connection usually completes
+ * later, when the socket becomes writable (see relayConnected()).
+ *
+ * @param connecting Set to 1 if the connection is still in progress, 0 if it completed at once
+ * @return The socket, -1 if the peer could not be reached
+ */
+int relayDial(const struct RelayPeer* peer, int* connecting);
+
+/**
+ * Tells how a connection started by relayDial() ended, once its socket is writable.
+ *
+ * @return 0 if the link is up, -1 with errno set if the peer could not be reached
+ */
+int relayConnected(int fd);
+
+/**
+ * Builds the hello announcing this server's origin id, to queue first on a new link.
+ *
+ * @return The frame, holding one reference, or NULL if memory is exhausted
+ */
+struct Frame* createRelayHello(void);
+
+/**
+ * Wraps a locally originated message into a relay frame with the next sequence number,
+ * ready to be queued in the outbox of every peer link.
+ *
+ * @return The frame, holding one reference, or NULL if memory is exhausted
+ */
+struct Frame* createRelayFrame(const struct Message* message);
+
+/**
+ * Decides whether a frame received from a peer must be delivered locally, and records it.
+ * Our own messages coming back and frames already seen (through another link) are refused.
+ *
+ * @return 1 to deliver, 0 to drop
+ */
+int acceptRelayFrame(const struct RelayFrame* frame);
+
+#endif
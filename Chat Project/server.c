@@ -1,6 +1,10 @@
+#define _GNU_SOURCE  // sched_setaffinity
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,49 +16,218 @@
 #include "chat.h"
 #include "server.h"
 #include "message_store.h"  // Handles persistent message logging
+#include "server_stats.h"   // Counters and latency histograms served on the admin socket
+#include "logger.h"         // Asynchronous logging, keeps console I/O off the event loop
+#include "trace.h"          // Sampled per-message tracing in Chrome trace-event format
+#include "capture.h"        // Records the inbound stream for chat_replay
+#include "relay.h"          // Federation with peer servers
+#include "handoff.h"        // Hands the connections over to a new server process
+#include "persist_queue.h"  // Appends the encoded records to the history off the event loop
+#include "lz.h"             // Compresses history batches
 
-#define PORT 12345  // Default port the server listens on
+static volatile sig_atomic_t stopRequested = 0;  // Set by SIGINT/SIGTERM
+
+// Asks the event loop to stop so the server can shut down cleanly
+static void requestStop(int signal) {
+    (void)signal;
+    stopRequested = 1;
+}
 
 void error(const char* msg) {
     perror(msg);
     exit(1);
 }
 
+// Sets up the descriptor arrays around a listening socket
+struct Server adoptServer(int _listenFd, int _maxClients) {
+    struct Server retval;
+    memset(&retval, 0, sizeof(retval));  // No rate limits until setRateLimits()
+    retval.nbClients = 0;
+    retval.maxClients = _maxClients;
+    retval.shmListenFd = -1;
+    retval.relayListenFd = -1;
+    retval.upgradeListenFd = -1;
+    retval.nbPeers = 0;
+    retval.nextConnectionId = 1;
+    retval.capacity = INITIAL_CAPACITY;
+    retval.fds = calloc(retval.capacity, sizeof(struct pollfd));
+    retval.clients = calloc(retval.capacity, sizeof(struct Connection));
+    if (retval.fds == NULL || retval.clients == NULL) {
+        error("Memory allocation failed");
+    }
+    if (initNicknameMap(&retval.nicknames) < 0) {
+        error("Memory allocation failed");
+    }
+    retval.fds[0].fd = _listenFd;
+    retval.fds[0].events = POLLIN;
+    return retval;
+}
+
 // Initializes the server socket, binds it, and sets it up for polling
-struct Server createServer() {
+struct Server createServer(uint16_t _port, int _maxClients) {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd == -1) {
         error("Error creating socket");
     }
 
-    struct Server retval;
-    retval.nbClients = 0;
-    memset(&retval.fds[0], 0, sizeof(struct pollfd));
-    retval.fds[0].fd = fd;
-    retval.fds[0].events = POLLIN;
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char*)&on, sizeof(on)) < 0) {
+        error("Error setting reuse option");
+    }
 
     // Set up server address and bind to the specified port
-    struct sockaddr_in serverAddress = setupServer(PORT);
+    struct sockaddr_in serverAddress = setupServer(_port);
     serverAddress.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    if (bind(retval.fds[0].fd, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) == -1) {
+    if (bind(fd, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) == -1) {
         error("Error binding");
     }
 
-    int on = 1;
-    if (setsockopt(retval.fds[0].fd, SOL_SOCKET, SO_REUSEADDR, (char*)&on, sizeof(on)) < 0) {
-        error("Error setting reuse option");
-    }
-
-    if (ioctl(retval.fds[0].fd, FIONBIO, (char*)&on) < 0) {
+    if (ioctl(fd, FIONBIO, (char*)&on) < 0) {
         error("Error setting non block option");
     }
 
-    if (listen(retval.fds[0].fd, 32) < 0) {
+    // A deep backlog so bursts of connections are not refused while the loop is busy
+    if (listen(fd, SOMAXCONN) < 0) {
         error("Error setting listen option");
     }
 
-    return retval;
+    return adoptServer(fd, _maxClients);
+}
+
+// Doubles the descriptor arrays, returns -1 if memory is exhausted
+static int growServer(struct Server* _server) {
+    int capacity = _server->capacity * 2;
+    struct pollfd* fds = realloc(_server->fds, capacity * sizeof(struct pollfd));
+    if (fds == NULL) {
+        return -1;
+    }
+    _server->fds = fds;
+
+    struct Connection* clients = realloc(_server->clients, capacity * sizeof(struct Connection));
+    if (clients == NULL) {
+        return -1;
+    }
+    _server->clients = clients;
+    _server->capacity = capacity;
+    return 0;
+}
+
+// Sets the limits and refills the shared buckets
+void setRateLimits(struct Server* _server, const struct RateLimits* _limits) {
+    uint64_t now = monotonicNs();
+    _server->limits = *_limits;
+    initTokenBucket(&_server->globalMessages, _limits->globalMessagesPerSecond, 1, now);
+    initTokenBucket(&_server->globalBytes, _limits->globalBytesPerSecond, sizeof(struct Message), now);
+    initTokenBucket(&_server->accepts, _limits->acceptsPerSecond, 1, now);
+}
+
+// Tells whether the accept budget allows one more connection, pausing the listening sockets if not
+static int admitAccept(struct Server* _server) {
+    uint64_t now = monotonicNs();
+    if (tokenBucketReady(&_server->accepts, now)) {
+        tokenBucketCharge(&_server->accepts, 1);
+        return 1;
+    }
+    // Further connections wait in the listen backlog
+    _server->acceptPausedUntilNs = now + tokenBucketWaitNs(&_server->accepts);
+    atomic_fetch_add_explicit(&serverStats.acceptsThrottled, 1, memory_order_relaxed);
+    return 0;
+}
+
+// Checks the client's and the global budgets before reading; when one is spent, the client
+// is not polled for reading until it refills, so its socket buffers fill and TCP pushes back
+static int admitRead(struct Server* _server, int _clientIndex) {
+    struct Connection* client = &_server->clients[_clientIndex];
+    uint64_t now = monotonicNs();
+
+    // The history writer fell behind: pause like a spent budget rather than lose messages
+    if (persistBacklogged()) {
+        _server->fds[_clientIndex].events &= ~POLLIN;
+        client->throttledUntilNs = now + PERSIST_BACKOFF_MS * 1000000ull;
+        atomic_fetch_add_explicit(&serverStats.persistThrottled, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    // Bitwise and: every bucket is refilled
+    if (tokenBucketReady(&client->messageBucket, now) & tokenBucketReady(&client->byteBucket, now)
+        & tokenBucketReady(&_server->globalMessages, now) & tokenBucketReady(&_server->globalBytes, now)) {
+        return 1;
+    }
+
+    uint64_t wait = tokenBucketWaitNs(&client->messageBucket);
+    uint64_t waits[3] = { tokenBucketWaitNs(&client->byteBucket), tokenBucketWaitNs(&_server->globalMessages),
+                          tokenBucketWaitNs(&_server->globalBytes) };
+    for (int i = 0; i < 3; i++) {
+        if (waits[i] > wait) {
+            wait = waits[i];
+        }
+    }
+    _server->fds[_clientIndex].events &= ~POLLIN;  // Queued output still goes out
+    client->throttledUntilNs = now + wait;
+    atomic_fetch_add_explicit(&serverStats.readsThrottled, 1, memory_order_relaxed);
+    return 0;
+}
+
+// Charges what a client was admitted to send
+static void chargeRead(struct Server* _server, struct Connection* client, size_t bytes, int messages) {
+    tokenBucketCharge(&client->byteBucket, bytes);
+    tokenBucketCharge(&_server->globalBytes, bytes);
+    tokenBucketCharge(&client->messageBucket, messages);
+    tokenBucketCharge(&_server->globalMessages, messages);
+}
+
+// Makes room for one more connection, keeping the entries of the extra sockets free
+static int reserveConnection(struct Server* _server) {
+    if (_server->nbClients + 1 + RESERVED_FDS >= _server->capacity && growServer(_server) < 0) {
+        logMessage(LOG_WARNING, "Cannot grow client table, leaving connections pending");
+        return -1;
+    }
+    return 0;
+}
+
+// In busy-poll mode, sends small messages at once and lets recv() spin on the device queue
+// briefly; only TCP sockets are concerned (not the Unix sockets of shared-memory clients)
+static void tuneConnection(const struct Server* _server, int fd) {
+    int domain = 0;
+    socklen_t length = sizeof(domain);
+    if (!_server->busyPoll || getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &length) < 0
+        || (domain != AF_INET && domain != AF_INET6)) {
+        return;
+    }
+    int on = 1;
+    int busyPollUsec = BUSY_POLL_USEC;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busyPollUsec, sizeof(busyPollUsec)) < 0) {
+        logMessage(LOG_DEBUG, "SO_BUSY_POLL refused: %s", strerror(errno));
+    }
+}
+
+// Appends a connection to the poll set; reserveConnection() must have succeeded
+static struct Connection* addConnection(struct Server* _server, int fd) {
+    _server->nbClients++;
+    atomic_fetch_add_explicit(&serverStats.connectionsAccepted, 1, memory_order_relaxed);
+    memset(&_server->fds[_server->nbClients], 0, sizeof(struct pollfd));
+    memset(&_server->clients[_server->nbClients], 0, sizeof(struct Connection));
+    _server->fds[_server->nbClients].fd = fd;
+    _server->fds[_server->nbClients].events = POLLIN;
+    _server->clients[_server->nbClients].id = _server->nextConnectionId++;
+
+    uint64_t now = monotonicNs();
+    struct Connection* connection = &_server->clients[_server->nbClients];
+    initOutbox(&connection->outbox);
+    initTokenBucket(&connection->messageBucket, _server->limits.messagesPerSecond, 1, now);
+    initTokenBucket(&connection->byteBucket, _server->limits.bytesPerSecond, sizeof(struct Message), now);
+    tuneConnection(_server, fd);
+    return connection;
+}
+
+// Adds a connected socket, e.g. one inherited from a previous server process
+struct Connection* adoptConnection(struct Server* _server, int _fd) {
+    if (reserveConnection(_server) < 0) {
+        return NULL;
+    }
+    return addConnection(_server, _fd);
 }
 
 // Accepts new incoming client connections and adds them to the poll set
@@ -63,84 +236,704 @@ int acceptNewClients(struct Server* _server) {
         return -2;
     }
 
-    int newFd;
-    do {
-        newFd = accept(_server->fds[0].fd, NULL, NULL);
+    while (_server->nbClients - _server->nbPeers < _server->maxClients) {
+        if (reserveConnection(_server) < 0 || !admitAccept(_server)) {
+            break;
+        }
+
+        int newFd = accept(_server->fds[0].fd, NULL, NULL);
         if (newFd < 0) {
-            if (errno != EWOULDBLOCK) {
-                perror("accept() failed");
+            if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                logMessage(LOG_ERROR, "accept() failed: %s", strerror(errno));
                 return -1;
             }
             break;
         }
 
-        _server->nbClients++;
-        memset(&_server->fds[_server->nbClients], 0, sizeof(struct pollfd));
-        _server->fds[_server->nbClients].fd = newFd;
-        _server->fds[_server->nbClients].events = POLLIN;
+        addConnection(_server, newFd);
+        logMessage(LOG_INFO, "New client connected: %d", newFd);
+    }
 
-        printf("New client connected: %d\n", newFd);
-    } while (newFd != -1 && _server->nbClients < 2);  // Accept at most 2 clients
+    return 0;
+}
+
+// Accepts local clients asking for a shared-memory channel and adds their socket to the poll set
+int acceptShmClients(struct Server* _server) {
+    if (_server == NULL) {
+        return -2;
+    }
+
+    while (_server->nbClients - _server->nbPeers < _server->maxClients) {
+        if (reserveConnection(_server) < 0 || !admitAccept(_server)) {
+            break;
+        }
+
+        struct ShmChannel* channel = malloc(sizeof(struct ShmChannel));
+        if (channel == NULL) {
+            logMessage(LOG_WARNING, "Cannot allocate shared-memory channel, leaving connections pending");
+            break;
+        }
+        int accepted = shmAccept(_server->shmListenFd, channel);
+        if (accepted != 0) {
+            free(channel);
+            if (accepted < 0) {
+                logMessage(LOG_WARNING, "Shared-memory handshake failed: %s", strerror(errno));
+                return -1;
+            }
+            break;
+        }
+
+        addConnection(_server, channel->socketFd)->shm = channel;
+        logMessage(LOG_INFO, "New shared-memory client connected: %d", channel->socketFd);
+    }
 
     return 0;
 }
 
-// Handles receiving a message from one client and broadcasting it to all others
-int receiveAndBroadcastMessage(struct Server* _server, int _sendingClientFd) {
+// Accounts for one message handed to a connection's socket or ring
+static void recordSend(int fd, const struct Frame* frame, uint64_t startNs, uint64_t endNs) {
+    histogramRecord(&serverStats.recipientSend, endNs - startNs);
+    traceEvent(frame->traceId, "send", fd, startNs, endNs);
+}
+
+// Pushes a message into the ring of a shared-memory client, for outboxFlushTo()
+static int takeShmFrame(void* channel, const struct Frame* frame) {
+    uint64_t startNs = monotonicNs();
+    int taken = shmTrySend(channel, frameMessage(frame));
+    if (taken) {
+        recordSend(((struct ShmChannel*)channel)->socketFd, frame, startNs, monotonicNs());
+    }
+    return taken;
+}
+
+// Writes what the socket of a TCP client accepts from its outbox; POLLOUT is watched
+// only while messages remain. A shared-memory client takes what its ring holds, and rings
+// the doorbell when it makes room for the rest.
+static void flushOutbox(struct Server* _server, int _clientIndex) {
+    struct Connection* client = &_server->clients[_clientIndex];
+    int sent = 0;
+    uint64_t written = client->outbox.bytesWritten;
+    if (client->shm != NULL) {
+        outboxFlushTo(&client->outbox, takeShmFrame, client->shm, &sent);
+        atomic_fetch_add_explicit(&serverStats.messagesSent, sent, memory_order_relaxed);
+        atomic_fetch_add_explicit(&serverStats.bytesSent, client->outbox.bytesWritten - written, memory_order_relaxed);
+        return;
+    }
+    int flushed = outboxFlush(&client->outbox, _server->fds[_clientIndex].fd, recordSend, &sent);
+    atomic_fetch_add_explicit(&serverStats.messagesSent, sent, memory_order_relaxed);
+    atomic_fetch_add_explicit(&serverStats.bytesSent, client->outbox.bytesWritten - written, memory_order_relaxed);
+    if (flushed < 0) {
+        atomic_fetch_add_explicit(&serverStats.sendDrops, 1, memory_order_relaxed);
+        client->closing = 1;  // Mark socket for cleanup
+    } else if (flushed > 0) {
+        _server->fds[_clientIndex].events |= POLLOUT;
+    } else {
+        _server->fds[_clientIndex].events &= ~POLLOUT;
+    }
+}
+
+// Queues a message for a client in the lane of its class and sends what its socket or ring
+// accepts, whatever its transport. A full bulk lane skips the message for that client; a full
+// interactive or control lane means the client stopped reading, and it is disconnected.
+static int deliverMessage(struct Server* _server, int _clientIndex, struct Frame* frame) {
+    struct Connection* client = &_server->clients[_clientIndex];
+    if (outboxPush(&client->outbox, frame) < 0) {
+        if (messageClass(frameMessage(frame)) == MESSAGE_BULK) {
+            atomic_fetch_add_explicit(&serverStats.bulkDrops, 1, memory_order_relaxed);
+            return 0;
+        }
+        atomic_fetch_add_explicit(&serverStats.sendDrops, 1, memory_order_relaxed);
+        client->closing = 1;
+        return -1;
+    }
+    // Behind a backlog, the message waits for POLLOUT rather than cutting in (the ring of a
+    // shared-memory client is fed from the outbox in order, so it can be tried every time)
+    if (client->shm != NULL || !(_server->fds[_clientIndex].events & POLLOUT)) {
+        flushOutbox(_server, _clientIndex);
+    }
+    return client->closing ? -1 : 0;
+}
+
+// Adds a link to a peer server to the poll set and queues the hello, returns -1 if there is
+// no room for it. Like a client's, its frames wait in its outbox for POLLOUT, so a peer that
+// reads slowly never blocks the event loop.
+static int addRelayLink(struct Server* _server, int fd, int outbound, int connecting) {
+    struct RelayLink* link = calloc(1, sizeof(struct RelayLink));
+    struct Frame* hello = createRelayHello();
+    if (link == NULL || hello == NULL || reserveConnection(_server) < 0) {
+        free(link);
+        if (hello != NULL) {
+            releaseFrame(hello);
+        }
+        return -1;
+    }
+    link->outbound = outbound;
+    link->connecting = connecting;
+    addConnection(_server, fd)->relay = link;
+    _server->nbPeers++;
+    if (connecting) {
+        _server->fds[_server->nbClients].events = POLLOUT;  // Writable once connected
+        outboxPush(&_server->clients[_server->nbClients].outbox, hello);
+    } else {
+        deliverMessage(_server, _server->nbClients, hello);
+    }
+    releaseFrame(hello);
+    return 0;
+}
+
+// Accepts links from peer servers; they do not count against maxClients
+int acceptRelayLinks(struct Server* _server) {
     if (_server == NULL) {
-        return -3;
+        return -2;
     }
 
-    struct Message message;
-    int read = readMessage(_sendingClientFd, &message);
-    if (read < 0) {
+    while (1) {
+        int newFd = accept4(_server->relayListenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newFd < 0) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                logMessage(LOG_WARNING, "Relay accept() failed: %s", strerror(errno));
+                return -1;
+            }
+            return 0;
+        }
+        int on = 1;
+        setsockopt(newFd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if (addRelayLink(_server, newFd, -1, 0) < 0) {
+            close(newFd);
+            continue;
+        }
+        logMessage(LOG_INFO, "Peer server linked: %d", newFd);
+    }
+}
+
+// Starts dialling the peers given with -P that are not linked, at most once per
+// RELAY_RETRY_MS each; the connections complete in the event loop
+void connectRelayPeers(struct Server* _server) {
+    int nbRelayPeers;
+    struct RelayPeer* peers = relayPeers(&nbRelayPeers);
+    uint64_t now = monotonicNs();
+    for (int i = 0; i < nbRelayPeers; i++) {
+        if (peers[i].linked || now < peers[i].nextAttemptNs) {
+            continue;
+        }
+        peers[i].nextAttemptNs = now + RELAY_RETRY_MS * 1000000ull;
+
+        int connecting;
+        int fd = relayDial(&peers[i], &connecting);
+        if (fd < 0) {
+            logMessage(LOG_DEBUG, "Peer %s:%u unreachable", peers[i].host, peers[i].port);
+            continue;
+        }
+        if (addRelayLink(_server, fd, i, connecting) < 0) {
+            close(fd);
+            continue;
+        }
+        peers[i].linked = 1;
+        if (!connecting) {
+            logMessage(LOG_INFO, "Linked to peer %s:%u", peers[i].host, peers[i].port);
+        }
+    }
+}
+
+// Completes the connection of a dialled peer once its socket is writable
+static void finishRelayDial(struct Server* _server, int _clientIndex) {
+    struct RelayLink* link = _server->clients[_clientIndex].relay;
+    int nbRelayPeers;
+    struct RelayPeer* peer = &relayPeers(&nbRelayPeers)[link->outbound];
+    if (relayConnected(_server->fds[_clientIndex].fd) < 0) {
+        logMessage(LOG_DEBUG, "Peer %s:%u unreachable: %s", peer->host, peer->port, strerror(errno));
+        _server->clients[_clientIndex].closing = 1;
+        return;
+    }
+    link->connecting = 0;
+    _server->fds[_clientIndex].events |= POLLIN;
+    logMessage(LOG_INFO, "Linked to peer %s:%u", peer->host, peer->port);
+}
+
+// Sends a control message to one client
+static void sendControl(struct Server* _server, int _clientIndex, const char* text) {
+    struct Message reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.flags = MESSAGE_CONTROL;
+    reply.timestamp = time(NULL);
+    snprintf(reply.message, BUFFER_LENGTH, "%s", text);
+    struct Frame* frame = createFrame(&reply, 0, 0);
+    if (frame != NULL) {
+        deliverMessage(_server, _clientIndex, frame);
+        releaseFrame(frame);
+    }
+}
+
+// Packs messages into one batch frame, LZ-compressed unless that does not make it smaller
+static int sendBatch(struct Server* _server, int _clientIndex, const struct Message* messages, int count) {
+    size_t rawLength = count * sizeof(struct Message);
+    size_t bound = lzCompressBound(rawLength);
+    unsigned char* compressed = malloc(bound);
+    if (compressed == NULL) {
+        return -1;
+    }
+
+    struct BatchHeader batch = { (uint32_t)count, BATCH_LZ, 0 };
+    size_t length = lzCompress(messages, rawLength, compressed, bound);
+    const void* payload = compressed;
+    if (length == 0 || length >= rawLength) {
+        batch.codec = BATCH_RAW;
+        payload = messages;
+        length = rawLength;
+    }
+    batch.payloadLength = (uint32_t)length;
+
+    struct Message header;
+    memset(&header, 0, sizeof(header));
+    header.flags = MESSAGE_BULK | MESSAGE_BATCH;
+    header.timestamp = time(NULL);
+    memcpy(header.message, &batch, sizeof(batch));
+    struct Frame* frame = createBatchFrame(&header, payload, length);
+    free(compressed);
+    if (frame == NULL) {
         return -1;
     }
+    atomic_fetch_add_explicit(&serverStats.historyWireBytes, frameLength(frame), memory_order_relaxed);
+    int result = deliverMessage(_server, _clientIndex, frame);
+    releaseFrame(frame);
+    return result;
+}
+
+// Answers a history request with the last stored messages, in the bulk lane. Clients that
+// negotiated batches get them MAX_BATCH_RECORDS at a time, compressed; the others get
+// single messages, at most what their bulk lane holds.
+static void sendHistory(struct Server* _server, int _clientIndex, int count) {
+    struct Connection* client = &_server->clients[_clientIndex];
+    int limit = client->batches ? MAX_HISTORY_MESSAGES : OUTPUT_QUEUE_LIMIT;
+    if (count > limit) {
+        count = limit;
+    }
+    if (count <= 0) {
+        return;
+    }
+
+    struct Message* messages = malloc(count * sizeof(struct Message));
+    int loaded = (messages != NULL) ? readLastMessages(messages, count) : -1;
+    if (loaded < 0) {
+        logMessage(LOG_WARNING, "Cannot read the history for client %d", _server->fds[_clientIndex].fd);
+        free(messages);
+        return;
+    }
+    atomic_fetch_add_explicit(&serverStats.historyMessages, loaded, memory_order_relaxed);
+    atomic_fetch_add_explicit(&serverStats.historyBytes, loaded * sizeof(struct Message), memory_order_relaxed);
+
+    for (int i = 0; i < loaded; i++) {
+        messages[i].flags = MESSAGE_BULK;
+    }
+    if (client->batches) {
+        for (int i = 0; i < loaded && !client->closing; i += MAX_BATCH_RECORDS) {
+            int batch = (loaded - i < MAX_BATCH_RECORDS) ? loaded - i : MAX_BATCH_RECORDS;
+            if (sendBatch(_server, _clientIndex, &messages[i], batch) < 0) {
+                break;
+            }
+        }
+    } else {
+        for (int i = 0; i < loaded && !client->closing; i++) {
+            struct Frame* frame = createFrame(&messages[i], 0, 0);
+            if (frame == NULL) {
+                break;
+            }
+            atomic_fetch_add_explicit(&serverStats.historyWireBytes, frameLength(frame), memory_order_relaxed);
+            deliverMessage(_server, _clientIndex, frame);
+            releaseFrame(frame);
+        }
+    }
+    free(messages);
+}
 
-    message.timestamp = time(NULL);  // Add timestamp
+// Handles a control message from a client; control messages are never broadcast
+static void handleControl(struct Server* _server, int _clientIndex, const struct Message* message) {
+    struct Connection* client = &_server->clients[_clientIndex];
+    char text[BUFFER_LENGTH];
+    snprintf(text, sizeof(text), "%.*s", BUFFER_LENGTH - 1, message->message);
+
+    char* rest = NULL;
+    char* command = strtok_r(text, " ", &rest);
+    if (command == NULL) {
+        return;
+    }
+    if (strcmp(command, CONTROL_HELLO) == 0) {
+        // Batches travel on the byte stream only; a shared-memory ring holds single messages
+        client->batches = 0;
+        for (char* feature = strtok_r(NULL, " ", &rest); feature != NULL; feature = strtok_r(NULL, " ", &rest)) {
+            if (strcmp(feature, FEATURE_LZ) == 0 && client->shm == NULL) {
+                client->batches = 1;
+            }
+        }
+        sendControl(_server, _clientIndex, client->batches ? CONTROL_HELLO " " FEATURE_LZ : CONTROL_HELLO);
+    } else if (strcmp(command, CONTROL_HISTORY) == 0) {
+        sendHistory(_server, _clientIndex, atoi(rest));
+    } else {
+        logMessage(LOG_DEBUG, "Unknown control message from %d: %s", _server->fds[_clientIndex].fd, command);
+    }
+}
 
-    // Save to persistent store
-    if (saveMessage(&message) < 0) {
-        printf("Warning: Failed to save message to history\n");
+// Timestamps, saves and broadcasts one complete message to every client but the sender.
+// The message is encoded once into a frame shared by the persistence queue and every
+// recipient's outbox. Messages posted here are also forwarded once to every peer server;
+// relayed ones (already timestamped by their origin) are only delivered locally.
+static int broadcastMessage(struct Server* _server, int _senderIndex, struct Message* message,
+                            uint64_t readNs, uint64_t traceId, int relayed) {
+    if (!relayed) {
+        message->timestamp = time(NULL);  // Add timestamp
     }
+    struct Frame* frame = createFrame(message, readNs, traceId);
+    if (frame == NULL) {
+        atomic_fetch_add_explicit(&serverStats.persistDrops, 1, memory_order_relaxed);
+        logMessage(LOG_WARNING, "Cannot allocate frame, message dropped");
+        return -1;
+    }
+    uint64_t decodedNs = monotonicNs();
+    traceEvent(traceId, "decode", TRACE_PIPELINE_TRACK, readNs, decodedNs);
+
+    // Hand the record to the persistence thread (saved at once if it is not running)
+    persistFrame(frame);
+    uint64_t persistedNs = monotonicNs();
+    traceEvent(traceId, "persist-enqueue", TRACE_PIPELINE_TRACK, decodedNs, persistedNs);
 
     // Broadcast to all connected clients except the sender
+    int result = 0;
     for (int j = 1; j <= _server->nbClients; ++j) {
-        if (_server->fds[j].fd == _sendingClientFd) {
+        if (j == _senderIndex || _server->clients[j].closing || _server->clients[j].relay != NULL) {
             continue;
         }
 
-        int sent = sendMessage(_server->fds[j].fd, &message);
-        if (sent < 0) {
-            _server->fds[j].fd = -1;  // Mark socket for cleanup
-            return -2;
+        // Recipients are counted, and their send timed, as their outbox drains
+        if (deliverMessage(_server, j, frame) < 0) {
+            result = -2;
         }
     }
 
-    // Display message on server console
-    char timeStr[64];
-    struct tm* timeinfo = localtime(&message.timestamp);
-    strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", timeinfo);
-    printf("[%s] %s> %s\n", timeStr, message.nickname, message.message);
+    // Forward to the other servers, which deliver it to their own clients
+    if (!relayed && _server->nbPeers > 0) {
+        struct Frame* relayFrame = createRelayFrame(message);
+        for (int j = 1; relayFrame != NULL && j <= _server->nbClients; ++j) {
+            if (_server->clients[j].relay == NULL || _server->clients[j].closing) {
+                continue;
+            }
+            if (deliverMessage(_server, j, relayFrame) < 0) {
+                logMessage(LOG_WARNING, "Lost link to peer server %d", _server->fds[j].fd);
+                result = -2;
+                continue;
+            }
+            atomic_fetch_add_explicit(&serverStats.relayForwarded, 1, memory_order_relaxed);
+        }
+        if (relayFrame != NULL) {
+            releaseFrame(relayFrame);
+        }
+    }
+    uint64_t broadcastNs = monotonicNs();
+    histogramRecord(&serverStats.readToBroadcast, broadcastNs - readNs);
+    traceEvent(traceId, "broadcast", TRACE_PIPELINE_TRACK, persistedNs, broadcastNs);
 
-    return 0;
+    // Display message on server console (the logger stamps and formats it off the hot path)
+    logMessage(LOG_INFO, "%.*s> %.*s", NAME_LENGTH, message->nickname, BUFFER_LENGTH, message->message);
+
+    releaseFrame(frame);  // The outboxes and the persistence queue hold their own references
+    return result;
 }
 
-// Cleans up pollfd list by removing disconnected clients (fd = -1)
+// Keeps the nickname map in step with the nickname a client signs its messages with:
+// the first message registers it, a new nickname renames it. A nickname already held by
+// another connection is not taken over.
+static void trackNickname(struct Server* _server, int _clientIndex, const struct Message* message) {
+    struct Connection* client = &_server->clients[_clientIndex];
+    char nickname[NAME_LENGTH];
+    snprintf(nickname, sizeof(nickname), "%.*s", NAME_LENGTH - 1, message->nickname);
+    if (strcmp(nickname, client->nickname) == 0) {
+        return;
+    }
+
+    if (client->nickname[0] != '\0') {
+        removeNickname(&_server->nicknames, client->nickname);
+        client->nickname[0] = '\0';
+    }
+    if (nickname[0] != '\0' && insertNickname(&_server->nicknames, nickname, _clientIndex) == 0) {
+        memcpy(client->nickname, nickname, NAME_LENGTH);
+    }
+}
+
+// Delivers a direct message to its recipient only, found with one lookup. Direct messages
+// are neither stored nor relayed; an unknown recipient is reported to the sender.
+static void sendDirect(struct Server* _server, int _senderIndex, struct Message* message) {
+    char recipient[NAME_LENGTH];
+    size_t length = strcspn(message->message, " ");
+    snprintf(recipient, sizeof(recipient), "%.*s", (int)(length < NAME_LENGTH - 1 ? length : NAME_LENGTH - 1),
+             message->message);
+
+    int index = findNickname(&_server->nicknames, recipient);
+    if (index == 0 || _server->clients[index].closing) {
+        atomic_fetch_add_explicit(&serverStats.directUnknown, 1, memory_order_relaxed);
+        char reply[BUFFER_LENGTH];
+        snprintf(reply, sizeof(reply), CONTROL_UNKNOWN " %s", recipient);
+        sendControl(_server, _senderIndex, reply);
+        return;
+    }
+
+    message->timestamp = time(NULL);
+    struct Frame* frame = createFrame(message, 0, 0);
+    if (frame != NULL) {
+        if (deliverMessage(_server, index, frame) == 0) {
+            atomic_fetch_add_explicit(&serverStats.directMessages, 1, memory_order_relaxed);
+        }
+        releaseFrame(frame);
+    }
+}
+
+// Routes a message read from a client: control messages are answered, direct messages go
+// to their recipient, anything else is broadcast
+static int dispatchMessage(struct Server* _server, int _clientIndex, struct Message* message,
+                           uint64_t readNs, uint64_t traceId) {
+    // MESSAGE_BATCH and the reserved bits are the server's own: a client setting them would
+    // make every batching recipient misread the stream
+    message->flags &= MESSAGE_CLIENT_FLAGS;
+    trackNickname(_server, _clientIndex, message);
+    if (messageClass(message) == MESSAGE_CONTROL) {
+        handleControl(_server, _clientIndex, message);
+        return 0;
+    }
+    if (message->flags & MESSAGE_DIRECT) {
+        sendDirect(_server, _clientIndex, message);
+        return 0;
+    }
+    return broadcastMessage(_server, _clientIndex, message, readNs, traceId, 0);
+}
+
+// Drains the ring of a shared-memory client and broadcasts its messages
+static int receiveShmMessages(struct Server* _server, int _clientIndex) {
+    struct Connection* client = &_server->clients[_clientIndex];
+    int result = 0;
+
+    // Clear the doorbell first: a message pushed after the drain below rings it again.
+    // The doorbell also means the client made room for the messages waiting in the outbox.
+    int connected = shmClearDoorbell(client->shm);
+    if (outboxPending(&client->outbox)) {
+        flushOutbox(_server, _clientIndex);
+    }
+    struct Message message;
+    uint64_t recvNs = monotonicNs();
+    while (admitRead(_server, _clientIndex) && shmReceive(client->shm, &message)) {
+        uint64_t readNs = monotonicNs();
+        chargeRead(_server, client, sizeof(struct Message), 1);
+        atomic_fetch_add_explicit(&serverStats.messagesReceived, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&serverStats.bytesReceived, sizeof(struct Message), memory_order_relaxed);
+        captureMessage(client->id, readNs, &message);
+        uint64_t traceId = traceSample();
+        traceEvent(traceId, "recv", TRACE_PIPELINE_TRACK, recvNs, readNs);
+        if (dispatchMessage(_server, _clientIndex, &message, readNs, traceId) < 0) {
+            result = -2;
+        }
+        recvNs = monotonicNs();
+    }
+
+    if (connected < 0) {
+        client->closing = 1;  // Messages pushed before the hang-up were still delivered
+        return -1;
+    }
+    return result;
+}
+
+// Reassembles the frames sent by a peer server and delivers the new ones to local clients
+static int receiveRelayFrames(struct Server* _server, int _clientIndex) {
+    struct RelayLink* link = _server->clients[_clientIndex].relay;
+    int fd = _server->fds[_clientIndex].fd;
+    int result = 0;
+
+    while (1) {
+        ssize_t bytes = recv(fd, (char*)&link->pending + link->received,
+                             sizeof(struct RelayFrame) - link->received, MSG_DONTWAIT);
+        if (bytes <= 0) {
+            if (bytes < 0 && (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR)) {
+                return result;
+            }
+            _server->clients[_clientIndex].closing = 1;
+            return -1;
+        }
+        link->received += bytes;
+        if (link->received < sizeof(struct RelayFrame)) {
+            continue;
+        }
+        link->received = 0;
+
+        uint64_t readNs = monotonicNs();
+        if (link->pending.magic != RELAY_MAGIC) {
+            logMessage(LOG_WARNING, "Peer server %d speaks another protocol, closing the link", fd);
+            _server->clients[_clientIndex].closing = 1;
+            return -1;
+        }
+        if (link->pending.sequence == 0) {
+            link->origin = link->pending.origin;
+            if (link->origin == relayOrigin()) {
+                logMessage(LOG_WARNING, "Peer %d is this server, closing the link", fd);
+                _server->clients[_clientIndex].closing = 1;
+                return -1;
+            }
+            continue;
+        }
+        if (!acceptRelayFrame(&link->pending)) {
+            atomic_fetch_add_explicit(&serverStats.relayDuplicates, 1, memory_order_relaxed);
+            continue;
+        }
+
+        atomic_fetch_add_explicit(&serverStats.relayReceived, 1, memory_order_relaxed);
+        struct Message message = link->pending.message;
+        message.flags &= MESSAGE_CLASS_MASK;  // Relayed messages are plain broadcasts
+        uint64_t traceId = traceSample();
+        traceEvent(traceId, "relay-recv", TRACE_PIPELINE_TRACK, readNs, readNs);
+        if (broadcastMessage(_server, _clientIndex, &message, readNs, traceId, 1) < 0) {
+            result = -2;
+        }
+    }
+}
+
+// Handles receiving data from one client and broadcasting the messages it completes
+int receiveAndBroadcastMessage(struct Server* _server, int _clientIndex) {
+    if (_server == NULL) {
+        return -3;
+    }
+
+    struct Connection* client = &_server->clients[_clientIndex];
+    if (client->shm != NULL) {
+        return receiveShmMessages(_server, _clientIndex);
+    }
+    if (client->relay != NULL) {
+        return receiveRelayFrames(_server, _clientIndex);
+    }
+    int fd = _server->fds[_clientIndex].fd;
+    int result = 0;
+
+    // Drain what the socket holds without blocking, one message-sized piece at a time
+    while (1) {
+        if (!admitRead(_server, _clientIndex)) {
+            return result;  // Resumed by runServer() once the buckets refill
+        }
+        uint64_t recvNs = monotonicNs();
+        char* destination = (char*)&client->pending + client->received;
+        ssize_t bytes = recv(fd, destination, sizeof(struct Message) - client->received, MSG_DONTWAIT);
+        if (bytes == 0) {
+            client->closing = 1;  // Orderly shutdown by the client
+            return -1;
+        }
+        if (bytes < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR) {
+                return result;
+            }
+            logMessage(LOG_WARNING, "Error reading message: %s", strerror(errno));
+            client->closing = 1;
+            return -1;
+        }
+
+        atomic_fetch_add_explicit(&serverStats.bytesReceived, bytes, memory_order_relaxed);
+        client->received += bytes;
+        chargeRead(_server, client, bytes, client->received == sizeof(struct Message));
+        if (client->received < sizeof(struct Message)) {
+            continue;
+        }
+
+        uint64_t readNs = monotonicNs();
+        atomic_fetch_add_explicit(&serverStats.messagesReceived, 1, memory_order_relaxed);
+        struct Message message = client->pending;
+        client->received = 0;
+        captureMessage(client->id, readNs, &message);
+        uint64_t traceId = traceSample();
+        traceEvent(traceId, "recv", TRACE_PIPELINE_TRACK, recvNs, readNs);
+        if (dispatchMessage(_server, _clientIndex, &message, readNs, traceId) < 0) {
+            result = -2;
+        }
+    }
+}
+
+// Forgets a closed peer link; a peer dialled with -P is dialled again after RELAY_RETRY_MS
+static void releaseRelayLink(struct Server* _server, struct RelayLink* link) {
+    if (link->outbound >= 0) {
+        int nbRelayPeers;
+        struct RelayPeer* peer = &relayPeers(&nbRelayPeers)[link->outbound];
+        peer->linked = 0;
+        peer->nextAttemptNs = monotonicNs() + RELAY_RETRY_MS * 1000000ull;
+    }
+    free(link);
+    _server->nbPeers--;
+}
+
+// Cleans up pollfd list by closing and removing the connections marked as closing
 void compactDescriptor(struct Server* _server) {
     if (_server == NULL) {
         return;
     }
 
+    int kept = 1;
+    for (int i = 1; i <= _server->nbClients; i++) {
+        if (_server->clients[i].closing) {
+            atomic_fetch_add_explicit(&serverStats.connectionsClosed, 1, memory_order_relaxed);
+            logMessage(LOG_INFO, "Client disconnected: %d", _server->fds[i].fd);
+            if (_server->clients[i].relay != NULL) {
+                releaseRelayLink(_server, _server->clients[i].relay);
+            }
+            freeOutbox(&_server->clients[i].outbox);
+            if (_server->clients[i].nickname[0] != '\0') {
+                removeNickname(&_server->nicknames, _server->clients[i].nickname);
+            }
+            if (_server->clients[i].shm != NULL) {
+                shmClose(_server->clients[i].shm);  // Also closes the socket in fds[i]
+                free(_server->clients[i].shm);
+            } else {
+                close(_server->fds[i].fd);
+            }
+            continue;
+        }
+        if (kept != i) {
+            _server->fds[kept] = _server->fds[i];
+            _server->clients[kept] = _server->clients[i];
+            if (_server->clients[kept].nickname[0] != '\0') {
+                moveNickname(&_server->nicknames, _server->clients[kept].nickname, kept);
+            }
+        }
+        kept++;
+    }
+    _server->nbClients = kept - 1;
+}
+
+// Lowers a poll timeout (ms, -1 for none) so poll() returns by deadlineNs
+static void wakeUpBy(int* timeout, uint64_t nowNs, uint64_t deadlineNs) {
+    int ms = (deadlineNs > nowNs) ? (int)((deadlineNs - nowNs + 999999) / 1000000) : 0;
+    if (*timeout < 0 || ms < *timeout) {
+        *timeout = ms;
+    }
+}
+
+// Polls again the throttled clients whose budget refilled, and the listening sockets once
+// accepting is allowed again; lowers the poll timeout to wake up for the others
+static void resumeThrottled(struct Server* _server, int* timeout) {
+    uint64_t now = monotonicNs();
     for (int i = 1; i <= _server->nbClients; i++) {
-        if (_server->fds[i].fd == -1) {
-            for (int j = i; j < _server->nbClients; j++) {
-                _server->fds[j] = _server->fds[j + 1];
+        struct Connection* client = &_server->clients[i];
+        if (client->throttledUntilNs != 0) {
+            if (now >= client->throttledUntilNs) {
+                client->throttledUntilNs = 0;
+                client->resumed = 1;
+                _server->fds[i].events |= POLLIN;
+            } else {
+                wakeUpBy(timeout, now, client->throttledUntilNs);
             }
-            i--;
-            _server->nbClients--;
+        }
+        if (client->resumed) {
+            *timeout = 0;  // A shared-memory ring may hold messages without a doorbell
+        }
+    }
+
+    if (_server->acceptPausedUntilNs != 0) {
+        if (now >= _server->acceptPausedUntilNs) {
+            _server->acceptPausedUntilNs = 0;
+        } else {
+            wakeUpBy(timeout, now, _server->acceptPausedUntilNs);
         }
     }
+    _server->fds[0].events = (_server->acceptPausedUntilNs != 0) ? 0 : POLLIN;
 }
 
 // The main event loop of the server, handling new connections and client messages
@@ -149,65 +942,322 @@ void runServer(struct Server* _server) {
         return;
     }
 
-    while (1) {
-        printf("Current nb clients: %d\n", _server->nbClients);
-        int retpoll = poll(_server->fds, _server->nbClients + 1, -1);
+    while (!stopRequested) {
+        uint64_t iterationNs = _server->busyPoll ? monotonicNs() : 0;
+        logMessage(LOG_DEBUG, "Current nb clients: %d", _server->nbClients);
+        connectRelayPeers(_server);
+
+        // Wake up in time to redial peers that are down, and to resume throttled reads
+        int nbRelayPeers;
+        struct RelayPeer* peers = relayPeers(&nbRelayPeers);
+        int timeout = -1;
+        for (int i = 0; i < nbRelayPeers; i++) {
+            if (!peers[i].linked) {
+                timeout = RELAY_RETRY_MS;
+            }
+        }
+        resumeThrottled(_server, &timeout);
+
+        // The extra sockets follow the clients
+        int nbFds = _server->nbClients + 1;
+        int shmEntry = -1;
+        int relayEntry = -1;
+        int upgradeEntry = -1;
+        if (_server->shmListenFd >= 0) {
+            shmEntry = nbFds++;
+            _server->fds[shmEntry].fd = _server->shmListenFd;
+            _server->fds[shmEntry].events = (_server->acceptPausedUntilNs != 0) ? 0 : POLLIN;
+        }
+        if (_server->relayListenFd >= 0) {
+            relayEntry = nbFds++;
+            _server->fds[relayEntry].fd = _server->relayListenFd;
+            _server->fds[relayEntry].events = POLLIN;
+        }
+        if (_server->upgradeListenFd >= 0) {
+            upgradeEntry = nbFds++;
+            _server->fds[upgradeEntry].fd = _server->upgradeListenFd;
+            _server->fds[upgradeEntry].events = POLLIN;
+        }
+
+        if (_server->busyPoll) {
+            timeout = 0;  // Never sleep: the core is dedicated to the event loop
+        }
+        int retpoll = poll(_server->fds, nbFds, timeout);
         if (retpoll < 0) {
-            perror("Call to poll failed");
+            if (errno == EINTR) {
+                continue;  // Interrupted by a signal: stopRequested tells whether to leave
+            }
+            logMessage(LOG_ERROR, "Call to poll failed: %s", strerror(errno));
             break;
         }
-        if (retpoll == 0) {
-            continue;
+        if (retpoll > 0) {
+            logMessage(LOG_DEBUG, "Checking %d fds", retpoll);
         }
 
-        printf("Checking %d fds\n", retpoll);
+        // Read before accepting: new clients take the entries of the extra sockets
+        short shmEvents = (shmEntry >= 0) ? _server->fds[shmEntry].revents : 0;
+        short relayEvents = (relayEntry >= 0) ? _server->fds[relayEntry].revents : 0;
+        short upgradeEvents = (upgradeEntry >= 0) ? _server->fds[upgradeEntry].revents : 0;
+
+        // A new server process takes over: stop serving as soon as it has everything
+        if (upgradeEvents & POLLIN) {
+            compactDescriptor(_server);
+            if (handOffServer(_server) == 0) {
+                logMessage(LOG_INFO, "Handed %d connections over to the new server", _server->nbClients);
+                _server->handedOff = 1;
+                break;
+            }
+            logMessage(LOG_WARNING, "Handoff failed, still serving");
+        }
 
         // Handle new client connections
-        if (_server->fds[0].revents == POLLIN) {
+        if (_server->fds[0].revents & POLLIN) {
             if (acceptNewClients(_server) == -1) {
-                perror("Error accepting new clients");
+                logMessage(LOG_ERROR, "Error accepting new clients");
                 break;
             }
         }
+        if (shmEvents & POLLIN) {
+            acceptShmClients(_server);  // A failed handshake only loses that client
+        }
+        if (relayEvents & POLLIN) {
+            acceptRelayLinks(_server);
+        }
 
         // Handle messages from clients
         for (int i = 1; i <= _server->nbClients; i++) {
-            if (_server->fds[i].revents == 0) {
+            short revents = _server->fds[i].revents;
+            int resumed = _server->clients[i].resumed;  // Read once even without an event
+            _server->clients[i].resumed = 0;
+            if ((revents == 0 && !resumed) || _server->clients[i].closing) {
                 continue;
             }
 
-            if (_server->fds[i].revents != POLLIN) {
-                _server->fds[i].fd = -1;
-                break;
+            if ((revents & POLLOUT) && _server->clients[i].relay != NULL && _server->clients[i].relay->connecting) {
+                finishRelayDial(_server, i);
+            }
+            if ((revents & POLLOUT) && !_server->clients[i].closing) {
+                flushOutbox(_server, i);
             }
 
-            int broadcast = receiveAndBroadcastMessage(_server, _server->fds[i].fd);
-            if (broadcast == -1) {
-                perror("Error reading message");
-                _server->fds[i].fd = -1;
-                break;
+            // Pending data is read even on hang-up; recv() then reports the disconnection
+            if ((revents & (POLLERR | POLLHUP | POLLNVAL)) && !(revents & POLLIN)) {
+                _server->clients[i].closing = 1;
+                continue;
+            }
+
+            // A client that failed or disconnected is closed by compactDescriptor()
+            if ((revents & POLLIN) || resumed) {
+                receiveAndBroadcastMessage(_server, i);
             }
         }
 
         compactDescriptor(_server);
+
+        if (_server->busyPoll && retpoll == 0) {
+            atomic_fetch_add_explicit(&serverStats.spinNs, monotonicNs() - iterationNs, memory_order_relaxed);
+        }
     }
 
     // Cleanup: close all file descriptors
     for (int i = 0; i <= _server->nbClients; ++i) {
-        if (_server->fds[i].fd >= 0) {
+        if (i > 0 && _server->clients[i].relay != NULL) {
+            free(_server->clients[i].relay);
+        }
+        if (i > 0) {
+            freeOutbox(&_server->clients[i].outbox);
+        }
+        if (i > 0 && _server->clients[i].shm != NULL) {
+            shmClose(_server->clients[i].shm);
+            free(_server->clients[i].shm);
+        } else if (_server->fds[i].fd >= 0) {
             close(_server->fds[i].fd);
         }
     }
+    if (_server->shmListenFd >= 0) {
+        close(_server->shmListenFd);
+    }
+    if (_server->relayListenFd >= 0) {
+        close(_server->relayListenFd);
+    }
+    if (_server->upgradeListenFd >= 0) {
+        close(_server->upgradeListenFd);
+    }
+    free(_server->fds);
+    free(_server->clients);
+    freeNicknameMap(&_server->nicknames);
 
-    // Close file used for storing messages
+    // Close file used for storing messages, once the queued records are written
+    stopPersistence();
     closeMessageStore();
 }
 
+void printUsage(const char* programName) {
+    printf("Usage: %s [options]\n", programName);
+    printf("Options:\n");
+    printf("  -p <port>       Port to listen on (default: %d)\n", DEFAULT_PORT);
+    printf("  -c <clients>    Maximum number of clients served at once (default: %d)\n", DEFAULT_MAX_CLIENTS);
+    printf("  -s <path>       Unix socket serving counters and latency histograms (default: %s)\n",
+           DEFAULT_STATS_SOCKET);
+    printf("  -t <file>       Trace sampled messages to <file> (Chrome trace-event JSON)\n");
+    printf("  -T <n>          Trace one message out of <n> (default: %d)\n", DEFAULT_TRACE_SAMPLING);
+    printf("  -m <path>       Unix socket on which local clients negotiate shared memory (default: %s, "
+           "\"off\" to disable)\n", DEFAULT_SHM_SOCKET);
+    printf("  -f <file>       Message history file (default: chat_history.dat)\n");
+    printf("  -r <port>       Accept links from peer servers on <port>\n");
+    printf("  -P <host:port>  Link to the peer server relaying on <host:port> (repeatable); messages are\n"
+           "                  forwarded to direct peers only, so the servers must form a full mesh\n");
+    printf("  -i <id>         Origin id of this server among its peers (default: random)\n");
+    printf("  -q <msgs/s>     Messages per second allowed to each client (default: unlimited)\n");
+    printf("  -b <bytes/s>    Bytes per second allowed to each client (default: unlimited)\n");
+    printf("  -Q <msgs/s>     Messages per second allowed to all clients together (default: unlimited)\n");
+    printf("  -B <bytes/s>    Bytes per second allowed to all clients together (default: unlimited)\n");
+    printf("  -a <conns/s>    New connections accepted per second (default: unlimited)\n");
+    printf("  -U <path>       Unix socket on which a new server process can take over (default: %s, "
+           "\"off\" to disable)\n", DEFAULT_UPGRADE_SOCKET);
+    printf("  -u              Take over the connections of the server listening on the -U socket\n");
+    printf("  -S <core>       Busy-poll: pin the event loop to <core> and spin instead of sleeping\n");
+    printf("  -C <file>       Capture inbound messages with their arrival time to <file> (see chat_replay)\n");
+    printf("  -v              Verbose: also log every event loop iteration\n");
+    printf("  -h              Display this help message\n");
+}
+
 // Entry point: sets up server and optionally prints last messages from storage
-int main() {
-    if (initMessageStore("chat_history.dat") != 0) {
-        fprintf(stderr, "Warning: Failed to initialize message store\n");
+int main(int argc, char** argv) {
+    const char* statsSocket = DEFAULT_STATS_SOCKET;
+    uint16_t port = DEFAULT_PORT;
+    int maxClients = DEFAULT_MAX_CLIENTS;
+    enum LogLevel logLevel = LOG_INFO;
+    const char* traceFile = NULL;
+    int traceSampling = DEFAULT_TRACE_SAMPLING;
+    const char* captureFile = NULL;
+    const char* shmSocket = DEFAULT_SHM_SOCKET;
+    const char* historyFile = "chat_history.dat";
+    struct RateLimits limits;
+    memset(&limits, 0, sizeof(limits));
+    int relayPort = 0;
+    uint32_t origin = (uint32_t)(time(NULL) ^ ((uint32_t)getpid() << 16));
+    const char* upgradeSocket = DEFAULT_UPGRADE_SOCKET;
+    int takeOver = 0;
+    int busyPollCore = -1;
+
+    // Parse command-line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            int value = atoi(argv[++i]);
+            if (value <= 0 || value > 65535) {
+                fprintf(stderr, "Invalid port number\n");
+                return 1;
+            }
+            port = (uint16_t)value;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            maxClients = atoi(argv[++i]);
+            if (maxClients <= 0) {
+                fprintf(stderr, "Invalid number of clients\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            statsSocket = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            traceSampling = atoi(argv[++i]);
+            if (traceSampling <= 0) {
+                fprintf(stderr, "Invalid trace sampling\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            shmSocket = argv[++i];
+            if (strcmp(shmSocket, "off") == 0) {
+                shmSocket = NULL;
+            }
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            historyFile = argv[++i];
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            relayPort = atoi(argv[++i]);
+            if (relayPort <= 0 || relayPort > 65535) {
+                fprintf(stderr, "Invalid relay port\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+            if (addRelayPeer(argv[++i]) != 0) {
+                fprintf(stderr, "Invalid peer address: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            origin = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            limits.messagesPerSecond = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            limits.bytesPerSecond = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-Q") == 0 && i + 1 < argc) {
+            limits.globalMessagesPerSecond = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+            limits.globalBytesPerSecond = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            limits.acceptsPerSecond = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-U") == 0 && i + 1 < argc) {
+            upgradeSocket = argv[++i];
+            if (strcmp(upgradeSocket, "off") == 0) {
+                upgradeSocket = NULL;
+            }
+        } else if (strcmp(argv[i], "-u") == 0) {
+            takeOver = 1;
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            busyPollCore = atoi(argv[++i]);
+            if (busyPollCore < 0 || busyPollCore >= CPU_SETSIZE) {
+                fprintf(stderr, "Invalid core\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+            captureFile = argv[++i];
+        } else if (strcmp(argv[i], "-v") == 0) {
+            logLevel = LOG_DEBUG;
+        } else if (strcmp(argv[i], "-h") == 0) {
+            printUsage(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    // A client closing its socket must not kill the server through SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+
+    // Ctrl-C stops the event loop so pending logs and the store checkpoint are written
+    struct sigaction stopAction;
+    memset(&stopAction, 0, sizeof(stopAction));
+    stopAction.sa_handler = requestStop;  // No SA_RESTART: poll() must return EINTR
+    sigaction(SIGINT, &stopAction, NULL);
+    sigaction(SIGTERM, &stopAction, NULL);
+
+    if (origin == 0) {
+        origin = 1;  // 0 means "unknown" in the relay protocol
+    }
+    initRelay(origin);
+
+    // Hot upgrade: inherit the sockets of the running server, which exits once they are handed over
+    struct Server server;
+    if (takeOver) {
+        if (upgradeSocket == NULL) {
+            fprintf(stderr, "-u needs the upgrade socket of the running server (-U)\n");
+            return 1;
+        }
+        if (takeOverServer(upgradeSocket, maxClients, &server) != 0) {
+            error("Failed to take over the running server");
+        }
+        origin = relayOrigin();
+        printf("Took over %d connections from the previous server\n", server.nbClients);
     } else {
+        server = createServer(port, maxClients);
+    }
+
+    if (initMessageStore(historyFile) != 0) {
+        fprintf(stderr, "Warning: Failed to initialize message store\n");
+    } else if (!takeOver) {
+        // After an upgrade the clients already saw the history: skip the replay
         printf("Message store initialized successfully\n");
 
         // Load and print last 10 messages on startup (sorted by time, descending)
@@ -231,9 +1281,87 @@ int main() {
         }
     }
 
-    struct Server server = createServer();
-    printf("Server started on port %d\n", PORT);
+    printf("Server started on port %d (up to %d clients)\n", port, maxClients);
+    setRateLimits(&server, &limits);
+
+    if (shmSocket != NULL) {
+        server.shmListenFd = shmListen(shmSocket);
+        if (server.shmListenFd < 0) {
+            perror("Failed to open the shared-memory socket");
+        } else {
+            printf("Local clients can use shared memory on %s\n", shmSocket);
+        }
+    }
+
+    if (relayPort > 0 && server.relayListenFd < 0) {
+        server.relayListenFd = relayListen((uint16_t)relayPort);
+        if (server.relayListenFd < 0) {
+            error("Error opening the relay port");
+        }
+        printf("Relaying as origin %u on port %d\n", origin, relayPort);
+    }
+
+    if (upgradeSocket != NULL) {
+        server.upgradeListenFd = listenForUpgrade(upgradeSocket);
+        if (server.upgradeListenFd < 0) {
+            perror("Failed to open the upgrade socket");
+        }
+    }
+
+    if (startStatsServer(statsSocket) == 0) {
+        printf("Stats available on %s\n", statsSocket);
+    }
+
+    if (startLogger(stdout, logLevel) != 0) {
+        fprintf(stderr, "Warning: Failed to start the logging thread, logging synchronously\n");
+    }
+
+    if (startPersistence() != 0) {
+        fprintf(stderr, "Warning: Failed to start the persistence thread, saving synchronously\n");
+    }
+
+    if (traceFile != NULL && startTracing(traceFile, traceSampling) == 0) {
+        printf("Tracing 1 message out of %d to %s\n", traceSampling, traceFile);
+    }
+
+    if (captureFile != NULL) {
+        if (startCapture(captureFile) != 0) {
+            perror("Failed to start capture");
+        } else {
+            printf("Capturing inbound messages to %s\n", captureFile);
+        }
+    }
+
+    if (busyPollCore >= 0) {
+        // Pinned after the helper threads started, so they do not inherit the core
+        cpu_set_t cores;
+        CPU_ZERO(&cores);
+        CPU_SET(busyPollCore, &cores);
+        if (sched_setaffinity(0, sizeof(cores), &cores) != 0) {
+            // Spinning on whatever core the scheduler picks would only steal it from others
+            perror("Failed to pin the event loop, busy-polling disabled");
+        } else {
+            server.busyPoll = 1;
+            // Connections handed over by a previous server were added before busy-polling
+            for (int j = 1; j <= server.nbClients; j++) {
+                tuneConnection(&server, server.fds[j].fd);
+            }
+            printf("Busy-polling on core %d\n", busyPollCore);
+        }
+    }
+
     runServer(&server);
+    stopStatsServer();
+    stopTracing();
+    stopCapture();
+    if (server.shmListenFd >= 0) {
+        unlink(shmSocket);
+    }
+    if (server.upgradeListenFd >= 0) {
+        unlink(upgradeSocket);
+    }
+    logMessage(LOG_INFO, server.handedOff ? "Server handed over" : "Server stopped");
+    stopLogger();
 
     return 0;
 }
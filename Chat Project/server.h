@@ -2,20 +2,113 @@
 #define SERVER_H
 
 #include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chat.h"
+#include "nickname_map.h"
+#include "output_queue.h"
+#include "rate_limit.h"
+#include "relay.h"
+#include "shm_transport.h"
+
+#define DEFAULT_PORT 12345      ///< Port the server listens on unless -p is given
+#define DEFAULT_MAX_CLIENTS 2   ///< Clients served at once unless -c is given
+#define INITIAL_CAPACITY 10     ///< Initial size of the pollfd array (listening socket included)
+#define BUSY_POLL_USEC 50       ///< SO_BUSY_POLL budget of client sockets in busy-poll mode
+#define RESERVED_FDS 3          ///< Entries kept after the clients for the shared-memory, relay and upgrade sockets
+#define MAX_HISTORY_MESSAGES 10000  ///< Most messages sent for one CONTROL_HISTORY request
+
+/**
+ * State kept for every client connection.
+ * TCP is a byte stream: a message may arrive in several pieces, so it is
+ * reassembled here until all of its bytes have been received.
+ */
+struct Connection {
+    size_t received;          ///< Bytes of `pending` received so far
+    struct Message pending;   ///< Message being reassembled
+    int closing;              ///< Set when the connection must be closed by compactDescriptor()
+    uint32_t id;              ///< Stable id of the connection (file descriptors are reused)
+    struct ShmChannel* shm;   ///< Shared-memory channel of a local client, NULL for TCP
+    struct RelayLink* relay;  ///< Link state when the connection is a peer server, NULL for a client
+    struct TokenBucket messageBucket;  ///< Messages this client may still send (-q)
+    struct TokenBucket byteBucket;     ///< Bytes this client may still send (-b)
+    uint64_t throttledUntilNs;         ///< While non-zero, the connection is not read until this time
+    int resumed;                       ///< Set when a throttled connection must be read without waiting for poll
+    struct Outbox outbox;              ///< Messages waiting for a TCP client's socket, one lane per class
+    int batches;                       ///< The client takes compressed history batches (it announced FEATURE_LZ)
+    char nickname[NAME_LENGTH];        ///< Nickname this connection holds in the server's map, empty if none
+};
 
 /**
  * The Server structure stores the file descriptors of:
  *  - the listening socket
- *  - up to 2 client sockets
+ *  - every connected client socket
  * It uses the `poll` mechanism to monitor events on each socket.
+ * The arrays grow as clients connect, up to maxClients clients.
+ * Links to peer servers are connections too, marked by their RelayLink.
+ * The shared-memory negotiation socket, the relay listening socket and the upgrade
+ * socket, when enabled, are polled right after the last connection.
  */
 struct Server {
-    struct pollfd fds[3];   ///< fds[0] is the listening socket; fds[1..2] are client sockets
-    int nbClients;          ///< Number of clients currently connected (max 2)
+    struct pollfd* fds;           ///< fds[0] is the listening socket; fds[1..nbClients] are client sockets
+    struct Connection* clients;   ///< clients[i] is the state of the connection in fds[i] (clients[0] unused)
+    int capacity;                 ///< Number of entries allocated in fds and clients
+    int nbClients;                ///< Number of clients currently connected
+    int maxClients;               ///< Further client connections wait in the listen backlog
+    int shmListenFd;              ///< Socket on which local clients ask for shared memory, -1 if disabled
+    int relayListenFd;            ///< Socket accepting links from peer servers, -1 if disabled
+    int nbPeers;                  ///< Connections that are peer links (not counted against maxClients)
+    int upgradeListenFd;          ///< Socket on which a new server process asks for a handoff, -1 if disabled
+    int handedOff;                ///< Set once the connections were handed over to a new process
+    uint32_t nextConnectionId;    ///< Id given to the next connection
+    int busyPoll;                 ///< Spin on poll() with a zero timeout instead of sleeping
+    struct RateLimits limits;     ///< Limits set with setRateLimits()
+    struct TokenBucket globalMessages;  ///< Messages all clients may still send
+    struct TokenBucket globalBytes;     ///< Bytes all clients may still send
+    struct TokenBucket accepts;         ///< Connections that may still be accepted
+    uint64_t acceptPausedUntilNs;       ///< Listening sockets are not polled before this time
+    struct NicknameMap nicknames;       ///< Nickname -> index in clients, for direct messages
 };
 
 /**
- * Accept new client connections if there are fewer than 2 clients connected.
+ * Creates the listening socket on the given port and the initial descriptor arrays.
+ * Exits the program on failure.
+ *
+ * @param _port Port to listen on
+ * @param _maxClients Maximum number of clients served at the same time
+ */
+struct Server createServer(uint16_t _port, int _maxClients);
+
+/**
+ * Same as createServer(), on a listening socket that is already bound (e.g. inherited
+ * from a previous server process).
+ *
+ * @param _listenFd Non-blocking listening socket
+ * @param _maxClients Maximum number of clients served at the same time
+ */
+struct Server adoptServer(int _listenFd, int _maxClients);
+
+/**
+ * Adds an already connected socket to the poll set, growing the arrays if needed.
+ *
+ * @param _server Pointer to the Server struct.
+ * @param _fd Connected socket
+ * @return The new connection, with its rate-limit buckets set up, or NULL if memory is exhausted
+ */
+struct Connection* adoptConnection(struct Server* _server, int _fd);
+
+/**
+ * Sets the rate limits; connections accepted afterwards get their own buckets.
+ * Clients over a limit are not read until their buckets refill, so TCP pushes back on them.
+ *
+ * @param _server Pointer to the Server struct.
+ * @param _limits Limits to apply (0 disables one)
+ */
+void setRateLimits(struct Server* _server, const struct RateLimits* _limits);
+
+/**
+ * Accept new client connections while fewer than maxClients clients are connected.
  *
  * @param _server Pointer to the Server struct.
  * @return 0 on success,
@@ -25,19 +118,49 @@ struct Server {
 int acceptNewClients(struct Server* _server);
 
 /**
- * Receive a message from the given client socket and broadcast it to other connected clients.
+ * Accept pending shared-memory clients while fewer than maxClients clients are connected.
+ * Their negotiation socket takes the place of the TCP socket in fds.
+ *
+ * @param _server Pointer to the Server struct.
+ * @return 0 on success,
+ *        -1 if a channel could not be set up,
+ *        -2 if _server is NULL.
+ */
+int acceptShmClients(struct Server* _server);
+
+/**
+ * Accept the links opened by peer servers and answer them with our hello.
+ *
+ * @param _server Pointer to the Server struct.
+ * @return 0 on success,
+ *        -1 on socket error (accept failed),
+ *        -2 if _server is NULL.
+ */
+int acceptRelayLinks(struct Server* _server);
+
+/**
+ * Open the links to the peers given with -P that are not linked yet.
+ * A peer that cannot be reached is tried again RELAY_RETRY_MS later.
+ *
+ * @param _server Pointer to the Server struct.
+ */
+void connectRelayPeers(struct Server* _server);
+
+/**
+ * Receive the available bytes of a client and broadcast every message they complete
+ * to the other connected clients.
  *
  * @param _server Pointer to the Server struct.
- * @param _sendingClientFd File descriptor of the client sending the message.
+ * @param _clientIndex Index in fds/clients of the client sending the message.
  * @return 0 on success,
- *        -1 if the message could not be read (sender fd is set to -1),
- *        -2 if the message could not be sent to any recipient (receiver fd is set to -1),
+ *        -1 if the client could not be read or disconnected (it is marked as closing),
+ *        -2 if the message could not be sent to a recipient (the recipient is marked as closing),
  *        -3 if _server is NULL.
  */
-int receiveAndBroadcastMessage(struct Server* _server, int _sendingClientFd);
+int receiveAndBroadcastMessage(struct Server* _server, int _clientIndex);
 
 /**
- * Compact the pollfd array by removing disconnected clients (fds marked as -1).
+ * Compact the pollfd array by closing and removing the connections marked as closing.
  *
  * This function updates the pollfd array in-place and decrements nbClients accordingly.
  *
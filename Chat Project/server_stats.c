@@ -0,0 +1,200 @@
+#include "server_stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+struct ServerStats serverStats = {
+    .readToBroadcast = { .name = "read_to_broadcast_ns" },
+    .persistence = { .name = "persistence_ns" },
+    .recipientSend = { .name = "recipient_send_ns" },
+};
+
+static int statsFd = -1;                  // Listening admin socket
+static pthread_t statsThread;
+static char statsPath[108] = {0};         // sizeof(sun_path)
+
+uint64_t monotonicNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Bucket of a value: values below 2*SUB_BUCKETS are exact, then each power of two
+// is split into SUB_BUCKETS linear buckets
+static int bucketIndex(uint64_t value) {
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int magnitude = 63 - __builtin_clzll(value);  // value is in [2^magnitude, 2^(magnitude+1))
+    int shift = magnitude - 5;                    // log2(HISTOGRAM_SUB_BUCKETS) == 5
+    int index = (shift + 1) * HISTOGRAM_SUB_BUCKETS + (int)((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+    return (index < HISTOGRAM_BUCKETS) ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+// Largest value that falls in a bucket
+static uint64_t bucketUpperBound(int index) {
+    if (index < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return (uint64_t)index;
+    }
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t subBucket = (uint64_t)(index % HISTOGRAM_SUB_BUCKETS) + HISTOGRAM_SUB_BUCKETS;
+    return ((subBucket + 1) << shift) - 1;
+}
+
+void histogramRecord(struct LatencyHistogram* histogram, uint64_t valueNs) {
+    atomic_fetch_add_explicit(&histogram->counts[bucketIndex(valueNs)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, valueNs, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while (valueNs > max
+           && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, valueNs,
+                                                     memory_order_relaxed, memory_order_relaxed)) {
+        // max was reloaded by the failed exchange
+    }
+}
+
+uint64_t histogramPercentile(const struct LatencyHistogram* histogram, double percent) {
+    uint64_t total = atomic_load_explicit(&histogram->total, memory_order_relaxed);
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percent / 100.0 * (double)total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t bound = bucketUpperBound(i);
+            uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+            return (bound < max) ? bound : max;
+        }
+    }
+    return atomic_load_explicit(&histogram->max, memory_order_relaxed);
+}
+
+// One summary line per histogram: count, mean, percentiles and max
+static void writeHistogram(FILE* out, const struct LatencyHistogram* histogram) {
+    uint64_t total = atomic_load_explicit(&histogram->total, memory_order_relaxed);
+    uint64_t sum = atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+    fprintf(out, "%s count=%llu mean=%llu p50=%llu p90=%llu p99=%llu p999=%llu max=%llu\n",
+            histogram->name,
+            (unsigned long long)total,
+            (unsigned long long)(total ? sum / total : 0),
+            (unsigned long long)histogramPercentile(histogram, 50),
+            (unsigned long long)histogramPercentile(histogram, 90),
+            (unsigned long long)histogramPercentile(histogram, 99),
+            (unsigned long long)histogramPercentile(histogram, 99.9),
+            (unsigned long long)atomic_load_explicit(&histogram->max, memory_order_relaxed));
+}
+
+#define WRITE_COUNTER(out, field) \
+    fprintf(out, "%s %llu\n", #field, \
+            (unsigned long long)atomic_load_explicit(&serverStats.field, memory_order_relaxed))
+
+void writeServerStats(FILE* out) {
+    WRITE_COUNTER(out, messagesReceived);
+    WRITE_COUNTER(out, messagesSent);
+    WRITE_COUNTER(out, bytesReceived);
+    WRITE_COUNTER(out, bytesSent);
+    WRITE_COUNTER(out, connectionsAccepted);
+    WRITE_COUNTER(out, connectionsClosed);
+    WRITE_COUNTER(out, sendDrops);
+    WRITE_COUNTER(out, bulkDrops);
+    WRITE_COUNTER(out, persistDrops);
+    WRITE_COUNTER(out, persistStalls);
+    WRITE_COUNTER(out, relayForwarded);
+    WRITE_COUNTER(out, relayReceived);
+    WRITE_COUNTER(out, relayDuplicates);
+    WRITE_COUNTER(out, readsThrottled);
+    WRITE_COUNTER(out, persistThrottled);
+    WRITE_COUNTER(out, acceptsThrottled);
+    WRITE_COUNTER(out, directMessages);
+    WRITE_COUNTER(out, directUnknown);
+    WRITE_COUNTER(out, historyMessages);
+    WRITE_COUNTER(out, historyBytes);
+    WRITE_COUNTER(out, historyWireBytes);
+    WRITE_COUNTER(out, spinNs);
+    writeHistogram(out, &serverStats.readToBroadcast);
+    writeHistogram(out, &serverStats.persistence);
+    writeHistogram(out, &serverStats.recipientSend);
+}
+
+// Admin thread: answers every connection with the current report
+static void* serveStats(void* arg) {
+    (void)arg;
+    while (1) {
+        int clientFd = accept(statsFd, NULL, NULL);
+        if (clientFd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;  // Listening socket shut down by stopStatsServer
+        }
+
+        FILE* out = fdopen(clientFd, "w");
+        if (out == NULL) {
+            close(clientFd);
+            continue;
+        }
+        writeServerStats(out);
+        fclose(out);
+    }
+    return NULL;
+}
+
+int startStatsServer(const char* socketPath) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Stats socket path too long: %s\n", socketPath);
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    statsFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (statsFd < 0) {
+        perror("Error creating stats socket");
+        return -1;
+    }
+
+    unlink(socketPath);  // Left behind by a previous run
+    if (bind(statsFd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(statsFd, 8) < 0) {
+        perror("Error binding stats socket");
+        close(statsFd);
+        statsFd = -1;
+        return -1;
+    }
+
+    if (pthread_create(&statsThread, NULL, serveStats, NULL) != 0) {
+        fprintf(stderr, "Error starting stats thread\n");
+        close(statsFd);
+        statsFd = -1;
+        unlink(socketPath);
+        return -1;
+    }
+
+    strcpy(statsPath, socketPath);
+    return 0;
+}
+
+void stopStatsServer(void) {
+    if (statsFd < 0) {
+        return;
+    }
+    shutdown(statsFd, SHUT_RDWR);  // Wakes the thread blocked in accept
+    pthread_join(statsThread, NULL);
+    close(statsFd);
+    statsFd = -1;
+    unlink(statsPath);
+}
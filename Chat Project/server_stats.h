@@ -0,0 +1,100 @@
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define DEFAULT_STATS_SOCKET "chat_server.sock"  ///< Default path of the admin Unix socket
+
+#define HISTOGRAM_SUB_BUCKETS 32  ///< Linear sub-buckets per power of two (about 3% precision)
+#define HISTOGRAM_MAGNITUDES 40   ///< Powers of two covered, from 1 ns to about 4 hours
+#define HISTOGRAM_BUCKETS (HISTOGRAM_MAGNITUDES * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * HDR-style latency histogram: every power of two is split into HISTOGRAM_SUB_BUCKETS
+ * linear buckets, so percentiles keep the same relative precision from nanoseconds to
+ * minutes. Recording is a few atomic increments and never blocks; the admin thread may
+ * read a histogram while the server records into it.
+ */
+struct LatencyHistogram {
+    const char* name;                            ///< Name used in the stats report
+    atomic_uint_fast64_t counts[HISTOGRAM_BUCKETS];
+    atomic_uint_fast64_t total;                  ///< Number of recorded values
+    atomic_uint_fast64_t sum;                    ///< Sum of recorded values, in ns
+    atomic_uint_fast64_t max;                    ///< Largest recorded value, in ns
+};
+
+/**
+ * Counters and histograms of the running server.
+ */
+struct ServerStats {
+    atomic_uint_fast64_t messagesReceived;    ///< Messages read from clients
+    atomic_uint_fast64_t messagesSent;        ///< Messages delivered to recipients
+    atomic_uint_fast64_t bytesReceived;       ///< Bytes read from clients
+    atomic_uint_fast64_t bytesSent;           ///< Bytes written to clients
+    atomic_uint_fast64_t connectionsAccepted; ///< Client connections accepted
+    atomic_uint_fast64_t connectionsClosed;   ///< Client connections closed
+    atomic_uint_fast64_t sendDrops;           ///< Deliveries that failed (recipient dropped)
+    atomic_uint_fast64_t bulkDrops;           ///< Bulk messages skipped for a recipient whose bulk lane was full
+    atomic_uint_fast64_t persistDrops;        ///< Messages that could not be saved
+    atomic_uint_fast64_t persistStalls;       ///< Times the event loop waited for room in the persistence queue
+    atomic_uint_fast64_t relayForwarded;      ///< Frames sent to peer servers
+    atomic_uint_fast64_t relayReceived;       ///< Relayed messages delivered to local clients
+    atomic_uint_fast64_t relayDuplicates;     ///< Relayed messages dropped as already seen
+    atomic_uint_fast64_t readsThrottled;      ///< Times a client was paused for exceeding a rate limit
+    atomic_uint_fast64_t persistThrottled;    ///< Times a client was paused while the history writer caught up
+    atomic_uint_fast64_t acceptsThrottled;    ///< Times accepting was paused by the connection rate limit
+    atomic_uint_fast64_t directMessages;      ///< Direct messages delivered to their recipient
+    atomic_uint_fast64_t directUnknown;       ///< Direct messages whose recipient is not connected here
+    atomic_uint_fast64_t historyMessages;     ///< Stored messages sent in answer to history requests
+    atomic_uint_fast64_t historyBytes;        ///< Size of those messages, uncompressed
+    atomic_uint_fast64_t historyWireBytes;    ///< Bytes actually queued for them (batched and compressed)
+    atomic_uint_fast64_t spinNs;              ///< Time the busy-polling event loop spent finding nothing to do
+    struct LatencyHistogram readToBroadcast;  ///< From message read to end of its broadcast
+    struct LatencyHistogram persistence;      ///< Time spent saving a message
+    struct LatencyHistogram recipientSend;    ///< Time to write one message to one connection, first byte to last
+};
+
+/**
+ * Statistics of this server process, updated by the event loop.
+ */
+extern struct ServerStats serverStats;
+
+/**
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t monotonicNs(void);
+
+/**
+ * Records one latency value (in nanoseconds) into a histogram.
+ */
+void histogramRecord(struct LatencyHistogram* histogram, uint64_t valueNs);
+
+/**
+ * Returns the value below which `percent` % of the recorded values fall (0 if empty).
+ * The result is the upper bound of the matching bucket.
+ */
+uint64_t histogramPercentile(const struct LatencyHistogram* histogram, double percent);
+
+/**
+ * Writes every counter and histogram summary as "name value" text lines.
+ */
+void writeServerStats(FILE* out);
+
+/**
+ * Starts a thread serving the stats report on a local Unix socket:
+ * every connection receives the current report, then is closed
+ * (e.g. `socat - UNIX-CONNECT:chat_server.sock`).
+ *
+ * @param socketPath Path of the socket; an existing file at this path is replaced
+ * @return 0 on success, -1 on failure
+ */
+int startStatsServer(const char* socketPath);
+
+/**
+ * Stops the stats thread and removes its socket.
+ */
+void stopStatsServer(void);
+
+#endif
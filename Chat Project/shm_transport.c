@@ -0,0 +1,298 @@
+#define _GNU_SOURCE  // memfd_create
+#include "shm_transport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Fills a Unix socket address, returns -1 if the path does not fit
+static int shmAddress(const char* path, struct sockaddr_un* address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+int shmListen(const char* path) {
+    struct sockaddr_un address;
+    if (shmAddress(path, &address) < 0) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);  // Left behind by a previous run
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int shmAccept(int listenFd, struct ShmChannel* channel) {
+    memset(channel, 0, sizeof(*channel));
+    channel->memFd = -1;
+    channel->socketFd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (channel->socketFd < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+    }
+
+    // Anonymous memory file: it disappears with the last mapping, nothing to clean up on disk
+    int memFd = memfd_create("chat_shm", MFD_CLOEXEC);
+    channel->memFd = memFd;
+    channel->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (memFd < 0 || channel->eventFd < 0 || ftruncate(memFd, sizeof(struct ShmRegion)) < 0) {
+        goto failed;
+    }
+    channel->region = mmap(NULL, sizeof(struct ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+    if (channel->region == MAP_FAILED) {
+        channel->region = NULL;
+        goto failed;
+    }
+    channel->region->magic = SHM_MAGIC;  // The file is zero-filled: the rings start empty
+    channel->region->slots = SHM_RING_SLOTS;
+    channel->outgoing = &channel->region->toClient;
+    channel->incoming = &channel->region->toServer;
+    channel->isServer = 1;
+
+    // Hand the region and the doorbell over to the client
+    char tag = 'S';
+    struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer) };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    int fds[2] = { memFd, channel->eventFd };
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(channel->socketFd, &msg, MSG_NOSIGNAL) != 1) {
+        goto failed;
+    }
+    return 0;
+
+failed:
+    shmClose(channel);
+    return -1;
+}
+
+int shmAdopt(struct ShmChannel* channel, int socketFd, int memFd, int eventFd) {
+    memset(channel, 0, sizeof(*channel));
+    channel->socketFd = socketFd;
+    channel->memFd = memFd;
+    channel->eventFd = eventFd;
+    channel->region = mmap(NULL, sizeof(struct ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+    if (channel->region == MAP_FAILED || channel->region->magic != SHM_MAGIC
+        || channel->region->slots != SHM_RING_SLOTS) {
+        if (channel->region == MAP_FAILED) {
+            channel->region = NULL;
+        }
+        shmClose(channel);
+        return -1;
+    }
+    channel->outgoing = &channel->region->toClient;
+    channel->incoming = &channel->region->toServer;
+    channel->isServer = 1;
+    return 0;
+}
+
+int shmConnect(const char* path, struct ShmChannel* channel) {
+    memset(channel, 0, sizeof(*channel));
+    channel->eventFd = -1;
+    channel->memFd = -1;
+    struct sockaddr_un address;
+    if (shmAddress(path, &address) < 0) {
+        return -1;
+    }
+    channel->socketFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (channel->socketFd < 0) {
+        return -1;
+    }
+    if (connect(channel->socketFd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        shmClose(channel);
+        return -1;
+    }
+
+    // Wait for the region and the doorbell
+    char tag;
+    struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer) };
+    struct cmsghdr* cmsg;
+    if (recvmsg(channel->socketFd, &msg, MSG_CMSG_CLOEXEC) != 1 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL
+        || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+        errno = EPROTO;
+        shmClose(channel);
+        return -1;
+    }
+    int fds[2];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    channel->eventFd = fds[1];
+    channel->region = mmap(NULL, sizeof(struct ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (channel->region == MAP_FAILED) {
+        channel->region = NULL;
+        shmClose(channel);
+        return -1;
+    }
+    if (channel->region->magic != SHM_MAGIC || channel->region->slots != SHM_RING_SLOTS) {
+        errno = EPROTO;
+        shmClose(channel);
+        return -1;
+    }
+    channel->outgoing = &channel->region->toServer;
+    channel->incoming = &channel->region->toClient;
+    channel->isServer = 0;
+    return 0;
+}
+
+static long futex(atomic_uint* address, int operation, unsigned value, const struct timespec* timeout) {
+    return syscall(SYS_futex, (unsigned*)address, operation, value, timeout, NULL, 0);
+}
+
+// Rings the peer's doorbell
+static void ringDoorbell(struct ShmChannel* channel) {
+    if (channel->isServer) {
+        uint64_t one = 1;
+        if (write(channel->eventFd, &one, sizeof(one)) < 0) {
+            // Counter saturated: the client has plenty of wake-ups pending already
+        }
+    } else {
+        char byte = 0;
+        send(channel->socketFd, &byte, 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+}
+
+// Fills the slot at head, which must be free, and publishes it
+static void pushMessage(struct ShmChannel* channel, unsigned head, const struct Message* message) {
+    struct ShmRing* ring = channel->outgoing;
+    ring->slots[head % SHM_RING_SLOTS] = *message;
+    atomic_store(&ring->head, head + 1);
+
+    // The consumer may have found the ring empty and gone to sleep: wake it up.
+    // Both sides use sequentially consistent head/tail accesses, so either the consumer
+    // sees this message or this load sees its final tail.
+    if (atomic_load(&ring->tail) == head) {
+        ringDoorbell(channel);
+    }
+}
+
+int shmSend(struct ShmChannel* channel, const struct Message* message) {
+    struct ShmRing* ring = channel->outgoing;
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    // Full ring: sleep on the tail until the consumer frees a slot, like a blocking send
+    int waitedMs = 0;
+    unsigned tail;
+    while (head - (tail = atomic_load_explicit(&ring->tail, memory_order_acquire)) >= SHM_RING_SLOTS) {
+        if (waitedMs >= SHM_SEND_TIMEOUT_MS) {
+            return -1;
+        }
+        atomic_store(&ring->spaceWaiting, 1);
+        if (head - atomic_load(&ring->tail) >= SHM_RING_SLOTS) {
+            struct timespec slice = { 0, 1000000 };
+            futex(&ring->tail, FUTEX_WAIT, tail, &slice);
+            waitedMs++;
+        }
+    }
+
+    pushMessage(channel, head, message);
+    return 0;
+}
+
+int shmTrySend(struct ShmChannel* channel, const struct Message* message) {
+    struct ShmRing* ring = channel->outgoing;
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= SHM_RING_SLOTS) {
+        // Ask for the doorbell, then look again: a slot freed in between would not ring it
+        atomic_store(&ring->spaceWaiting, 1);
+        if (head - atomic_load(&ring->tail) >= SHM_RING_SLOTS) {
+            return 0;
+        }
+    }
+    pushMessage(channel, head, message);
+    return 1;
+}
+
+int shmReceive(struct ShmChannel* channel, struct Message* message) {
+    struct ShmRing* ring = channel->incoming;
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (atomic_load(&ring->head) == tail) {
+        return 0;
+    }
+
+    *message = ring->slots[tail % SHM_RING_SLOTS];
+    atomic_store(&ring->tail, tail + 1);
+    if (atomic_load(&ring->spaceWaiting)) {
+        atomic_store(&ring->spaceWaiting, 0);
+        if (channel->isServer) {
+            futex(&ring->tail, FUTEX_WAKE, 1, NULL);  // The client sleeps in shmSend()
+        } else {
+            ringDoorbell(channel);  // The server keeps its messages until the doorbell rings
+        }
+    }
+    return 1;
+}
+
+int shmClearDoorbell(struct ShmChannel* channel) {
+    if (!channel->isServer) {
+        uint64_t count;
+        if (read(channel->eventFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            return -1;
+        }
+        return 0;
+    }
+
+    char bytes[256];
+    while (1) {
+        ssize_t received = recv(channel->socketFd, bytes, sizeof(bytes), MSG_DONTWAIT);
+        if (received == 0) {
+            return -1;  // The client closed the channel
+        }
+        if (received < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        }
+    }
+}
+
+void shmClose(struct ShmChannel* channel) {
+    if (channel->region != NULL) {
+        munmap(channel->region, sizeof(struct ShmRegion));
+        channel->region = NULL;
+    }
+    if (channel->eventFd >= 0) {
+        close(channel->eventFd);
+        channel->eventFd = -1;
+    }
+    if (channel->memFd >= 0) {
+        close(channel->memFd);
+        channel->memFd = -1;
+    }
+    if (channel->socketFd >= 0) {
+        close(channel->socketFd);
+        channel->socketFd = -1;
+    }
+}
@@ -0,0 +1,124 @@
+#ifndef SHM_TRANSPORT_H
+#define SHM_TRANSPORT_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "chat.h"
+
+#define DEFAULT_SHM_SOCKET "chat_server.shm"  ///< Unix socket on which local clients negotiate shared memory
+#define SHM_RING_SLOTS 64                     ///< Messages buffered per direction (power of two)
+#define SHM_SEND_TIMEOUT_MS 1000              ///< A send waiting this long for space fails, like a dead socket
+#define SHM_MAGIC 0x4D485343u                 ///< "CSHM" in little-endian, first field of the region
+
+/**
+ * Single-producer single-consumer ring of messages in shared memory.
+ * head and tail are free-running counters on separate cache lines.
+ */
+struct ShmRing {
+    _Alignas(64) atomic_uint head;            ///< Messages pushed (written by the producer)
+    _Alignas(64) atomic_uint tail;            ///< Messages popped (written by the consumer)
+    atomic_uint spaceWaiting;                 ///< Set by a producer sleeping on a full ring
+    _Alignas(64) struct Message slots[SHM_RING_SLOTS];
+};
+
+/**
+ * Memory shared by the server and one local client.
+ */
+struct ShmRegion {
+    uint32_t magic;               ///< SHM_MAGIC
+    uint32_t slots;               ///< SHM_RING_SLOTS of the server, checked by the client
+    struct ShmRing toServer;      ///< Messages written by the client
+    struct ShmRing toClient;      ///< Messages broadcast by the server
+};
+
+/**
+ * One end of a shared-memory connection.
+ * A push into an empty ring rings the peer's doorbell: the client writes a byte on the
+ * negotiation socket, which the server polls like a TCP client (and which reports hang-ups),
+ * and the server signals an eventfd polled by the client.
+ */
+struct ShmChannel {
+    struct ShmRegion* region;     ///< Shared mapping
+    struct ShmRing* outgoing;     ///< Ring this end pushes into
+    struct ShmRing* incoming;     ///< Ring this end pops from
+    int socketFd;                 ///< Negotiation socket, kept open while connected
+    int eventFd;                  ///< Doorbell of the client
+    int memFd;                    ///< Server side: memory file of the region, kept to hand the channel over
+    int isServer;                 ///< Which end this is
+};
+
+/**
+ * Creates the non-blocking Unix socket on which local clients negotiate a channel.
+ *
+ * @param path Socket path (replaced if it exists)
+ * @return The listening socket, -1 on failure
+ */
+int shmListen(const char* path);
+
+/**
+ * Server side: accepts one pending client and hands it a new shared region and doorbell.
+ *
+ * @param listenFd Socket returned by shmListen()
+ * @param channel Receives the server end of the channel
+ * @return 0 on success, 1 if no client is pending, -1 on failure
+ */
+int shmAccept(int listenFd, struct ShmChannel* channel);
+
+/**
+ * Client side: connects to the server's negotiation socket and maps the region it sends.
+ *
+ * @param path Socket path given to the server
+ * @param channel Receives the client end of the channel
+ * @return 0 on success, -1 on failure
+ */
+int shmConnect(const char* path, struct ShmChannel* channel);
+
+/**
+ * Server side: rebuilds a channel handed over by another server process.
+ *
+ * @param channel Receives the server end of the channel
+ * @param socketFd Negotiation socket of the client
+ * @param memFd Memory file of the region
+ * @param eventFd Doorbell of the client
+ * @return 0 on success, -1 if the region cannot be mapped (the descriptors are then closed)
+ */
+int shmAdopt(struct ShmChannel* channel, int socketFd, int memFd, int eventFd);
+
+/**
+ * Client side: pushes a message to the server, waiting up to SHM_SEND_TIMEOUT_MS while the
+ * ring is full.
+ *
+ * @return 0 on success, -1 if the peer did not make room in time
+ */
+int shmSend(struct ShmChannel* channel, const struct Message* message);
+
+/**
+ * Server side: pushes a message to the client without waiting. When the ring is full, the
+ * client rings the server's doorbell as soon as it makes room, so the caller can keep the
+ * message and retry then.
+ *
+ * @return 1 if the message was pushed, 0 if the ring is full
+ */
+int shmTrySend(struct ShmChannel* channel, const struct Message* message);
+
+/**
+ * Pops the next message from the peer, if any.
+ *
+ * @return 1 if a message was copied to `message`, 0 if the ring is empty
+ */
+int shmReceive(struct ShmChannel* channel, struct Message* message);
+
+/**
+ * Consumes pending doorbell signals; call it before draining with shmReceive().
+ *
+ * @return 0 on success, -1 if the peer closed the channel
+ */
+int shmClearDoorbell(struct ShmChannel* channel);
+
+/**
+ * Unmaps the region and closes the descriptors of a channel.
+ */
+void shmClose(struct ShmChannel* channel);
+
+#endif
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chat.h"
+#include "message_store.h"
+
+#define DEFAULT_BENCH_FILE "store_bench.dat"
+#define DEFAULT_MAX_RECORDS 1000000L   // Largest history measured unless -N is given
+#define DEFAULT_SAVE_RECORDS 20000     // Records saved per durability setting
+#define DEFAULT_FSYNC_RECORDS 500      // fsync per record is slow: fewer records
+#define LOADED_MESSAGES 10             // What the server loads at startup
+
+void error(const char* msg) {
+    perror(msg);
+    exit(1);
+}
+
+static const char* nicknames[] = { "alice", "bob", "carol", "dave", "eve", "mallory", "trent" };
+
+void printUsage(const char* programName) {
+    printf("Usage: %s [options]\n", programName);
+    printf("Options:\n");
+    printf("  -f <filename>   Scratch file for the synthetic histories (default: %s)\n", DEFAULT_BENCH_FILE);
+    printf("  -N <records>    Largest history to measure, from 1000 by powers of ten (default: %ld)\n",
+           DEFAULT_MAX_RECORDS);
+    printf("  -n <records>    Records saved per durability setting (default: %d)\n", DEFAULT_SAVE_RECORDS);
+    printf("  -j <threads>    Threads used by the parallel scan (default: number of CPUs)\n");
+    printf("  -h              Display this help message\n");
+}
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fills a message with deterministic pseudo-random content
+static void syntheticMessage(struct Message* message, long index) {
+    memset(message, 0, sizeof(*message));
+    strcpy(message->nickname, nicknames[index % (long)(sizeof(nicknames) / sizeof(nicknames[0]))]);
+    int written = snprintf(message->message, BUFFER_LENGTH, "synthetic message %ld ", index);
+    int padding = (int)((index * 2654435761u) % 200);
+    memset(message->message + written, 'a' + index % 26, padding);
+    // Mostly increasing timestamps with some jitter, like a real log
+    message->timestamp = 1700000000 + index - (time_t)((index * 40503u) % 30);
+}
+
+// Prints one result line: operations, time per operation and throughput
+static void report(const char* name, long records, long operations, double seconds) {
+    double bytes = (double)records * sizeof(struct MessageRecord);
+    printf("%-28s %12ld %14.1f %12.1f\n", name, records,
+           seconds * 1e9 / operations, bytes / seconds / (1024 * 1024));
+    fflush(stdout);
+}
+
+// Creates a history of `records` messages with buffered saves
+static void generateHistory(const char* filename, long records) {
+    unlink(filename);
+    char checkpoint[512];
+    snprintf(checkpoint, sizeof(checkpoint), "%s.ckpt", filename);
+    unlink(checkpoint);
+
+    if (initMessageStore(filename) != 0) {
+        error("Failed to create the synthetic history");
+    }
+    setStoreDurability(STORE_BUFFERED);
+    struct Message message;
+    for (long i = 0; i < records; i++) {
+        syntheticMessage(&message, i);
+        if (saveMessage(&message) < 0) {
+            error("Failed to write the synthetic history");
+        }
+    }
+    closeMessageStore();
+}
+
+// saveMessage() throughput with one durability setting
+static void benchSave(const char* filename, const char* name, enum StoreDurability durability, long records) {
+    generateHistory(filename, 0);
+    if (initMessageStore(filename) != 0) {
+        error("Failed to open the synthetic history");
+    }
+    setStoreDurability(durability);
+
+    struct Message message;
+    syntheticMessage(&message, 0);
+    double start = nowSeconds();
+    for (long i = 0; i < records; i++) {
+        message.timestamp++;
+        // A failing store would otherwise show up as a faster one
+        if (saveMessage(&message) < 0) {
+            error("Failed to save a message");
+        }
+    }
+    closeMessageStore();  // Buffered records are only written here
+    report(name, records, records, nowSeconds() - start);
+}
+
+static int countMessage(const struct Message* message, void* context) {
+    (void)message;
+    (*(long*)context)++;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    const char* filename = DEFAULT_BENCH_FILE;
+    long maxRecords = DEFAULT_MAX_RECORDS;
+    long saveRecords = DEFAULT_SAVE_RECORDS;
+    int nbThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    // Parse command-line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            filename = argv[++i];
+        } else if (strcmp(argv[i], "-N") == 0 && i + 1 < argc) {
+            maxRecords = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            saveRecords = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nbThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-h") == 0) {
+            printUsage(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (maxRecords < 1000 || saveRecords <= 0 || nbThreads <= 0) {
+        fprintf(stderr, "Invalid settings\n");
+        return 1;
+    }
+
+    printf("%-28s %12s %14s %12s\n", "case", "records", "ns/op", "MB/s");
+    printf("--------------------\n");
+
+    // Save throughput per durability setting
+    benchSave(filename, "save buffered", STORE_BUFFERED, saveRecords);
+    benchSave(filename, "save flush", STORE_FLUSH, saveRecords);
+    benchSave(filename, "save fsync", STORE_FSYNC,
+              saveRecords < DEFAULT_FSYNC_RECORDS ? saveRecords : DEFAULT_FSYNC_RECORDS);
+
+    // Load and scan latency against history size; one operation reads the whole history
+    for (long records = 1000; records <= maxRecords; records *= 10) {
+        generateHistory(filename, records);
+        char name[64];
+
+        struct Message loaded[LOADED_MESSAGES];
+        if (initMessageStore(filename) != 0) {
+            error("Failed to open the synthetic history");
+        }
+        double start = nowSeconds();
+        loadMessages(loaded, LOADED_MESSAGES, 1, 0);
+        report("load by time", records, 1, nowSeconds() - start);
+
+        start = nowSeconds();
+        loadMessages(loaded, LOADED_MESSAGES, 0, 1);
+        report("load by nickname", records, 1, nowSeconds() - start);
+        closeMessageStore();
+
+        struct MessageFilter filter;
+        memset(&filter, 0, sizeof(filter));
+        strcpy(filter.nickname, "bob");
+        struct Message* matches = NULL;
+        start = nowSeconds();
+        int matched = scanMessages(filename, &filter, nbThreads, &matches);
+        snprintf(name, sizeof(name), "scan filter (%d threads)", nbThreads);
+        report(name, records, 1, nowSeconds() - start);
+        free(matches);
+        if (matched < 0) {
+            error("Scan failed");
+        }
+
+        long sorted = 0;
+        start = nowSeconds();
+        int sortedCount = sortMessagesExternal(filename, NULL, DEFAULT_SORT_MEMORY / 8, 0, 1, countMessage, &sorted);
+        snprintf(name, sizeof(name), "external sort (%ld MB)", DEFAULT_SORT_MEMORY / 8 / (1024 * 1024));
+        report(name, records, 1, nowSeconds() - start);
+        if (sortedCount < 0) {
+            error("External sort failed");
+        }
+    }
+    printf("--------------------\n");
+
+    char checkpoint[512];
+    snprintf(checkpoint, sizeof(checkpoint), "%s.ckpt", filename);
+    unlink(checkpoint);
+    unlink(filename);
+    return 0;
+}
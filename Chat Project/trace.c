@@ -0,0 +1,103 @@
+#include "trace.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// One recorded span, formatted only when the trace is written
+struct TraceEvent {
+    uint64_t traceId;
+    const char* name;
+    int track;
+    uint64_t startNs;
+    uint64_t endNs;
+};
+
+static struct TraceEvent* events = NULL;     // Preallocated at start: recording never allocates
+static atomic_uint_fast64_t nbEvents = 0;    // Slots claimed, may exceed TRACE_MAX_EVENTS
+static uint64_t messagesSeen = 0;
+static uint64_t nextTraceId = 0;
+static int samplingRate = DEFAULT_TRACE_SAMPLING;
+static char tracePath[256] = {0};
+
+int startTracing(const char* path, int sampling) {
+    events = malloc(TRACE_MAX_EVENTS * sizeof(struct TraceEvent));
+    if (events == NULL) {
+        return -1;
+    }
+    strncpy(tracePath, path, sizeof(tracePath) - 1);
+    samplingRate = (sampling > 0) ? sampling : 1;
+    atomic_store(&nbEvents, 0);
+    messagesSeen = 0;
+    return 0;
+}
+
+uint64_t traceSample(void) {
+    if (events == NULL) {
+        return 0;
+    }
+    return (messagesSeen++ % samplingRate == 0) ? ++nextTraceId : 0;
+}
+
+void traceEvent(uint64_t traceId, const char* name, int track, uint64_t startNs, uint64_t endNs) {
+    if (traceId == 0 || events == NULL) {
+        return;
+    }
+    uint64_t slot = atomic_fetch_add_explicit(&nbEvents, 1, memory_order_relaxed);
+    if (slot >= TRACE_MAX_EVENTS) {
+        return;  // Buffer full: the overflow is reported when the trace is written
+    }
+    events[slot].traceId = traceId;
+    events[slot].name = name;
+    events[slot].track = track;
+    events[slot].startNs = startNs;
+    events[slot].endNs = endNs;
+}
+
+void stopTracing(void) {
+    if (events == NULL) {
+        return;
+    }
+
+    uint64_t recorded = atomic_load(&nbEvents);
+    uint64_t kept = (recorded < TRACE_MAX_EVENTS) ? recorded : TRACE_MAX_EVENTS;
+    FILE* out = fopen(tracePath, "w");
+    if (out == NULL) {
+        perror("Failed to write trace file");
+    } else {
+        // Timestamps are relative to the first event, in microseconds as the format expects
+        uint64_t origin = (kept > 0) ? events[0].startNs : 0;
+        for (uint64_t i = 1; i < kept; i++) {
+            if (events[i].startNs < origin) {
+                origin = events[i].startNs;
+            }
+        }
+
+        fprintf(out, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"sampling\":%d,\"dropped_events\":%llu},\n",
+                samplingRate, (unsigned long long)(recorded - kept));
+        fprintf(out, "\"traceEvents\":[\n");
+        fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"chat server\"}},\n");
+        fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"pipeline\"}}",
+                TRACE_PIPELINE_TRACK);
+        for (uint64_t i = 0; i < kept; i++) {
+            const struct TraceEvent* event = &events[i];
+            double ts = (event->startNs - origin) / 1000.0;
+            if (event->endNs == event->startNs) {
+                fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"message\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                             "\"pid\":1,\"tid\":%d,\"args\":{\"message\":%llu}}",
+                        event->name, ts, event->track, (unsigned long long)event->traceId);
+            } else {
+                fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"message\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                             "\"pid\":1,\"tid\":%d,\"args\":{\"message\":%llu}}",
+                        event->name, ts, (event->endNs - event->startNs) / 1000.0, event->track,
+                        (unsigned long long)event->traceId);
+            }
+        }
+        fprintf(out, "\n]}\n");
+        fclose(out);
+    }
+
+    free(events);
+    events = NULL;
+}
@@ -0,0 +1,50 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define DEFAULT_TRACE_SAMPLING 100   ///< One message traced out of this many unless -T is given
+#define TRACE_MAX_EVENTS 262144      ///< Events kept in memory; later events are counted and dropped
+
+/**
+ * Track (Chrome "tid") of the events of the server pipeline itself.
+ * Per-recipient sends use the recipient file descriptor as their track.
+ */
+#define TRACE_PIPELINE_TRACK 0
+
+/**
+ * Starts recording trace events for a sample of the messages.
+ * Events are kept in a preallocated buffer and written by stopTracing().
+ *
+ * @param path File receiving the Chrome trace-event JSON
+ * @param sampling Trace one message out of `sampling` (1 traces every message)
+ * @return 0 on success, -1 on failure
+ */
+int startTracing(const char* path, int sampling);
+
+/**
+ * Writes the recorded events as Chrome trace-event JSON (open it in chrome://tracing
+ * or Perfetto) and stops tracing.
+ */
+void stopTracing(void);
+
+/**
+ * Decides whether the next message is traced.
+ *
+ * @return A non-zero trace id for a sampled message, 0 otherwise (or when tracing is off)
+ */
+uint64_t traceSample(void);
+
+/**
+ * Records a span of a traced message, timestamps coming from monotonicNs().
+ * Does nothing for trace id 0. Pass startNs == endNs for an instant event.
+ *
+ * @param traceId Id returned by traceSample()
+ * @param name Stage name (static string: only the pointer is kept)
+ * @param track Track the event is drawn on
+ * @param startNs Start of the span
+ * @param endNs End of the span
+ */
+void traceEvent(uint64_t traceId, const char* name, int track, uint64_t startNs, uint64_t endNs);
+
+#endif
@@ -2,7 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#ifdef USE_PACKING_MAKKAWI
+#include "packing_MAKKAWI.h"  // Streaming packer with 64-bit sizes (packer_MAKKAWI target)
+#else
 #include "packing_Wang.h"  // Custom header for file packing/unpacking functions
+#endif
 
 #pragma region Exercise 2.1 - Gaussian Plotting with gnuplot
 
@@ -132,17 +136,42 @@ static void E3_file_packing(int argc, char* argv[]) {
         printf("Usage:\n");
         printf("  To pack: %s pack output.pak file1 file2 ...\n", argv[0]);
         printf("  To unpack: %s unpack output.pak\n", argv[0]);
+#ifdef USE_PACKING_MAKKAWI
+        printf("  To pack with a compression level: %s pack -<0-9> output.pak file1 file2 ...\n", argv[0]);
+        printf("  To unpack one file: %s unpack output.pak name\n", argv[0]);
+        printf("  To list: %s list output.pak\n", argv[0]);
+#endif
         return;
     }
 
     // Pack multiple files into one .pak archive
     if (strcmp(argv[1], "pack") == 0) {
+#ifdef USE_PACKING_MAKKAWI
+        // -0 stores the files as they are, -1 compresses fastest, -9 smallest
+        if (argc > 3 && argv[2][0] == '-' && argv[2][1] >= '0' && argv[2][1] <= '9' && argv[2][2] == '\0') {
+            filepackinglevel(argv[3], argc - 4, &argv[4], argv[2][1] - '0');
+            return;
+        }
+#endif
         filepacking(argv[2], argc - 3, &argv[3]);
     }
     // Unpack .pak archive into individual files
     else if (strcmp(argv[1], "unpack") == 0) {
+#ifdef USE_PACKING_MAKKAWI
+        // A name extracts that entry only, found through the central directory
+        if (argc > 3) {
+            fileextracting(argv[2], argv[3]);
+            return;
+        }
+#endif
         fileunpacking(argv[2]);
     }
+#ifdef USE_PACKING_MAKKAWI
+    // List the entries of a .pak archive
+    else if (strcmp(argv[1], "list") == 0) {
+        filelisting(argv[2]);
+    }
+#endif
     else {
         printf("Unknown command.\n");
     }
@@ -0,0 +1,235 @@
+#include "compress_MAKKAWI.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HASHBITS 16
+#define WINDOWMASK 0xFFFF          // Chain entries kept: one per position of the window
+
+struct lzcontext {
+    uint32_t head[1 << HASHBITS];  // Position + 1 of the last prefix seen per slot, 0 if none
+    uint32_t chain[WINDOWMASK + 1];// Position + 1 of the previous prefix with the same hash
+};
+
+static uint32_t read32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hashprefix(uint32_t prefix) {
+    return (prefix * 2654435761u) >> (32 - HASHBITS);
+}
+
+lzcontext* lzcreate(void) {
+    return malloc(sizeof(lzcontext));
+}
+
+void lzfree(lzcontext* context) {
+    free(context);
+}
+
+size_t lzbound(size_t length) {
+    return length + length / 255 + 16;
+}
+
+// Length of the common prefix of a and b, at most limit bytes, eight bytes per step
+static size_t matchlength(const unsigned char* a, const unsigned char* b, size_t limit) {
+    size_t length = 0;
+    while (length + 8 <= limit) {
+        uint64_t x, y;
+        memcpy(&x, a + length, 8);
+        memcpy(&y, b + length, 8);
+        if (x != y) return length + (__builtin_ctzll(x ^ y) >> 3);  // Little-endian
+        length += 8;
+    }
+    while (length < limit && a[length] == b[length]) length++;
+    return length;
+}
+
+// Records position in the hash table and its chain
+static void insert(lzcontext* c, const unsigned char* in, size_t position) {
+    uint32_t slot = hashprefix(read32(in + position));
+    c->chain[position & WINDOWMASK] = c->head[slot];
+    c->head[slot] = (uint32_t)(position + 1);
+}
+
+// Longest earlier match for position, looking at depth candidates at most; 0 if none.
+// position itself must not be inserted yet.
+static size_t findmatch(const lzcontext* c, const unsigned char* in, size_t length, size_t position, int depth,
+                        size_t* matchposition) {
+    uint32_t prefix = read32(in + position);
+    size_t best = 0;
+    uint32_t candidate = c->head[hashprefix(prefix)];
+    while (candidate != 0 && depth-- > 0) {
+        size_t start = candidate - 1;
+        if (position - start > LZMAXOFFSET) break;
+        if (read32(in + start) == prefix) {
+            size_t found = LZMINMATCH + matchlength(in + start + LZMINMATCH, in + position + LZMINMATCH,
+                                                    length - position - LZMINMATCH);
+            if (found > best) {
+                best = found;
+                *matchposition = start;
+            }
+        }
+        candidate = c->chain[start & WINDOWMASK];
+    }
+    return best;
+}
+
+// Spills what does not fit in a nibble as bytes of 255, closed by one below 255
+static unsigned char* writelength(unsigned char* out, size_t rest) {
+    while (rest >= 255) {
+        *out++ = 255;
+        rest -= 255;
+    }
+    *out++ = (unsigned char)rest;
+    return out;
+}
+
+// Appends a token, its literals and, unless offset is 0 (end of block), the match. The room
+// needed in the worst case is checked first; NULL means the block would not fit.
+static unsigned char* writesequence(unsigned char* out, const unsigned char* end, const unsigned char* literals,
+                                    size_t numofliterals, size_t offset, size_t length) {
+    size_t extra = length >= LZMINMATCH ? length - LZMINMATCH : 0;
+    size_t worst = 1 + numofliterals + numofliterals / 255 + 1 + 2 + extra / 255 + 1;
+    if ((size_t)(end - out) < worst) return NULL;
+
+    unsigned char* token = out++;
+    *token = (unsigned char)((numofliterals >= 15 ? 15 : numofliterals) << 4);
+    if (numofliterals >= 15) out = writelength(out, numofliterals - 15);
+    memcpy(out, literals, numofliterals);
+    out += numofliterals;
+    if (offset == 0) return out;
+
+    *out++ = (unsigned char)(offset & 0xFF);
+    *out++ = (unsigned char)(offset >> 8);
+    *token |= (unsigned char)(extra >= 15 ? 15 : extra);
+    if (extra >= 15) out = writelength(out, extra - 15);
+    return out;
+}
+
+size_t lzcompress(lzcontext* context, int level, const void* source, size_t length, void* destination,
+                  size_t capacity) {
+    const unsigned char* in = source;
+    unsigned char* out = destination;
+    const unsigned char* outend = out + capacity;
+    if (level < LZMINLEVEL) level = LZMINLEVEL;
+    if (level > LZMAXLEVEL) level = LZMAXLEVEL;
+    int depth = level <= 2 ? 1 : 1 << (level - 1);
+    int lazy = level >= 5;
+    int fullinsert = level >= 3;   // Fast levels do not index the inside of matches
+    memset(context->head, 0, sizeof(context->head));
+
+    size_t anchor = 0;             // First byte not yet emitted
+    size_t position = 0;
+    size_t misses = 0;
+    while (length >= LZMINMATCH && position <= length - LZMINMATCH) {
+        size_t matchposition = 0;
+        size_t found = findmatch(context, in, length, position, depth, &matchposition);
+        insert(context, in, position);
+        if (found == 0) {
+            // Level 1 steps faster and faster through data that does not match
+            position += (level == 1) ? 1 + (misses++ >> 6) : 1;
+            continue;
+        }
+        misses = 0;
+
+        // Lazy matching: a longer match starting one byte later wins
+        while (lazy && position + 1 <= length - LZMINMATCH) {
+            size_t nextposition = 0;
+            size_t next = findmatch(context, in, length, position + 1, depth, &nextposition);
+            if (next <= found) break;
+            insert(context, in, position + 1);
+            position++;
+            found = next;
+            matchposition = nextposition;
+        }
+
+        out = writesequence(out, outend, in + anchor, position - anchor, position - matchposition, found);
+        if (out == NULL) return 0;
+        size_t end = position + found;
+        if (fullinsert) {
+            for (position++; position < end && position <= length - LZMINMATCH; position++) {
+                insert(context, in, position);
+            }
+        }
+        position = end;
+        anchor = position;
+    }
+
+    out = writesequence(out, outend, in + anchor, length - anchor, 0, 0);
+    return (out == NULL) ? 0 : (size_t)(out - (unsigned char*)destination);
+}
+
+// Adds up the 255-terminated bytes that follow a nibble of 15; -1 if the input stops first
+static long readlength(const unsigned char** in, const unsigned char* end, size_t base) {
+    size_t total = base;
+    unsigned char byte;
+    do {
+        if (*in >= end) return -1;
+        byte = *(*in)++;
+        total += byte;
+    } while (byte == 255);
+    return (long)total;
+}
+
+long lzdecompress(const void* source, size_t length, void* destination, size_t capacity) {
+    const unsigned char* in = source;
+    const unsigned char* inend = in + length;
+    unsigned char* out = destination;
+    unsigned char* outend = out + capacity;
+    unsigned char* op = out;
+
+    while (in < inend) {
+        unsigned char token = *in++;
+        long numofliterals = token >> 4;
+        if (numofliterals == 15 && (numofliterals = readlength(&in, inend, 15)) < 0) return -1;
+        if ((size_t)(inend - in) < (size_t)numofliterals || (size_t)(outend - op) < (size_t)numofliterals) return -1;
+        if (numofliterals <= 16 && inend - in >= 16 && outend - op >= 16) {
+            memcpy(op, in, 16);   // Short literal runs: one fixed-size copy, the excess is overwritten later
+        }
+        else {
+            memcpy(op, in, numofliterals);
+        }
+        in += numofliterals;
+        op += numofliterals;
+        if (in == inend) break;   // The block ends on literals
+
+        if (inend - in < 2) return -1;
+        size_t offset = in[0] | ((size_t)in[1] << 8);
+        in += 2;
+        long matchlen = token & 0xF;
+        if (matchlen == 15 && (matchlen = readlength(&in, inend, 15)) < 0) return -1;
+        matchlen += LZMINMATCH;
+        if (offset == 0 || offset > (size_t)(op - out) || (size_t)(outend - op) < (size_t)matchlen) return -1;
+
+        const unsigned char* match = op - offset;
+        if (offset >= 16 && (size_t)(outend - op) >= (size_t)matchlen + 16) {
+            // Sixteen bytes per step; may write up to 15 bytes past the match, overwritten later
+            unsigned char* end = op + matchlen;
+            do {
+                memcpy(op, match, 16);
+                op += 16;
+                match += 16;
+            } while (op < end);
+            op = end;
+        }
+        else if (offset >= 8 && (size_t)(outend - op) >= (size_t)matchlen + 8) {
+            unsigned char* end = op + matchlen;
+            do {
+                memcpy(op, match, 8);
+                op += 8;
+                match += 8;
+            } while (op < end);
+            op = end;
+        }
+        else {
+            // A distance under 8 repeats bytes this very copy writes, and near the end of the
+            // output there is no room to copy past the match: one byte at a time
+            for (long i = 0; i < matchlen; i++) op[i] = match[i];
+            op += matchlen;
+        }
+    }
+    return (long)(op - out);
+}
@@ -0,0 +1,40 @@
+#ifndef COMPRESS_MAKKAWI_H
+#define COMPRESS_MAKKAWI_H
+
+#include <stddef.h>
+
+// LZ77 codec of the .pak blocks, with the LZ4 sequence layout: one byte whose high nibble
+// counts literals and low nibble the match length minus LZMINMATCH (15 means more bytes
+// follow, each added until one is below 255), then the literals, then the match distance
+// on two bytes, low byte first. The stream ends with literals and no distance.
+//
+// The chat server compresses history batches with the same layout ("Chat Project/lz.c").
+// This codec is kept on its own since every TP builds alone, without the chat sources, and
+// the two are free to diverge: only this one has levels, hash chains and lazy matching.
+//
+// Levels trade speed for ratio:
+//   1-2  one candidate per hash slot, greedy (level 1 also skips ahead over incompressible data)
+//   3-9  hash chains searched 2^(level-1) deep, with lazy matching from level 5
+
+#define LZMINLEVEL 1
+#define LZMAXLEVEL 9
+#define LZMINMATCH 4
+#define LZMAXOFFSET 65535
+
+// Match finder state, reused from one buffer to the next; one per thread
+typedef struct lzcontext lzcontext;
+
+lzcontext* lzcreate(void);
+void lzfree(lzcontext* context);
+
+// Worst-case compressed size of length bytes
+size_t lzbound(size_t length);
+
+// Returns the compressed size, or 0 if it does not fit in capacity
+size_t lzcompress(lzcontext* context, int level, const void* source, size_t length, void* destination,
+                  size_t capacity);
+
+// Returns the decompressed size, or -1 if the input is corrupted or does not fit in capacity
+long lzdecompress(const void* source, size_t length, void* destination, size_t capacity);
+
+#endif
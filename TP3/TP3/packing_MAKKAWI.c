@@ -1,83 +1,849 @@
+#define _GNU_SOURCE  // copy_file_range
 #include "packing_MAKKAWI.h"
+#include "compress_MAKKAWI.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <direct.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#define MAXFNAMELENGTH 256
+#define UNPACKDIR "unpacked_files"
+#define COPYBUFFERSIZE (1 << 20)   // Fallback copy buffer: memory use does not depend on file sizes
+#define PACKWINDOW 4               // Files prepared ahead of the writer, per worker thread
+#define MINSAVING 32               // A block must shrink by 1/32 to be stored compressed
+#define MAXBACKOFF 64              // Most blocks stored raw untried after incompressible ones
+#define MAXFAILURES 4              // Incompressible blocks before a file that never shrank is stored raw
 
-struct filestruct {
-    char filename[MAXFNAMELENGTH];
-    unsigned int numofbytes;
-};
+// Preparation of one input file by a worker, consumed by the writer in packing order
+enum jobstate { JOBPENDING, JOBREADY, JOBSKIPPED };
 
+typedef struct {
+    enum jobstate state;
+    int fd;                    // Open input, handed over to the writer
+    FILE* packed;              // Compressed contents of a PAKLZ entry (a temporary file), NULL for PAKRAW
+    uint64_t numofbytes;
+    uint64_t storedbytes;
+    enum pakcodec codec;
+    uint32_t checksum;
+    const char* reason;        // Why the file was skipped
+    int error;                 // errno behind the reason, 0 if none
+} packjob;
 
-typedef struct filestruct filtestructtype;
+// Shared by the workers and the writer of filepacking()
+typedef struct {
+    char** names;
+    int numoffiles;
+    int level;                 // Compression level, 0 to store raw
+    const char* tempdir;       // Directory of the archive, where compressed contents are staged
+    packjob* jobs;
+    int next;                  // Next file to hand to a worker
+    int written;               // Files consumed by the writer
+    int window;                // How far next may run ahead of written
+    int stop;                  // Set by the writer on a write error
+    pthread_mutex_t lock;
+    pthread_cond_t ready;      // A job left JOBPENDING
+    pthread_cond_t room;       // written moved, or stop was set
+} packpipeline;
+
+// Shared by the threads of fileunpacking()
+typedef struct {
+    int fd;
+    const direntry* entries;
+    int64_t numofentries;
+    int64_t next;              // Next entry to extract
+    pthread_mutex_t lock;
+} unpackpipeline;
+
+// Per-thread buffers of the block codec
+typedef struct {
+    lzcontext* lz;             // Match finder, packing only
+    unsigned char* raw;        // One block as in the file, PAKBLOCKSIZE bytes
+    unsigned char* packed;     // One block as in the archive, lzbound(PAKBLOCKSIZE) bytes
+} blockbuffers;
+
+// crctable[0] is the classic byte table; crctable[k][i] is the CRC of byte i followed by k zero bytes
+static uint32_t crctable[8][256];
+
+static void buildcrctable(void) {
+    if (crctable[0][1] != 0) return;
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        }
+        crctable[0][i] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 256; i++) {
+            crctable[k][i] = (crctable[k - 1][i] >> 8) ^ crctable[0][crctable[k - 1][i] & 0xFF];
+        }
+    }
+}
+
+// Slicing-by-8 CRC-32, continued from crc (0 for the first block)
+static uint32_t crc32update(uint32_t crc, const void* data, size_t length) {
+    const unsigned char* bytes = data;
+    crc = ~crc;
+    for (; length >= 8; length -= 8, bytes += 8) {
+        uint32_t low, high;
+        memcpy(&low, bytes, 4);   // Little-endian loads, alignment-safe
+        memcpy(&high, bytes + 4, 4);
+        low ^= crc;
+        crc = crctable[7][low & 0xFF] ^ crctable[6][(low >> 8) & 0xFF]
+            ^ crctable[5][(low >> 16) & 0xFF] ^ crctable[4][low >> 24]
+            ^ crctable[3][high & 0xFF] ^ crctable[2][(high >> 8) & 0xFF]
+            ^ crctable[1][(high >> 16) & 0xFF] ^ crctable[0][high >> 24];
+    }
+    for (size_t i = 0; i < length; i++) {
+        crc = crctable[0][(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Writes the whole buffer, retrying short writes
+static int writeall(int fd, const void* buffer, size_t length) {
+    const char* data = buffer;
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Reads exactly length bytes at offset; returns 0, or -1 on error or early end of file
+static int readat(int fd, void* buffer, size_t length, uint64_t offset) {
+    char* data = buffer;
+    while (length > 0) {
+        ssize_t got = pread(fd, data, length, (off_t)offset);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (got == 0) {
+            errno = EIO;
+            return -1;
+        }
+        data += got;
+        offset += got;
+        length -= got;
+    }
+    return 0;
+}
+
+// Copies length bytes from offset in in to the current position of out. Positioned reads
+// leave the position of in alone, so threads may share it.
+// copy_file_range() lets the kernel move the data (or clone it on filesystems that can);
+// a fixed buffer is used when it is not supported, e.g. across filesystems.
+static int copybytes(int in, uint64_t offset, int out, uint64_t length) {
+    off_t position = (off_t)offset;
+    while (length > 0) {
+        ssize_t copied = copy_file_range(in, &position, out, NULL, length, 0);
+        if (copied < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP) break;
+            return -1;
+        }
+        if (copied == 0) {
+            errno = EIO;   // The input ended before its announced size
+            return -1;
+        }
+        length -= copied;
+    }
+    if (length == 0) return 0;
+
+    char* buffer = malloc(COPYBUFFERSIZE);
+    if (!buffer) return -1;
+    while (length > 0) {
+        size_t chunk = length < COPYBUFFERSIZE ? (size_t)length : COPYBUFFERSIZE;
+        if (readat(in, buffer, chunk, (uint64_t)position) != 0 || writeall(out, buffer, chunk) != 0) {
+            free(buffer);
+            return -1;
+        }
+        position += chunk;
+        length -= chunk;
+    }
+    free(buffer);
+    return 0;
+}
+
+// Continues the CRC-32 in checksum over length bytes at offset
+static int checksumrange(int fd, uint64_t offset, uint64_t length, uint32_t* checksum) {
+    char* buffer = malloc(COPYBUFFERSIZE);
+    if (!buffer) return -1;
+    uint32_t crc = *checksum;
+    while (length > 0) {
+        size_t chunk = length < COPYBUFFERSIZE ? (size_t)length : COPYBUFFERSIZE;
+        if (readat(fd, buffer, chunk, offset) != 0) {
+            free(buffer);
+            return -1;
+        }
+        crc = crc32update(crc, buffer, chunk);
+        offset += chunk;
+        length -= chunk;
+    }
+    free(buffer);
+    *checksum = crc;
+    return 0;
+}
+
+// Name recorded for an input file: leading "/" and "./" are dropped, as tar does
+static const char* storedname(const char* name) {
+    while (1) {
+        if (name[0] == '/') name++;
+        else if (name[0] == '.' && name[1] == '/') name += 2;
+        else return name;
+    }
+}
+
+// Tells whether an entry name stays inside UNPACKDIR: relative, and no component empty,
+// "." or ".."
+static int safename(const char* name) {
+    if (name[0] == '\0' || name[0] == '/') return 0;
+    while (*name) {
+        const char* slash = strchr(name, '/');
+        size_t length = slash ? (size_t)(slash - name) : strlen(name);
+        if (length == 0 || (length == 1 && name[0] == '.') || (length == 2 && name[0] == '.' && name[1] == '.')) {
+            return 0;
+        }
+        name += length;
+        if (*name == '/' && *++name == '\0') return 0;   // Trailing slash: a directory, not a file
+    }
+    return 1;
+}
+
+// Creates the directories leading to path (relative, checked by safename()), as needed
+static int makeparents(const char* path) {
+    char parent[MAXFNAMELENGTH + 20];
+    snprintf(parent, sizeof(parent), "%s", path);
+    for (char* slash = strchr(parent, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(parent, 0755) != 0 && errno != EEXIST) return -1;
+        *slash = '/';
+    }
+    return 0;
+}
+
+static int initbuffers(blockbuffers* b, int packing) {
+    b->lz = packing ? lzcreate() : NULL;
+    b->raw = malloc(PAKBLOCKSIZE);
+    b->packed = malloc(lzbound(PAKBLOCKSIZE));
+    if ((packing && !b->lz) || !b->raw || !b->packed) {
+        lzfree(b->lz);
+        free(b->raw);
+        free(b->packed);
+        return -1;
+    }
+    return 0;
+}
+
+static void freebuffers(blockbuffers* b) {
+    lzfree(b->lz);
+    free(b->raw);
+    free(b->packed);
+}
+
+// Checks the header and footer of an archive and loads its central directory.
+// Returns the number of entries, or -1 with a message printed.
+static int64_t readdirectory(int fd, const char* packedfilename, direntry** entries) {
+    archiveheader header;
+    archivefooter footer;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(header) + sizeof(footer)
+        || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || pread(fd, &footer, sizeof(footer), st.st_size - sizeof(footer)) != sizeof(footer)
+        || memcmp(header.magic, PAKMAGIC, sizeof(header.magic)) != 0 || header.version != PAKVERSION
+        || memcmp(footer.magic, PAKMAGIC, sizeof(footer.magic)) != 0 || footer.version != PAKVERSION) {
+        fprintf(stderr, "Not a packed file, or an unsupported version: %s\n", packedfilename);
+        return -1;
+    }
+
+    // The directory must sit between the first entry and the footer
+    uint64_t end = (uint64_t)st.st_size - sizeof(footer);
+    if (footer.directoryoffset < sizeof(header) || footer.directoryoffset > end
+        || footer.numofentries != (end - footer.directoryoffset) / sizeof(direntry)
+        || (end - footer.directoryoffset) % sizeof(direntry) != 0) {
+        fprintf(stderr, "Corrupted central directory: %s\n", packedfilename);
+        return -1;
+    }
+
+    size_t size = footer.numofentries * sizeof(direntry);
+    *entries = malloc(size ? size : 1);
+    if (!*entries) {
+        perror("Error reading central directory");
+        return -1;
+    }
+    if (readat(fd, *entries, size, footer.directoryoffset) != 0) {
+        fprintf(stderr, "Error reading central directory: %s\n", packedfilename);
+        free(*entries);
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < footer.numofentries; i++) {
+        direntry* e = &(*entries)[i];
+        e->filename[MAXFNAMELENGTH - 1] = '\0';
+        if (e->offset < sizeof(header) || e->offset > footer.directoryoffset
+            || e->storedbytes > footer.directoryoffset - e->offset
+            || (e->codec == PAKRAW && e->storedbytes != e->numofbytes)
+            || (e->codec != PAKRAW && e->codec != PAKLZ)) {
+            fprintf(stderr, "Corrupted central directory entry %llu: %s\n", (unsigned long long)i, packedfilename);
+            free(*entries);
+            return -1;
+        }
+        // Nothing may be written outside UNPACKDIR, whatever the archive holds
+        if (!safename(e->filename)) {
+            fprintf(stderr, "Unsafe entry name %s in %s\n", e->filename, packedfilename);
+            free(*entries);
+            return -1;
+        }
+    }
+    return (int64_t)footer.numofentries;
+}
+
+// Decompresses the blocks of a PAKLZ entry to out, checksumming what is written.
+// Returns 0, -1 on an I/O error, -2 if the entry is corrupted.
+static int decompressentry(int in, const direntry* e, int out, blockbuffers* b, uint32_t* checksum) {
+    uint64_t position = e->offset;
+    uint64_t end = e->offset + e->storedbytes;
+    uint64_t remaining = e->numofbytes;
+    while (remaining > 0) {
+        size_t chunk = remaining < PAKBLOCKSIZE ? (size_t)remaining : PAKBLOCKSIZE;
+        uint32_t blockheader;
+        if (end - position < sizeof(blockheader)) return -2;
+        if (readat(in, &blockheader, sizeof(blockheader), position) != 0) return -1;
+        position += sizeof(blockheader);
+
+        size_t stored = blockheader & ~PAKBLOCKRAW;
+        if (stored > end - position) return -2;
+        if (blockheader & PAKBLOCKRAW) {
+            if (stored != chunk) return -2;
+            if (readat(in, b->raw, chunk, position) != 0) return -1;
+        }
+        else {
+            if (stored > lzbound(PAKBLOCKSIZE)) return -2;
+            if (readat(in, b->packed, stored, position) != 0) return -1;
+            if (lzdecompress(b->packed, stored, b->raw, chunk) != (long)chunk) return -2;
+        }
+        *checksum = crc32update(*checksum, b->raw, chunk);
+        if (writeall(out, b->raw, chunk) != 0) return -1;
+        position += stored;
+        remaining -= chunk;
+    }
+    return position == end ? 0 : -2;
+}
+
+// Writes one entry of the archive to UNPACKDIR and checks its checksum
+static int extractentry(int in, const direntry* e, blockbuffers* b) {
+    char path[MAXFNAMELENGTH + 20];
+    snprintf(path, sizeof(path), UNPACKDIR "/%s", e->filename);
+
+    // Entries packed from subdirectories are extracted into the same subdirectories
+    int out = makeparents(path) == 0 ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    if (out < 0) {
+        perror("Error creating output file");
+        return -1;
+    }
+    uint32_t checksum = 0;
+    int result;
+    if (e->codec == PAKLZ) {
+        result = decompressentry(in, e, out, b, &checksum);
+    }
+    else {
+        result = (copybytes(in, e->offset, out, e->numofbytes) != 0
+                  || checksumrange(in, e->offset, e->numofbytes, &checksum) != 0) ? -1 : 0;
+    }
+    if (result == -1) {
+        perror("Error extracting file");
+    }
+    close(out);
+    if (result == -2 || (result == 0 && checksum != e->checksum)) {
+        fprintf(stderr, "%s, removed: %s\n", result == -2 ? "Corrupted entry" : "Checksum mismatch", path);
+        unlink(path);
+        return -1;
+    }
+    return result;
+}
+
+// Opens an unnamed temporary file in directory. Staged next to the archive rather than in
+// /tmp, compressed contents never fill a tmpfs (memory), and copy_file_range() can move them
+// within one filesystem.
+static FILE* tempfilein(const char* directory) {
+    int fd = open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        // No O_TMPFILE on this filesystem: a named file, removed at once
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/.packXXXXXX", directory);
+        fd = mkostemp(path, O_CLOEXEC);
+        if (fd < 0) return NULL;
+        unlink(path);
+    }
+    FILE* file = fdopen(fd, "w+");
+    if (!file) close(fd);
+    return file;
+}
+
+// Compresses a file block by block into a temporary file, checksumming it on the way.
+// Sets *done to the bytes checksummed; the entry stays PAKRAW if the data does not shrink.
+static int compressfile(int in, packjob* job, int level, const char* tempdir, blockbuffers* b, uint64_t* done) {
+    FILE* packed = tempfilein(tempdir);
+    if (!packed) return -1;
+    uint64_t stored = 0;
+    int backoff = 0;               // Blocks to store raw without trying, after incompressible ones
+    int skip = 0;
+    int failures = 0;
+    int shrunk = 0;
+    *done = 0;
+    while (*done < job->numofbytes) {
+        uint64_t remaining = job->numofbytes - *done;
+        size_t chunk = remaining < PAKBLOCKSIZE ? (size_t)remaining : PAKBLOCKSIZE;
+        if (readat(in, b->raw, chunk, *done) != 0) {
+            fclose(packed);
+            return -1;
+        }
+        job->checksum = crc32update(job->checksum, b->raw, chunk);
+        *done += chunk;
+
+        // Incompressible data (already compressed, encrypted) is detected block by block;
+        // the blocks after it are stored raw untried, twice as many each time it repeats
+        size_t size = 0;
+        if (skip > 0) {
+            skip--;
+        }
+        else {
+            size = lzcompress(b->lz, level, b->raw, chunk, b->packed, lzbound(PAKBLOCKSIZE));
+            if (size == 0 || size > chunk - chunk / MINSAVING) {
+                if (++failures == MAXFAILURES && !shrunk) {
+                    fclose(packed);   // Not worth a temporary copy: the rest is only checksummed
+                    return 0;
+                }
+                size = 0;
+                skip = backoff;
+                backoff = backoff == 0 ? 1 : (backoff * 2 > MAXBACKOFF ? MAXBACKOFF : backoff * 2);
+            }
+            else {
+                backoff = 0;
+                shrunk = 1;
+            }
+        }
+        uint32_t blockheader = (uint32_t)size;
+        const unsigned char* data = b->packed;
+        if (size == 0) {
+            blockheader = PAKBLOCKRAW | (uint32_t)chunk;
+            data = b->raw;
+            size = chunk;
+        }
+        if (fwrite(&blockheader, sizeof(blockheader), 1, packed) != 1 || fwrite(data, 1, size, packed) != size) {
+            fclose(packed);
+            return -1;
+        }
+        stored += sizeof(blockheader) + size;
+    }
+    if (fflush(packed) != 0) {
+        fclose(packed);
+        return -1;
+    }
+    if (stored >= job->numofbytes) {
+        fclose(packed);   // No gain over the whole file
+        return 0;
+    }
+    job->packed = packed;
+    job->codec = PAKLZ;
+    job->storedbytes = stored;
+    return 0;
+}
+
+// Opens, checks, checksums and compresses one input file
+static void preparejob(const char* name, packjob* job, int level, const char* tempdir, blockbuffers* b) {
+    job->fd = -1;
+    if (strlen(storedname(name)) >= MAXFNAMELENGTH) {
+        job->reason = "File name too long, skipped";
+        job->state = JOBSKIPPED;
+        return;
+    }
+    if (!safename(storedname(name))) {
+        job->reason = "File name with \"..\" or an empty component, skipped";
+        job->state = JOBSKIPPED;
+        return;
+    }
+    int in = open(name, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        job->reason = "Error opening input file";
+        job->error = errno;
+        job->state = JOBSKIPPED;
+        return;
+    }
+    struct stat st;
+    if (fstat(in, &st) != 0 || !S_ISREG(st.st_mode)) {
+        job->reason = "Not a regular file, skipped";
+        job->state = JOBSKIPPED;
+        close(in);
+        return;
+    }
+    job->numofbytes = (uint64_t)st.st_size;
+    job->storedbytes = job->numofbytes;
+    job->codec = PAKRAW;
+
+    // Reading the file here also brings it into the page cache for the writer's copy
+    uint64_t done = 0;
+    if ((level > 0 && job->numofbytes > 0 && compressfile(in, job, level, tempdir, b, &done) != 0)
+        || checksumrange(in, done, job->numofbytes - done, &job->checksum) != 0) {
+        job->reason = "Error reading input file";
+        job->error = errno;
+        job->state = JOBSKIPPED;
+        close(in);
+        return;
+    }
+    job->fd = in;
+    job->state = JOBREADY;
+}
+
+// Worker thread: prepares files in order of their index, at most window files ahead of the writer
+static void* packworker(void* arg) {
+    packpipeline* p = arg;
+    blockbuffers b;
+    int level = p->level;
+    if (level > 0 && initbuffers(&b, 1) != 0) {
+        level = 0;   // Out of memory: this worker stores its files raw
+    }
+    while (1) {
+        pthread_mutex_lock(&p->lock);
+        while (!p->stop && p->next < p->numoffiles && p->next >= p->written + p->window) {
+            pthread_cond_wait(&p->room, &p->lock);
+        }
+        if (p->stop || p->next >= p->numoffiles) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        int i = p->next++;
+        pthread_mutex_unlock(&p->lock);
+
+        packjob job;
+        memset(&job, 0, sizeof(job));
+        preparejob(p->names[i], &job, level, p->tempdir, &b);
+
+        pthread_mutex_lock(&p->lock);
+        p->jobs[i] = job;
+        pthread_cond_broadcast(&p->ready);
+        pthread_mutex_unlock(&p->lock);
+    }
+    if (level > 0) freebuffers(&b);
+    return NULL;
+}
+
+// Stops the workers: they wait for room under the lock, so stop is set under it too
+static void stoppipeline(packpipeline* p) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->room);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Releases what a prepared job holds
+static void releasejob(packjob* job) {
+    if (job->fd >= 0) close(job->fd);
+    if (job->packed) fclose(job->packed);
+    job->fd = -1;
+    job->packed = NULL;
+}
 
 void filepacking(const char* packedfilename, int numoffiles, char** arrayofnames) {
-    FILE* out = fopen(packedfilename, "wb");
-    if (!out) {
+    filepackinglevel(packedfilename, numoffiles, arrayofnames, PAKDEFAULTLEVEL);
+}
+
+void filepackinglevel(const char* packedfilename, int numoffiles, char** arrayofnames, int level) {
+    buildcrctable();
+    if (numoffiles < 0) numoffiles = 0;
+    if (level < 0) level = 0;
+    if (level > LZMAXLEVEL) level = LZMAXLEVEL;
+    direntry* entries = calloc(numoffiles > 0 ? numoffiles : 1, sizeof(direntry));
+    packjob* jobs = calloc(numoffiles > 0 ? numoffiles : 1, sizeof(packjob));
+    if (!entries || !jobs) {
+        perror("Error packing files");
+        free(entries);
+        free(jobs);
+        return;
+    }
+    int out = open(packedfilename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) {
         perror("Error opening packed file for writing");
+        free(entries);
+        free(jobs);
         return;
     }
+    struct stat outst;
+    int regular = fstat(out, &outst) == 0 && S_ISREG(outst.st_mode);   // Only a file is removed on failure
 
-    for (int i = 0; i < numoffiles; i++) {
-        FILE* in = fopen(arrayofnames[i], "rb");
-        if (!in) {
-            perror("Error opening input file");
-            continue;
+    archiveheader header;
+    memcpy(header.magic, PAKMAGIC, sizeof(header.magic));
+    header.version = PAKVERSION;
+    if (writeall(out, &header, sizeof(header)) != 0) {
+        perror("Error writing packed file");
+        close(out);
+        free(entries);
+        free(jobs);
+        return;
+    }
+
+    // Workers open, checksum and compress the inputs concurrently; this thread writes them
+    // in order, so the archive is the same whatever the number of threads
+    char tempdir[PATH_MAX];
+    snprintf(tempdir, sizeof(tempdir), "%s", packedfilename);
+    char* slash = strrchr(tempdir, '/');
+    if (!slash) strcpy(tempdir, ".");
+    else slash[slash == tempdir ? 1 : 0] = '\0';
+
+    packpipeline p;
+    memset(&p, 0, sizeof(p));
+    p.names = arrayofnames;
+    p.numoffiles = numoffiles;
+    p.level = level;
+    p.tempdir = tempdir;
+    p.jobs = jobs;
+    int numofthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (numofthreads > numoffiles) numofthreads = numoffiles;
+    if (numofthreads < 1) numofthreads = 1;
+    p.window = PACKWINDOW * numofthreads;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.ready, NULL);
+    pthread_cond_init(&p.room, NULL);
+
+    pthread_t* threads = malloc(numofthreads * sizeof(pthread_t));
+    int started = 0;
+    while (threads && started < numofthreads && pthread_create(&threads[started], NULL, packworker, &p) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        fprintf(stderr, "Error starting packing threads\n");
+        stoppipeline(&p);
+    }
+
+    uint64_t offset = sizeof(header);
+    int numofentries = 0;
+    for (int i = 0; i < numoffiles && !p.stop; i++) {
+        pthread_mutex_lock(&p.lock);
+        while (jobs[i].state == JOBPENDING) {
+            pthread_cond_wait(&p.ready, &p.lock);
         }
+        pthread_mutex_unlock(&p.lock);
 
-        fseek(in, 0, SEEK_END);
-        unsigned int size = ftell(in);
-        fseek(in, 0, SEEK_SET);
+        packjob* job = &jobs[i];
+        if (job->state == JOBSKIPPED) {
+            if (job->error != 0) {
+                fprintf(stderr, "%s: %s: %s\n", job->reason, arrayofnames[i], strerror(job->error));
+            }
+            else {
+                fprintf(stderr, "%s: %s\n", job->reason, arrayofnames[i]);
+            }
+        }
+        else {
+            filestruct f;
+            memset(&f, 0, sizeof(f));
+            strcpy(f.filename, storedname(arrayofnames[i]));
+            f.numofbytes = job->numofbytes;
+            f.storedbytes = job->storedbytes;
+            f.codec = job->codec;
+            f.checksum = job->checksum;
 
-        filtestructtype f;
-        strncpy_s(f.filename, MAXFNAMELENGTH, arrayofnames[i], _TRUNCATE);
-        f.numofbytes = size;
+            direntry* e = &entries[numofentries];
+            memcpy(e->filename, f.filename, MAXFNAMELENGTH);
+            e->offset = offset + sizeof(f);
+            e->numofbytes = f.numofbytes;
+            e->storedbytes = f.storedbytes;
+            e->checksum = f.checksum;
+            e->codec = f.codec;
 
-        fwrite(&f, sizeof(filtestructtype), 1, out);
+            // The contents are streamed: nothing is held in memory but the copy buffer
+            int source = job->packed ? fileno(job->packed) : job->fd;
+            if (writeall(out, &f, sizeof(f)) != 0 || copybytes(source, 0, out, f.storedbytes) != 0) {
+                perror("Error writing packed file");
+                stoppipeline(&p);
+            }
+            else {
+                offset = e->offset + e->storedbytes;
+                numofentries++;
+            }
+            releasejob(job);
+        }
 
-        char* buffer = malloc(size);
-        fread(buffer, 1, size, in);
-        fwrite(buffer, 1, size, out);
+        pthread_mutex_lock(&p.lock);
+        p.written = i + 1;
+        pthread_cond_broadcast(&p.room);
+        pthread_mutex_unlock(&p.lock);
+    }
 
-        free(buffer);
-        fclose(in);
+    int failed = p.stop;   // Only this thread sets it
+    stoppipeline(&p);
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    for (int i = 0; i < numoffiles; i++) {
+        if (jobs[i].state == JOBREADY) releasejob(&jobs[i]);  // Prepared after a failure
     }
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.ready);
+    pthread_cond_destroy(&p.room);
 
-    fclose(out);
+    // Central directory, then the footer pointing to it
+    archivefooter footer;
+    footer.directoryoffset = offset;
+    footer.numofentries = numofentries;
+    memcpy(footer.magic, PAKMAGIC, sizeof(footer.magic));
+    footer.version = PAKVERSION;
+    if (!failed && (writeall(out, entries, numofentries * sizeof(direntry)) != 0
+                    || writeall(out, &footer, sizeof(footer)) != 0)) {
+        perror("Error writing central directory");
+        failed = 1;
+    }
+    if (close(out) != 0 && !failed) {
+        perror("Error writing packed file");
+        failed = 1;
+    }
+
+    // A truncated archive has no footer and could not be read back: do not leave it behind
+    if (failed && regular) {
+        unlink(packedfilename);
+        fprintf(stderr, "Packing failed, %s removed\n", packedfilename);
+    }
+    else if (failed) {
+        fprintf(stderr, "Packing failed: %s\n", packedfilename);
+    }
+    free(entries);
+    free(jobs);
+}
+
+// Unpacking thread: extracts entries until none is left
+static void* unpackworker(void* arg) {
+    unpackpipeline* p = arg;
+    blockbuffers b;
+    if (initbuffers(&b, 0) != 0) {
+        perror("Error unpacking files");
+        return NULL;
+    }
+    while (1) {
+        pthread_mutex_lock(&p->lock);
+        int64_t i = p->next++;
+        pthread_mutex_unlock(&p->lock);
+        if (i >= p->numofentries) break;
+        extractentry(p->fd, &p->entries[i], &b);
+    }
+    freebuffers(&b);
+    return NULL;
 }
 
 void fileunpacking(const char* packedfilename) {
-    FILE* in = fopen(packedfilename, "rb");
-    if (!in) {
+    buildcrctable();
+    int in = open(packedfilename, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
         perror("Error opening packed file for reading");
         return;
     }
 
-    _mkdir("unpackedfiles");
+    direntry* entries;
+    int64_t numofentries = readdirectory(in, packedfilename, &entries);
+    if (numofentries < 0) {
+        close(in);
+        return;
+    }
+    if (mkdir(UNPACKDIR, 0755) != 0 && errno != EEXIST) {
+        perror("Error creating " UNPACKDIR);
+        free(entries);
+        close(in);
+        return;
+    }
+
+    // Entries are independent: each thread takes the next one, reading with pread()
+    unpackpipeline p;
+    p.fd = in;
+    p.entries = entries;
+    p.numofentries = numofentries;
+    p.next = 0;
+    pthread_mutex_init(&p.lock, NULL);
+    int numofthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (numofthreads > numofentries) numofthreads = (int)numofentries;
+    if (numofthreads < 1) numofthreads = 1;
+    pthread_t* threads = malloc(numofthreads * sizeof(pthread_t));
+    int started = 0;
+    while (threads && started < numofthreads && pthread_create(&threads[started], NULL, unpackworker, &p) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        unpackworker(&p);   // No thread could be started: extract on this one
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&p.lock);
+
+    free(entries);
+    close(in);
+}
 
-    while (!feof(in)) {
-        filtestructtype f;
-        if (fread(&f, sizeof(filtestructtype), 1, in) != 1) break;
+void fileextracting(const char* packedfilename, const char* name) {
+    buildcrctable();
+    int in = open(packedfilename, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        perror("Error opening packed file for reading");
+        return;
+    }
 
-        char path[MAXFNAMELENGTH + 20];
-        snprintf(path, sizeof(path), "unpacked_files/%s", f.filename);
+    // Only the footer, the directory and the entry itself are read
+    direntry* entries;
+    int64_t numofentries = readdirectory(in, packedfilename, &entries);
+    if (numofentries < 0) {
+        close(in);
+        return;
+    }
+    int64_t found = -1;
+    for (int64_t i = 0; i < numofentries && found < 0; i++) {
+        if (strcmp(entries[i].filename, name) == 0) found = i;
+    }
 
-        FILE* out = fopen(path, "wb");
-        if (!out) {
-            perror("Error creating output file");
-            break;
-        }
+    blockbuffers b;
+    if (found < 0) {
+        fprintf(stderr, "No entry named %s in %s\n", name, packedfilename);
+    }
+    else if (mkdir(UNPACKDIR, 0755) != 0 && errno != EEXIST) {
+        perror("Error creating " UNPACKDIR);
+    }
+    else if (initbuffers(&b, 0) != 0) {
+        perror("Error extracting file");
+    }
+    else {
+        extractentry(in, &entries[found], &b);
+        freebuffers(&b);
+    }
 
-        char* buffer = malloc(f.numofbytes);
-        fread(buffer, 1, f.numofbytes, in);
-        fwrite(buffer, 1, f.numofbytes, out);
+    free(entries);
+    close(in);
+}
 
-        free(buffer);
-        fclose(out);
+void filelisting(const char* packedfilename) {
+    int in = open(packedfilename, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        perror("Error opening packed file for reading");
+        return;
     }
 
-    fclose(in);
+    direntry* entries;
+    int64_t numofentries = readdirectory(in, packedfilename, &entries);
+    if (numofentries >= 0) {
+        printf("%14s  %14s  %5s  %8s  %s\n", "size", "stored", "codec", "crc32", "name");
+        for (int64_t i = 0; i < numofentries; i++) {
+            printf("%14llu  %14llu  %5s  %08x  %s\n", (unsigned long long)entries[i].numofbytes,
+                   (unsigned long long)entries[i].storedbytes, entries[i].codec == PAKLZ ? "lz" : "raw",
+                   entries[i].checksum, entries[i].filename);
+        }
+        free(entries);
+    }
+    close(in);
 }
@@ -1,14 +1,77 @@
 #ifndef PACKING_MAKKAWI_H
 #define PACKING_MAKKAWI_H
 
+#include <stdint.h>
+
 #define MAXFNAMELENGTH 256
+#define PAKMAGIC "MPAK"        // First bytes of every archive, repeated in the footer
+#define PAKVERSION 3           // Bumped whenever the layout below changes
+#define PAKBLOCKSIZE (1 << 20) // Compressed entries are cut in blocks of this many bytes
+#define PAKBLOCKRAW 0x80000000u  // Block header flag: the block is stored as is
+#define PAKDEFAULTLEVEL 1      // Compression level of filepacking(), see compress_MAKKAWI.h
+
+// Archive layout:
+//   archiveheader
+//   filestruct + contents, for each file
+//   direntry, for each file (the central directory)
+//   archivefooter
+// The footer has a fixed size at the end of the file, so a reader finds the directory
+// with one seek and can then go straight to any entry.
+//
+// The contents of a PAKLZ entry are blocks of PAKBLOCKSIZE bytes (the last one shorter),
+// each a uint32_t header followed by the block: the header holds the stored length, with
+// PAKBLOCKRAW set when the block did not compress and is kept as is.
 
+// How the contents of an entry are stored
+enum pakcodec { PAKRAW = 0, PAKLZ = 1 };
+
+// Written once at the start of the archive
+typedef struct {
+    char magic[4];
+    uint32_t version;
+} archiveheader;
+
+// Written before the contents of each file; sizes are 64-bit so files of 4 GB and more fit
 typedef struct {
     char filename[MAXFNAMELENGTH];
-    unsigned int numofbytes;
+    uint64_t numofbytes;
+    uint64_t storedbytes;      // Size in the archive, after compression
+    uint32_t codec;            // enum pakcodec
+    uint32_t checksum;         // CRC-32 of the original contents
 } filestruct;
 
+// One central directory entry per file, in packing order
+typedef struct {
+    char filename[MAXFNAMELENGTH];
+    uint64_t offset;           // Position of the contents in the archive
+    uint64_t numofbytes;
+    uint64_t storedbytes;      // Size in the archive, after compression
+    uint32_t checksum;         // CRC-32 of the original contents
+    uint32_t codec;            // enum pakcodec
+} direntry;
+
+// Last bytes of the archive
+typedef struct {
+    uint64_t directoryoffset;
+    uint64_t numofentries;
+    char magic[4];
+    uint32_t version;
+} archivefooter;
+
+// Packs with PAKDEFAULTLEVEL
 void filepacking(const char* packedfilename, int numoffiles, char** arrayofnames);
+
+// Packs with a compression level from LZMINLEVEL (fastest) to LZMAXLEVEL (smallest), 0 to
+// store everything raw. Each entry that does not shrink is stored raw whatever the level.
+void filepackinglevel(const char* packedfilename, int numoffiles, char** arrayofnames, int level);
+
+// Extracts every entry, on one thread per CPU
 void fileunpacking(const char* packedfilename);
 
+// Extracts the single entry called name, found through the central directory
+void fileextracting(const char* packedfilename, const char* name);
+
+// Prints the central directory without reading any contents
+void filelisting(const char* packedfilename);
+
 #endif